@@ -0,0 +1,901 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+// Microbenchmark each file system operation that bench/microbench.py covers
+// and report its latency distribution, throughput, BPRAM bytes written, and,
+// with libbpfs, data TLB misses.
+// Runs against a mounted file system or directly against libbpfs.
+
+#define _GNU_SOURCE
+
+#include "libbpfs.h"
+#include "histogram.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// The largest write that FUSE makes atomically
+#define MAX_WRITE (128 * 1024)
+
+// Directory, relative to the file system root, that the benchmarks run in
+#define BENCH_DIR "bpfsbench"
+
+// The most mounts that -M may ask for
+#define MAX_MODES 16
+
+// What benchmarks write, and what they write to set up a file that they
+// then overwrite. They differ so that each overwrite changes every byte.
+static char data[MAX_WRITE];
+static char setup_data[MAX_WRITE];
+
+
+//
+// backends
+
+// File system operations on paths relative to BENCH_DIR.
+// Each returns 0 (or a count) on success and a negative errno on failure.
+struct backend
+{
+	int (*create)(const char *path);
+	int (*mkdir)(const char *path);
+	int (*symlink)(const char *link, const char *path);
+	int (*link)(const char *src, const char *dst);
+	int (*unlink)(const char *path);
+	int (*rmdir)(const char *path);
+	int (*rename)(const char *src, const char *dst);
+	int (*chmod)(const char *path, mode_t mode);
+	int (*truncate)(const char *path, off_t size);
+	// Write size bytes of buf at off (at EOF if off < 0), MAX_WRITE at a
+	// time
+	int (*write)(const char *path, off_t off, size_t size, const char *buf);
+	int (*read)(const char *path, off_t off, size_t size);
+	// Return the number of entries
+	int (*readdir)(const char *path);
+	// Set *bytes to the number of bytes written to BPRAM so far
+	int (*written)(uint64_t *bytes);
+};
+
+static uint64_t stats_written(const struct bpfs_stats *stats)
+{
+	uint64_t bytes = 0;
+	unsigned i;
+	for (i = 0; i < BPFS_STATS_NOPS; i++)
+		bytes += stats->op[i].store_bytes;
+	return bytes;
+}
+
+// mount: system calls on a mounted file system
+
+static char mnt_dir[PATH_MAX];
+
+static const char* mnt_path(const char *path, char *buf)
+{
+	xassert(snprintf(buf, PATH_MAX, "%s/" BENCH_DIR "/%s", mnt_dir, path)
+	        < PATH_MAX);
+	return buf;
+}
+
+#define MNT_PATH(path) mnt_path(path, (char[PATH_MAX]) {0})
+
+#define MNT_SYSCALL(call) ((call) < 0 ? -errno : 0)
+
+static int mnt_create(const char *path)
+{
+	int fd = open(MNT_PATH(path), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return -errno;
+	return MNT_SYSCALL(close(fd));
+}
+
+static int mnt_mkdir(const char *path)
+{
+	return MNT_SYSCALL(mkdir(MNT_PATH(path), 0755));
+}
+
+static int mnt_symlink(const char *link, const char *path)
+{
+	return MNT_SYSCALL(symlink(link, MNT_PATH(path)));
+}
+
+static int mnt_link(const char *src, const char *dst)
+{
+	return MNT_SYSCALL(link(MNT_PATH(src), MNT_PATH(dst)));
+}
+
+static int mnt_unlink(const char *path)
+{
+	return MNT_SYSCALL(unlink(MNT_PATH(path)));
+}
+
+static int mnt_rmdir(const char *path)
+{
+	return MNT_SYSCALL(rmdir(MNT_PATH(path)));
+}
+
+static int mnt_rename(const char *src, const char *dst)
+{
+	return MNT_SYSCALL(rename(MNT_PATH(src), MNT_PATH(dst)));
+}
+
+static int mnt_chmod(const char *path, mode_t mode)
+{
+	return MNT_SYSCALL(chmod(MNT_PATH(path), mode));
+}
+
+static int mnt_truncate(const char *path, off_t size)
+{
+	return MNT_SYSCALL(truncate(MNT_PATH(path), size));
+}
+
+static int mnt_write(const char *path, off_t off, size_t size,
+                     const char *buf)
+{
+	int fd = open(MNT_PATH(path), O_WRONLY | (off < 0 ? O_APPEND : 0));
+	int r = 0;
+	if (fd < 0)
+		return -errno;
+	while (size && r >= 0)
+	{
+		size_t n = size < MAX_WRITE ? size : MAX_WRITE;
+		if (off < 0)
+			r = write(fd, buf, n);
+		else
+			r = pwrite(fd, buf, n, off);
+		if (r < 0)
+			r = -errno;
+		else if (off >= 0)
+			off += n;
+		size -= n;
+	}
+	if (close(fd) < 0 && r >= 0)
+		r = -errno;
+	return r < 0 ? r : 0;
+}
+
+static int mnt_read(const char *path, off_t off, size_t size)
+{
+	char buf[MAX_WRITE];
+	int fd = open(MNT_PATH(path), O_RDONLY);
+	int r;
+	if (fd < 0)
+		return -errno;
+	xassert(size <= sizeof(buf));
+	r = pread(fd, buf, size, off);
+	if (r < 0)
+		r = -errno;
+	if (close(fd) < 0 && r >= 0)
+		r = -errno;
+	return r;
+}
+
+static int mnt_readdir(const char *path)
+{
+	DIR *dir = opendir(MNT_PATH(path));
+	int n = 0;
+	if (!dir)
+		return -errno;
+	while (readdir(dir))
+		n++;
+	closedir(dir);
+	return n;
+}
+
+static int mnt_written(uint64_t *bytes)
+{
+	struct bpfs_stats stats;
+	int fd = open(mnt_dir, O_RDONLY);
+	int r;
+	if (fd < 0)
+		return -errno;
+	r = MNT_SYSCALL(ioctl(fd, BPFS_IOC_STATS, &stats));
+	close(fd);
+	if (r >= 0)
+		*bytes = stats_written(&stats);
+	return r;
+}
+
+static const struct backend mnt_backend =
+{
+	mnt_create, mnt_mkdir, mnt_symlink, mnt_link, mnt_unlink, mnt_rmdir,
+	mnt_rename, mnt_chmod, mnt_truncate, mnt_write, mnt_read, mnt_readdir,
+	mnt_written
+};
+
+// core: libbpfs calls, in process
+
+static uint64_t core_dir_ino;
+
+// Find the directory that holds path and return the entry's name in it
+static int core_parent(const char *path, uint64_t *parent_ino,
+                       const char **name)
+{
+	const char *slash;
+	*parent_ino = core_dir_ino;
+	while ((slash = strchr(path, '/')))
+	{
+		char component[NAME_MAX + 1];
+		struct bpfs_entry e;
+		int r;
+		xassert(slash - path <= NAME_MAX);
+		memcpy(component, path, slash - path);
+		component[slash - path] = 0;
+		r = bpfs_lookup(*parent_ino, component, &e);
+		if (r < 0)
+			return r;
+		*parent_ino = e.ino;
+		path = slash + 1;
+	}
+	*name = path;
+	return 0;
+}
+
+static int core_ino(const char *path, uint64_t *ino)
+{
+	struct bpfs_entry e;
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	if (!strcmp(name, "."))
+	{
+		*ino = parent_ino;
+		return 0;
+	}
+	r = bpfs_lookup(parent_ino, name, &e);
+	if (r < 0)
+		return r;
+	*ino = e.ino;
+	return 0;
+}
+
+static int core_create(const char *path)
+{
+	struct bpfs_entry e;
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	return bpfs_create(parent_ino, name, S_IFREG | 0644, getuid(), getgid(),
+	                   &e);
+}
+
+static int core_mkdir(const char *path)
+{
+	struct bpfs_entry e;
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	return bpfs_mkdir(parent_ino, name, 0755, getuid(), getgid(), &e);
+}
+
+static int core_symlink(const char *link, const char *path)
+{
+	struct bpfs_entry e;
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	return bpfs_symlink(link, parent_ino, name, getuid(), getgid(), &e);
+}
+
+static int core_link(const char *src, const char *dst)
+{
+	struct bpfs_entry e;
+	uint64_t ino, parent_ino;
+	const char *name;
+	int r;
+	if ((r = core_ino(src, &ino)) < 0)
+		return r;
+	if ((r = core_parent(dst, &parent_ino, &name)) < 0)
+		return r;
+	return bpfs_link(ino, parent_ino, name, &e);
+}
+
+static int core_unlink(const char *path)
+{
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	return bpfs_unlink(parent_ino, name);
+}
+
+static int core_rmdir(const char *path)
+{
+	uint64_t parent_ino;
+	const char *name;
+	int r = core_parent(path, &parent_ino, &name);
+	if (r < 0)
+		return r;
+	return bpfs_rmdir(parent_ino, name);
+}
+
+static int core_rename(const char *src, const char *dst)
+{
+	uint64_t src_parent_ino, dst_parent_ino;
+	const char *src_name, *dst_name;
+	int r;
+	if ((r = core_parent(src, &src_parent_ino, &src_name)) < 0)
+		return r;
+	if ((r = core_parent(dst, &dst_parent_ino, &dst_name)) < 0)
+		return r;
+	return bpfs_rename(src_parent_ino, src_name, dst_parent_ino, dst_name);
+}
+
+static int core_chmod(const char *path, mode_t mode)
+{
+	struct stat attr, stbuf;
+	uint64_t ino;
+	int r = core_ino(path, &ino);
+	if (r < 0)
+		return r;
+	if ((r = bpfs_getattr(ino, &stbuf)) < 0)
+		return r;
+	memset(&attr, 0, sizeof(attr));
+	attr.st_mode = (stbuf.st_mode & S_IFMT) | mode;
+	return bpfs_setattr(ino, &attr, BPFS_SET_ATTR_MODE, &stbuf);
+}
+
+static int core_truncate(const char *path, off_t size)
+{
+	struct stat attr, stbuf;
+	uint64_t ino;
+	int r = core_ino(path, &ino);
+	if (r < 0)
+		return r;
+	memset(&attr, 0, sizeof(attr));
+	attr.st_size = size;
+	return bpfs_setattr(ino, &attr, BPFS_SET_ATTR_SIZE, &stbuf);
+}
+
+static int core_write(const char *path, off_t off, size_t size,
+                      const char *buf)
+{
+	uint64_t ino;
+	int r = core_ino(path, &ino);
+	if (r < 0)
+		return r;
+	if ((r = bpfs_open(ino)) < 0)
+		return r;
+	if (off < 0)
+	{
+		struct stat stbuf;
+		if ((r = bpfs_getattr(ino, &stbuf)) < 0)
+			return r;
+		off = stbuf.st_size;
+	}
+	while (size)
+	{
+		size_t n = size < MAX_WRITE ? size : MAX_WRITE;
+		ssize_t w = bpfs_write(ino, buf, n, off);
+		if (w < 0)
+			return w;
+		off += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int core_read(const char *path, off_t off, size_t size)
+{
+	char buf[MAX_WRITE];
+	uint64_t ino;
+	int r = core_ino(path, &ino);
+	if (r < 0)
+		return r;
+	if ((r = bpfs_open(ino)) < 0)
+		return r;
+	xassert(size <= sizeof(buf));
+	return bpfs_read(ino, buf, size, off);
+}
+
+static int core_readdir_filler(void *user, const char *name, uint64_t ino,
+                               mode_t type, int64_t next_off)
+{
+	++*(int*) user;
+	return 0;
+}
+
+static int core_readdir(const char *path)
+{
+	uint64_t ino;
+	int n = 0;
+	int r = core_ino(path, &ino);
+	if (r < 0)
+		return r;
+	if ((r = bpfs_opendir(ino)) < 0)
+		return r;
+	r = bpfs_readdir(ino, 0, core_readdir_filler, &n);
+	xcall(bpfs_releasedir(ino));
+	return r < 0 ? r : n;
+}
+
+static int core_written(uint64_t *bytes)
+{
+	struct bpfs_stats stats;
+	int r = bpfs_get_stats(&stats);
+	if (r >= 0)
+		*bytes = stats_written(&stats);
+	return r;
+}
+
+static const struct backend core_backend =
+{
+	core_create, core_mkdir, core_symlink, core_link, core_unlink,
+	core_rmdir, core_rename, core_chmod, core_truncate, core_write,
+	core_read, core_readdir, core_written
+};
+
+static const struct backend *be;
+
+
+//
+// dTLB counters
+
+// Data TLB load misses and accesses while benchmark operations run, for the
+// libbpfs backend (the mount backend's file system runs in another process).
+// Counting is per thread and excludes the kernel.
+
+#define DTLB_EVENT(result) \
+	(PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+	 | ((result) << 16))
+
+// The event group's leader (misses) and member (accesses); -1 if unavailable
+static int dtlb_fds[2] = {-1, -1};
+
+static int dtlb_open_event(uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = config;
+	attr.disabled = group_fd < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void dtlb_init(void)
+{
+	dtlb_fds[0] = dtlb_open_event(DTLB_EVENT(PERF_COUNT_HW_CACHE_RESULT_MISS),
+	                              -1);
+	if (dtlb_fds[0] < 0)
+	{
+		printf("dTLB counters unavailable: %s\n", strerror(errno));
+		return;
+	}
+	dtlb_fds[1] = dtlb_open_event(
+		DTLB_EVENT(PERF_COUNT_HW_CACHE_RESULT_ACCESS), dtlb_fds[0]);
+	if (dtlb_fds[1] < 0)
+	{
+		printf("dTLB access counter unavailable: %s\n", strerror(errno));
+		xsyscall(close(dtlb_fds[0]));
+		dtlb_fds[0] = -1;
+	}
+}
+
+static bool dtlb_available(void)
+{
+	return dtlb_fds[0] >= 0;
+}
+
+static void dtlb_reset(void)
+{
+	if (dtlb_available())
+		xsyscall(ioctl(dtlb_fds[0], PERF_EVENT_IOC_RESET,
+		               PERF_IOC_FLAG_GROUP));
+}
+
+static void dtlb_enable(bool enable)
+{
+	if (dtlb_available())
+		xsyscall(ioctl(dtlb_fds[0],
+		               enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+		               PERF_IOC_FLAG_GROUP));
+}
+
+// Read the misses and accesses counted since dtlb_reset()
+static int dtlb_read(uint64_t *misses, uint64_t *accesses)
+{
+	uint64_t values[3]; // nr, misses, accesses
+
+	if (!dtlb_available())
+		return -ENODEV;
+	if (read(dtlb_fds[0], values, sizeof(values)) != sizeof(values))
+		return -EIO;
+	assert(values[0] == 2);
+	*misses = values[1];
+	*accesses = values[2];
+	return 0;
+}
+
+
+//
+// benchmarks
+
+// Each iteration runs prepare() (if set), then the timed run(), then
+// cleanup() (if set). Iterations should leave BENCH_DIR as they found it.
+struct bench
+{
+	const char *name;
+	void (*prepare)(const struct bench *b, unsigned i, unsigned n);
+	void (*run)(const struct bench *b, unsigned i, unsigned n);
+	void (*cleanup)(const struct bench *b, unsigned i, unsigned n);
+	size_t size;  // the size of file "a" before run()
+	size_t size2; // the size run() writes, truncates to, or reads
+	off_t off;    // the offset run() writes at
+};
+
+#define BENCH_FN(name) \
+	static void name(const struct bench *b, unsigned i, unsigned n)
+
+BENCH_FN(create_a)     { xcall(be->create("a")); }
+BENCH_FN(create_sized) { xcall(be->create("a")); xcall(be->write("a", 0, b->size, setup_data)); }
+BENCH_FN(unlink_a)     { xcall(be->unlink("a")); }
+BENCH_FN(unlink_b)     { xcall(be->unlink("b")); }
+BENCH_FN(unlink_ab)    { xcall(be->unlink("a")); xcall(be->unlink("b")); }
+BENCH_FN(mkdir_a)      { xcall(be->mkdir("a")); }
+BENCH_FN(rmdir_a)      { xcall(be->rmdir("a")); }
+BENCH_FN(rmdir_b)      { xcall(be->rmdir("b")); }
+BENCH_FN(symlink_b)    { xcall(be->symlink("a", "b")); }
+BENCH_FN(link_b)       { xcall(be->link("a", "b")); }
+BENCH_FN(rename_ab)    { xcall(be->rename("a", "b")); }
+BENCH_FN(chmod_a)      { xcall(be->chmod("a", 0600)); }
+BENCH_FN(append_a)     { xcall(be->write("a", -1, b->size2, data)); }
+BENCH_FN(write_a)      { xcall(be->write("a", b->off, b->size2, data)); }
+BENCH_FN(truncate_a)   { xcall(be->truncate("a", b->size2)); }
+BENCH_FN(read_a)       { xassert(xcall(be->read("a", 0, b->size2)) == b->size2); }
+
+BENCH_FN(create_ab)
+{
+	xcall(be->create("a"));
+	xcall(be->create("b"));
+}
+
+BENCH_FN(create_large)
+{
+	xcall(be->create("a"));
+	xcall(be->write("a", 0, b->size2, data));
+}
+
+BENCH_FN(prepare_inter)
+{
+	xcall(be->mkdir("a"));
+	xcall(be->mkdir("b"));
+	xcall(be->create("a/c"));
+}
+
+BENCH_FN(rename_inter) { xcall(be->rename("a/c", "b/c")); }
+
+BENCH_FN(cleanup_inter)
+{
+	xcall(be->unlink("b/c"));
+	xcall(be->rmdir("a"));
+	xcall(be->rmdir("b"));
+}
+
+// b->size entries, created by the first iteration, removed by the last
+BENCH_FN(prepare_readdir)
+{
+	unsigned j;
+	for (j = 0; !i && j < b->size; j++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "%u", j);
+		xcall(be->create(name));
+	}
+}
+
+BENCH_FN(readdir_dot) { xassert(xcall(be->readdir(".")) == b->size + 2); }
+
+BENCH_FN(cleanup_readdir)
+{
+	unsigned j;
+	for (j = 0; i == n - 1 && j < b->size; j++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "%u", j);
+		xcall(be->unlink(name));
+	}
+}
+
+#define KB 1024
+#define MB (1024 * 1024)
+
+static const struct bench benches[] =
+{
+	{"create",            NULL,          create_a,     unlink_a},
+	{"mkdir",             NULL,          mkdir_a,      rmdir_a},
+	{"symlink",           NULL,          symlink_b,    unlink_b},
+	{"unlink_0B",         create_sized,  unlink_a,     NULL, 0},
+	{"unlink_4k",         create_sized,  unlink_a,     NULL, 4 * KB},
+	{"unlink_1M",         create_sized,  unlink_a,     NULL, 1 * MB},
+	{"unlink_16M",        create_sized,  unlink_a,     NULL, 16 * MB},
+	{"rmdir",             mkdir_a,       rmdir_a,      NULL},
+	{"unlink_symlink",    symlink_b,     unlink_b,     NULL},
+	{"rename_file_intra", create_a,      rename_ab,    unlink_b},
+	{"rename_file_inter", prepare_inter, rename_inter, cleanup_inter},
+	{"rename_file_clobber", create_ab,   rename_ab,    unlink_b},
+	{"rename_dir_intra",  mkdir_a,       rename_ab,    rmdir_b},
+	{"link",              create_a,      link_b,       unlink_ab},
+	{"chmod",             create_a,      chmod_a,      unlink_a},
+	{"append_0B_8B",      create_sized,  append_a,     unlink_a, 0, 8},
+	{"append_8B_8B",      create_sized,  append_a,     unlink_a, 8, 8},
+	{"append_0B_4k",      create_sized,  append_a,     unlink_a, 0, 4 * KB},
+	{"append_8k_4k",      create_sized,  append_a,     unlink_a, 8 * KB, 4 * KB},
+	{"append_0B_128k",    create_sized,  append_a,     unlink_a, 0, 128 * KB},
+	{"append_2M_4k",      create_sized,  append_a,     unlink_a, 2 * MB, 4 * KB},
+	{"append_2M_128k",    create_sized,  append_a,     unlink_a, 2 * MB, 128 * KB},
+	{"write_1M_8B",       create_sized,  write_a,      unlink_a, 1 * MB, 8},
+	{"write_1M_8B_4092",  create_sized,  write_a,      unlink_a, 1 * MB, 8, 4092},
+	{"write_1M_16B",      create_sized,  write_a,      unlink_a, 1 * MB, 16},
+	{"write_1M_4k",       create_sized,  write_a,      unlink_a, 1 * MB, 4 * KB},
+	{"write_1M_4k_1",     create_sized,  write_a,      unlink_a, 1 * MB, 4 * KB, 1},
+	{"write_1M_128k",     create_sized,  write_a,      unlink_a, 1 * MB, 128 * KB},
+	{"write_1M_124k_1",   create_sized,  write_a,      unlink_a, 1 * MB, 124 * KB, 1},
+	{"truncate_1M_0",     create_sized,  truncate_a,   unlink_a, 1 * MB, 0},
+	{"truncate_4k_1M",    create_sized,  truncate_a,   unlink_a, 4 * KB, 1 * MB},
+	{"read",              create_sized,  read_a,       unlink_a, 4 * KB, 4 * KB},
+	{"readdir",           NULL,          readdir_dot,  NULL},
+	{"readdir_256",       prepare_readdir, readdir_dot, cleanup_readdir, 256},
+	{"create_16M",        NULL,          create_large, unlink_a, 0, 16 * MB},
+};
+
+#define NBENCHES (sizeof(benches) / sizeof(*benches))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static void run_bench(const struct bench *b, unsigned n)
+{
+	static struct histogram h;
+	uint64_t written = 0;
+	bool count_written = true;
+	uint64_t dtlb_misses, dtlb_accesses;
+	unsigned i;
+
+	histogram_init(&h);
+	dtlb_reset();
+	for (i = 0; i < n; i++)
+	{
+		uint64_t start, end;
+		uint64_t written_start = 0, written_end = 0;
+
+		if (b->prepare)
+			b->prepare(b, i, n);
+		if (count_written && be->written(&written_start) < 0)
+			count_written = false;
+
+		dtlb_enable(true);
+		start = now_ns();
+		b->run(b, i, n);
+		end = now_ns();
+		dtlb_enable(false);
+
+		if (count_written && be->written(&written_end) < 0)
+			count_written = false;
+		written += written_end - written_start;
+		if (b->cleanup)
+			b->cleanup(b, i, n);
+
+		histogram_record(&h, end - start);
+	}
+
+	printf("%-20s %7u %10.0f %9.2f %9.2f %9.2f %9.2f",
+	       b->name, n, h.count / (h.sum / 1e9),
+	       histogram_percentile(&h, 50) / 1e3,
+	       histogram_percentile(&h, 99) / 1e3,
+	       histogram_percentile(&h, 99.9) / 1e3, h.max / 1e3);
+	if (count_written)
+		printf(" %12.1f", (double) written / n);
+	else
+		printf(" %12s", "-");
+	if (dtlb_read(&dtlb_misses, &dtlb_accesses) >= 0)
+		printf(" %10.1f %9.3f\n", (double) dtlb_misses / n,
+		       dtlb_accesses ? 100.0 * dtlb_misses / dtlb_accesses : 0);
+	else
+		printf(" %10s %9s\n", "-", "-");
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Microbenchmark file system operations.\n");
+	fprintf(stderr, "Usage: %s [-n N] [-M MODE] [-w NS] [-b MBPS] [-r NS]"
+	        " [-c PCT] [-H PAGES] <-m DIR|-f FILE|-s SIZE> [BENCHMARK...]\n",
+	        prog);
+	fprintf(stderr, "\t-n N: run each benchmark N times (default 1000)\n");
+	fprintf(stderr, "\t-m DIR: use the file system mounted at DIR\n");
+	fprintf(stderr, "\t-f FILE: use libbpfs on the BPFS image FILE\n");
+	fprintf(stderr, "\t-s SIZE: use libbpfs on a new SIZE byte BPFS in DRAM\n");
+	fprintf(stderr, "\t-M MODE: with -f or -s, mount in commit mode MODE (sp,\n"
+	        "\t\tscsp, or bpfs), or in each in turn (all). Repeat to\n"
+	        "\t\tmount in each given mode in turn.\n");
+	fprintf(stderr, "\t-w NS, -b MBPS, -r NS: with -f or -s, emulate NVM with\n"
+	        "\t\tNS per cache line written, MBPS MB/s write bandwidth,\n"
+	        "\t\tand NS per block first read by an operation\n");
+	fprintf(stderr, "\t-c PCT: with -f or -s, check the file system online,"
+	        " spending\n\t\tup to PCT percent of the time\n");
+	fprintf(stderr, "\t-H PAGES: with -f or -s, map BPRAM with transparent\n"
+	        "\t\thuge pages (thp) or hugetlb pages (hugetlb)\n");
+	fprintf(stderr, "\tSpecifying no benchmarks runs them all. Benchmarks:\n");
+	{
+		unsigned i;
+		for (i = 0; i < NBENCHES; i++)
+			fprintf(stderr, "\t\t%s\n", benches[i].name);
+	}
+	exit(1);
+}
+
+// Run the benchmarks named in names, or all if nnames is 0, n times each
+static void run_benches(const struct bpfs_options *opts, const char *image,
+                        size_t size, unsigned n, int nnames, char **names)
+{
+	int i;
+
+	if (be == &core_backend)
+	{
+		struct bpfs_entry e;
+		if (image)
+			xcall(bpfs_mount_file(image, opts));
+		else
+			xcall(bpfs_mount_ephemeral(size, opts));
+		printf("BPFS running in %s\n", bpfs_mode_str());
+		xcall(bpfs_mkdir(BPFS_INO_ROOT, BENCH_DIR, 0755, getuid(), getgid(),
+		                 &e));
+		core_dir_ino = e.ino;
+	}
+	else
+		xsyscall(mkdir(mnt_path("", (char[PATH_MAX]) {0}), 0755));
+
+	printf("%-20s %7s %10s %9s %9s %9s %9s %12s %10s %9s\n", "benchmark",
+	       "nops", "ops/s", "p50_us", "p99_us", "p999_us", "max_us",
+	       "bytes/op", "dtlb_mpo", "dtlb_mr%");
+	for (i = 0; i < NBENCHES; i++)
+	{
+		bool selected = !nnames;
+		int j;
+		for (j = 0; j < nnames && !selected; j++)
+			selected = !strcmp(names[j], benches[i].name);
+		if (selected)
+			run_bench(&benches[i], n);
+	}
+
+	if (be == &core_backend)
+	{
+		xcall(bpfs_rmdir(BPFS_INO_ROOT, BENCH_DIR));
+		bpfs_unmount();
+	}
+	else
+		xsyscall(rmdir(mnt_path("", (char[PATH_MAX]) {0})));
+}
+
+int main(int argc, char **argv)
+{
+	struct bpfs_options opts = BPFS_OPTIONS_DEFAULT;
+	enum bpfs_mode modes[MAX_MODES];
+	unsigned nmodes = 0;
+	const char *image = NULL;
+	size_t size = 0;
+	unsigned n = 1000;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:M:m:f:s:w:b:r:c:H:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			if (!strcmp(optarg, "all"))
+			{
+				if (nmodes + 3 > MAX_MODES)
+					usage(argv[0]);
+				modes[nmodes++] = BPFS_MODE_SP;
+				modes[nmodes++] = BPFS_MODE_SCSP;
+				modes[nmodes++] = BPFS_MODE_BPFS;
+			}
+			else if (nmodes == MAX_MODES
+			         || (int) (modes[nmodes++] = bpfs_mode_parse(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			be = &mnt_backend;
+			snprintf(mnt_dir, sizeof(mnt_dir), "%s", optarg);
+			break;
+		case 'f':
+			be = &core_backend;
+			image = optarg;
+			break;
+		case 's':
+			be = &core_backend;
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.nvm_write_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.nvm_write_mbps = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.nvm_read_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.fsck_budget = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			if (!strcmp(optarg, "thp"))
+				opts.hugepages = BPFS_HUGEPAGES_THP;
+			else if (!strcmp(optarg, "hugetlb"))
+				opts.hugepages = BPFS_HUGEPAGES_HUGETLB;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!be || !n)
+		usage(argv[0]);
+	for (i = optind; i < argc; i++)
+	{
+		unsigned j;
+		for (j = 0; j < NBENCHES; j++)
+			if (!strcmp(argv[i], benches[j].name))
+				break;
+		if (j == NBENCHES)
+		{
+			fprintf(stderr, "\"%s\" is not a benchmark\n", argv[i]);
+			usage(argv[0]);
+		}
+	}
+
+	memset(data, '2', sizeof(data));
+	memset(setup_data, '1', sizeof(setup_data));
+	if (be == &core_backend)
+		dtlb_init();
+
+	if (!nmodes)
+		modes[nmodes++] = BPFS_MODE_DEFAULT;
+	if (be != &core_backend)
+		nmodes = 1;
+	for (i = 0; i < (int) nmodes; i++)
+	{
+		if (i)
+			printf("\n");
+		opts.mode = modes[i];
+		run_benches(&opts, image, size, n, argc - optind, argv + optind);
+	}
+
+	return 0;
+}
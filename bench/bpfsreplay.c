@@ -0,0 +1,738 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+// Replay a trace recorded by bpfs -o trace=FILE (see bpfs_trace.h) directly
+// against libbpfs or through a mounted file system, as fast as possible or
+// at the recorded times, and report the throughput and BPRAM bytes written.
+//
+// Replaying against libbpfs from a copy of the image that the recording
+// mounted repeats the recorded operations, including their group commits,
+// exactly; each result that differs from the recorded one is counted.
+// A mounted replay goes through the kernel, which adds and drops requests.
+
+#define _GNU_SOURCE
+
+#include "libbpfs.h"
+#include "bpfs_trace.h"
+#include "hash_map.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// Size of the FUSE dirent that fuse_add_direntry() adds for name
+#define FUSE_DIRENT_SIZE(namelen) (((24 + (namelen)) + 7) & ~7)
+
+static const char *op_names[BPFS_TRACE_NOPS] = BPFS_TRACE_OP_NAMES;
+
+// An operation read from the trace
+struct op
+{
+	struct bpfs_trace_rec rec;
+	char name[NAME_MAX + 1];
+	char name2[PATH_MAX];
+	struct bpfs_trace_attr attr;
+};
+
+// A buffer for reads and writes, grown as needed
+static char *data;
+static size_t data_size;
+
+static char* data_get(size_t size)
+{
+	if (size > data_size)
+	{
+		xassert((data = realloc(data, size)));
+		memset(data + data_size, 'a', size - data_size);
+		data_size = size;
+	}
+	return data;
+}
+
+// Return size bytes for the next replayed write. Each write's bytes differ
+// from every earlier write's, so that overwrites change the file's data.
+static char* data_write(size_t size)
+{
+	static uint64_t nwrites;
+	uint64_t word = ++nwrites * 0x9e3779b97f4a7c15ULL;
+	char *buf = data_get(size);
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word))
+		memcpy(buf + i, &word, sizeof(word));
+	memcpy(buf + i, &word, size - i);
+	return buf;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t stats_written(const struct bpfs_stats *stats)
+{
+	uint64_t bytes = 0;
+	unsigned i;
+	for (i = 0; i < BPFS_STATS_NOPS; i++)
+		bytes += stats->op[i].store_bytes;
+	return bytes;
+}
+
+static int read_op(FILE *trace, struct op *op)
+{
+	struct bpfs_trace_rec *rec = &op->rec;
+
+	if (fread(rec, sizeof(*rec), 1, trace) != 1)
+		return feof(trace) ? 0 : -EIO;
+	if (rec->op >= BPFS_TRACE_NOPS || rec->name_len >= sizeof(op->name)
+	    || rec->name2_len >= sizeof(op->name2)
+	    || (rec->data_len && rec->data_len != sizeof(op->attr)))
+		return -EINVAL;
+	if (fread(op->name, 1, rec->name_len, trace) != rec->name_len
+	    || fread(op->name2, 1, rec->name2_len, trace) != rec->name2_len
+	    || fread(&op->attr, 1, rec->data_len, trace) != rec->data_len)
+		return -EIO;
+	op->name[rec->name_len] = 0;
+	op->name2[rec->name2_len] = 0;
+	return 1;
+}
+
+// Return whether the op's recorded result sets its resulting inode
+static bool op_is_entry(const struct op *op)
+{
+	switch (op->rec.op)
+	{
+	case BPFS_TRACE_LOOKUP:
+	case BPFS_TRACE_MKNOD:
+	case BPFS_TRACE_MKDIR:
+	case BPFS_TRACE_SYMLINK:
+	case BPFS_TRACE_RENAME:
+	case BPFS_TRACE_LINK:
+	case BPFS_TRACE_CREATE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+//
+// backends
+
+// Each replays op and returns its result as the trace records it
+// (for ENTRY ops, nonnegative on success)
+struct backend
+{
+	int64_t (*replay)(const struct op *op);
+	// Set *bytes to the number of bytes written to BPRAM so far
+	int (*written)(uint64_t *bytes);
+};
+
+// core: libbpfs calls, in process
+
+// The recorded inode number -> the replay's inode number
+static hash_map_t *core_inos;
+
+static uint64_t core_ino(uint64_t ino)
+{
+	if (ino == BPFS_INO_ROOT)
+		return ino;
+	return (uintptr_t) hash_map_find_val(core_inos, u64_ptr(ino));
+}
+
+static int64_t core_entry(const struct op *op, int r,
+                          const struct bpfs_entry *e)
+{
+	if (r < 0)
+		return r;
+	if (op->rec.result > 0)
+		xcall(hash_map_insert(core_inos, u64_ptr(op->rec.result),
+		                      u64_ptr(e->ino)));
+	return e->ino;
+}
+
+struct core_readdir_params
+{
+	size_t max_size;
+	size_t total_size;
+};
+
+static int core_readdir_filler(void *user, const char *name, uint64_t ino,
+                               mode_t type, int64_t next_off)
+{
+	struct core_readdir_params *params = (struct core_readdir_params*) user;
+	size_t size = FUSE_DIRENT_SIZE(strlen(name));
+	if (params->total_size + size > params->max_size)
+		return 1;
+	params->total_size += size;
+	return 0;
+}
+
+static int64_t core_replay(const struct op *op)
+{
+	const struct bpfs_trace_rec *rec = &op->rec;
+	uint64_t ino = core_ino(rec->ino);
+	struct bpfs_entry e;
+	struct stat stbuf;
+	int r;
+
+	switch (rec->op)
+	{
+	case BPFS_TRACE_STATFS:
+	{
+		struct statvfs stv;
+		return bpfs_statfs(&stv);
+	}
+	case BPFS_TRACE_LOOKUP:
+		r = bpfs_lookup(ino, op->name, &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_GETATTR:
+		return bpfs_getattr(ino, &stbuf);
+	case BPFS_TRACE_SETATTR:
+	{
+		struct stat attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.st_mode = op->attr.mode;
+		attr.st_uid = op->attr.uid;
+		attr.st_gid = op->attr.gid;
+		attr.st_size = op->attr.size;
+		attr.st_atime = op->attr.atime;
+		attr.st_mtime = op->attr.mtime;
+		return bpfs_setattr(ino, &attr, rec->arg[0], &stbuf);
+	}
+	case BPFS_TRACE_READLINK:
+		return bpfs_readlink(ino, data_get(BPFS_BLOCK_SIZE), BPFS_BLOCK_SIZE);
+	case BPFS_TRACE_MKNOD:
+		r = bpfs_mknod(ino, op->name, rec->arg[0], rec->arg[1], rec->arg[2],
+		               &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_MKDIR:
+		r = bpfs_mkdir(ino, op->name, rec->arg[0], rec->arg[1], rec->arg[2],
+		               &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_UNLINK:
+		return bpfs_unlink(ino, op->name);
+	case BPFS_TRACE_RMDIR:
+		return bpfs_rmdir(ino, op->name);
+	case BPFS_TRACE_SYMLINK:
+		r = bpfs_symlink(op->name2, ino, op->name, rec->arg[1], rec->arg[2],
+		                 &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_RENAME:
+		r = bpfs_rename(ino, op->name, core_ino(rec->arg[0]), op->name2);
+		return r < 0 ? r : (int64_t) core_ino(rec->result);
+	case BPFS_TRACE_LINK:
+		r = bpfs_link(ino, core_ino(rec->arg[0]), op->name, &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_OPENDIR:
+		return bpfs_opendir(ino);
+	case BPFS_TRACE_READDIR:
+	{
+		struct core_readdir_params params = {rec->arg[1], 0};
+		r = bpfs_readdir(ino, rec->arg[0], core_readdir_filler, &params);
+		return r < 0 ? r : (int64_t) params.total_size;
+	}
+	case BPFS_TRACE_RELEASEDIR:
+		return bpfs_releasedir(ino);
+	case BPFS_TRACE_FSYNCDIR:
+		return bpfs_fsyncdir(ino, rec->arg[0]);
+	case BPFS_TRACE_CREATE:
+		r = bpfs_create(ino, op->name, rec->arg[0], rec->arg[1], rec->arg[2],
+		                &e);
+		return core_entry(op, r, &e);
+	case BPFS_TRACE_OPEN:
+		return bpfs_open(ino);
+	case BPFS_TRACE_READ:
+		return bpfs_read(ino, data_get(rec->arg[1]), rec->arg[1],
+		                 rec->arg[0]);
+	case BPFS_TRACE_WRITE:
+		return bpfs_write(ino, data_write(rec->arg[1]), rec->arg[1],
+		                  rec->arg[0]);
+	case BPFS_TRACE_FSYNC:
+		return bpfs_fsync(ino, rec->arg[0]);
+	case BPFS_TRACE_IOCTL:
+		switch (rec->arg[0])
+		{
+		case BPFS_IOC_COMPACT:
+		{
+			uint64_t reclaimed;
+			return bpfs_compact(ino, &reclaimed);
+		}
+		case BPFS_IOC_TXN_BEGIN:
+			return bpfs_txn_begin();
+		case BPFS_IOC_TXN_COMMIT:
+			return bpfs_txn_commit();
+		case BPFS_IOC_TXN_ABORT:
+			return bpfs_txn_abort();
+		case BPFS_IOC_STATS:
+		{
+			struct bpfs_stats stats;
+			return bpfs_get_stats(&stats);
+		}
+		}
+		return -ENOTTY;
+	case BPFS_TRACE_SYNC:
+		bpfs_sync();
+		return 0;
+	}
+	return -ENOSYS;
+}
+
+static int core_written(uint64_t *bytes)
+{
+	struct bpfs_stats stats;
+	int r = bpfs_get_stats(&stats);
+	if (r >= 0)
+		*bytes = stats_written(&stats);
+	return r;
+}
+
+static const struct backend core_backend = {core_replay, core_written};
+
+// mount: system calls on a mounted file system
+
+static char mnt_dir[PATH_MAX];
+
+// The recorded inode number -> where the replay last found it
+struct mnt_ino
+{
+	uint64_t parent_ino;
+	char *name;
+};
+
+static hash_map_t *mnt_inos;
+
+static void mnt_ino_set(uint64_t ino, uint64_t parent_ino, const char *name)
+{
+	struct mnt_ino *mi = hash_map_find_val(mnt_inos, u64_ptr(ino));
+	if (!mi)
+	{
+		xassert((mi = calloc(1, sizeof(*mi))));
+		xcall(hash_map_insert(mnt_inos, u64_ptr(ino), mi));
+	}
+	free(mi->name);
+	xassert((mi->name = strdup(name)));
+	mi->parent_ino = parent_ino;
+}
+
+// Set buf to the path of ino (and name, if not NULL)
+static const char* mnt_path(uint64_t ino, const char *name, char *buf)
+{
+	char parent[PATH_MAX];
+	const struct mnt_ino *mi;
+
+	if (ino == BPFS_INO_ROOT)
+		strcpy(parent, mnt_dir);
+	else if ((mi = hash_map_find_val(mnt_inos, u64_ptr(ino))))
+		mnt_path(mi->parent_ino, mi->name, parent);
+	else
+		xassert(snprintf(parent, sizeof(parent), "%s/.unknown-%" PRIu64,
+		                 mnt_dir, ino) < (int) sizeof(parent));
+	if (name)
+		xassert(snprintf(buf, PATH_MAX, "%s/%s", parent, name) < PATH_MAX);
+	else
+		strcpy(buf, parent);
+	return buf;
+}
+
+#define MNT_PATH(ino, name) mnt_path(ino, name, (char[PATH_MAX]) {0})
+
+#define MNT_SYSCALL(call) ((call) < 0 ? -errno : 0)
+
+static int64_t mnt_entry(const struct op *op, int r)
+{
+	if (r < 0)
+		return r;
+	if (op->rec.result > 0)
+		mnt_ino_set(op->rec.result, op->rec.ino, op->name);
+	return op->rec.result;
+}
+
+// Open ino, call f on it, and close it
+static int mnt_with_fd(uint64_t ino, int flags,
+                       int (*f)(int fd, const struct op *op),
+                       const struct op *op)
+{
+	int fd = open(MNT_PATH(ino, NULL), flags);
+	int r;
+	if (fd < 0)
+		return -errno;
+	r = f(fd, op);
+	if (close(fd) < 0 && r >= 0)
+		r = -errno;
+	return r;
+}
+
+static int mnt_fd_fsync(int fd, const struct op *op)
+{
+	return MNT_SYSCALL(op->rec.arg[0] ? fdatasync(fd) : fsync(fd));
+}
+
+static int mnt_fd_read(int fd, const struct op *op)
+{
+	ssize_t r = pread(fd, data_get(op->rec.arg[1]), op->rec.arg[1],
+	                  op->rec.arg[0]);
+	return r < 0 ? -errno : r;
+}
+
+static int mnt_fd_write(int fd, const struct op *op)
+{
+	ssize_t r = pwrite(fd, data_write(op->rec.arg[1]), op->rec.arg[1],
+	                   op->rec.arg[0]);
+	return r < 0 ? -errno : r;
+}
+
+static int mnt_fd_ioctl(int fd, const struct op *op)
+{
+	struct bpfs_stats stats;
+	uint64_t reclaimed;
+	void *arg = NULL;
+
+	if (op->rec.arg[0] == BPFS_IOC_COMPACT)
+		arg = &reclaimed;
+	else if (op->rec.arg[0] == BPFS_IOC_STATS)
+		arg = &stats;
+	return MNT_SYSCALL(ioctl(fd, op->rec.arg[0], arg));
+}
+
+static int mnt_setattr(const struct op *op)
+{
+	const char *path = MNT_PATH(op->rec.ino, NULL);
+	unsigned to_set = op->rec.arg[0];
+	int r;
+
+	if (to_set & BPFS_SET_ATTR_MODE)
+		if ((r = MNT_SYSCALL(chmod(path, op->attr.mode & 07777))) < 0)
+			return r;
+	if (to_set & (BPFS_SET_ATTR_UID | BPFS_SET_ATTR_GID))
+	{
+		uid_t uid = to_set & BPFS_SET_ATTR_UID ? op->attr.uid : (uid_t) -1;
+		gid_t gid = to_set & BPFS_SET_ATTR_GID ? op->attr.gid : (gid_t) -1;
+		if ((r = MNT_SYSCALL(lchown(path, uid, gid))) < 0)
+			return r;
+	}
+	if (to_set & BPFS_SET_ATTR_SIZE)
+		if ((r = MNT_SYSCALL(truncate(path, op->attr.size))) < 0)
+			return r;
+	if (to_set & (BPFS_SET_ATTR_ATIME | BPFS_SET_ATTR_MTIME))
+	{
+		struct timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+		if (to_set & BPFS_SET_ATTR_ATIME_NOW)
+			times[0].tv_nsec = UTIME_NOW;
+		else if (to_set & BPFS_SET_ATTR_ATIME)
+			times[0] = (struct timespec) {op->attr.atime, 0};
+		if (to_set & BPFS_SET_ATTR_MTIME_NOW)
+			times[1].tv_nsec = UTIME_NOW;
+		else if (to_set & BPFS_SET_ATTR_MTIME)
+			times[1] = (struct timespec) {op->attr.mtime, 0};
+		if ((r = MNT_SYSCALL(utimensat(AT_FDCWD, path, times,
+		                               AT_SYMLINK_NOFOLLOW))) < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int mnt_readdir(const struct op *op)
+{
+	DIR *dir = opendir(MNT_PATH(op->rec.ino, NULL));
+	struct dirent *d;
+	int64_t total_size = 0;
+	if (!dir)
+		return -errno;
+	if (op->rec.arg[0])
+		seekdir(dir, op->rec.arg[0]);
+	while ((d = readdir(dir)))
+	{
+		size_t size = FUSE_DIRENT_SIZE(strlen(d->d_name));
+		if (total_size + size > op->rec.arg[1])
+			break;
+		total_size += size;
+	}
+	closedir(dir);
+	return total_size;
+}
+
+static int64_t mnt_replay(const struct op *op)
+{
+	const struct bpfs_trace_rec *rec = &op->rec;
+	struct stat stbuf;
+	int r;
+
+	switch (rec->op)
+	{
+	case BPFS_TRACE_STATFS:
+	{
+		struct statvfs stv;
+		return MNT_SYSCALL(statvfs(mnt_dir, &stv));
+	}
+	case BPFS_TRACE_LOOKUP:
+		r = MNT_SYSCALL(lstat(MNT_PATH(rec->ino, op->name), &stbuf));
+		return mnt_entry(op, r);
+	case BPFS_TRACE_GETATTR:
+		return MNT_SYSCALL(lstat(MNT_PATH(rec->ino, NULL), &stbuf));
+	case BPFS_TRACE_SETATTR:
+		return mnt_setattr(op);
+	case BPFS_TRACE_READLINK:
+	{
+		char *buf = data_get(PATH_MAX);
+		return MNT_SYSCALL(readlink(MNT_PATH(rec->ino, NULL), buf, PATH_MAX));
+	}
+	case BPFS_TRACE_MKNOD:
+		r = MNT_SYSCALL(mknod(MNT_PATH(rec->ino, op->name), rec->arg[0], 0));
+		return mnt_entry(op, r);
+	case BPFS_TRACE_MKDIR:
+		r = MNT_SYSCALL(mkdir(MNT_PATH(rec->ino, op->name), rec->arg[0]));
+		return mnt_entry(op, r);
+	case BPFS_TRACE_UNLINK:
+		return MNT_SYSCALL(unlink(MNT_PATH(rec->ino, op->name)));
+	case BPFS_TRACE_RMDIR:
+		return MNT_SYSCALL(rmdir(MNT_PATH(rec->ino, op->name)));
+	case BPFS_TRACE_SYMLINK:
+		r = MNT_SYSCALL(symlink(op->name2, MNT_PATH(rec->ino, op->name)));
+		return mnt_entry(op, r);
+	case BPFS_TRACE_RENAME:
+		r = MNT_SYSCALL(rename(MNT_PATH(rec->ino, op->name),
+		                       MNT_PATH(rec->arg[0], op->name2)));
+		if (r < 0)
+			return r;
+		if (rec->result > 0)
+			mnt_ino_set(rec->result, rec->arg[0], op->name2);
+		return rec->result;
+	case BPFS_TRACE_LINK:
+		r = MNT_SYSCALL(link(MNT_PATH(rec->ino, NULL),
+		                     MNT_PATH(rec->arg[0], op->name)));
+		return r < 0 ? r : rec->result;
+	case BPFS_TRACE_READDIR:
+		return mnt_readdir(op);
+	case BPFS_TRACE_FSYNCDIR:
+		return mnt_with_fd(rec->ino, O_RDONLY | O_DIRECTORY, mnt_fd_fsync, op);
+	case BPFS_TRACE_CREATE:
+	{
+		int fd = open(MNT_PATH(rec->ino, op->name),
+		              O_WRONLY | O_CREAT | O_EXCL, rec->arg[0]);
+		r = fd < 0 ? -errno : MNT_SYSCALL(close(fd));
+		return mnt_entry(op, r);
+	}
+	case BPFS_TRACE_READ:
+		return mnt_with_fd(rec->ino, O_RDONLY, mnt_fd_read, op);
+	case BPFS_TRACE_WRITE:
+		return mnt_with_fd(rec->ino, O_WRONLY, mnt_fd_write, op);
+	case BPFS_TRACE_FSYNC:
+		return mnt_with_fd(rec->ino, O_RDONLY, mnt_fd_fsync, op);
+	case BPFS_TRACE_IOCTL:
+		return mnt_with_fd(rec->ino, O_RDONLY, mnt_fd_ioctl, op);
+	case BPFS_TRACE_OPENDIR:
+	case BPFS_TRACE_RELEASEDIR:
+	case BPFS_TRACE_OPEN:
+	case BPFS_TRACE_SYNC:
+		// The kernel makes these requests itself
+		return rec->result;
+	}
+	return -ENOSYS;
+}
+
+static int mnt_written(uint64_t *bytes)
+{
+	struct bpfs_stats stats;
+	int fd = open(mnt_dir, O_RDONLY);
+	int r;
+	if (fd < 0)
+		return -errno;
+	r = MNT_SYSCALL(ioctl(fd, BPFS_IOC_STATS, &stats));
+	close(fd);
+	if (r >= 0)
+		*bytes = stats_written(&stats);
+	return r;
+}
+
+static const struct backend mnt_backend = {mnt_replay, mnt_written};
+
+
+//
+// main
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Replay a BPFS trace (bpfs -o trace=TRACE).\n");
+	fprintf(stderr, "Usage: %s [-t] [-M MODE] <-m DIR|-f FILE|-s SIZE> TRACE\n",
+	        prog);
+	fprintf(stderr, "\t-t: replay at the recorded times (default: at once)\n");
+	fprintf(stderr, "\t-M MODE: with -f or -s, replay in commit mode MODE\n"
+	        "\t\t(sp, scsp, or bpfs; default: the recorded mode)\n");
+	fprintf(stderr, "\t-m DIR: use the file system mounted at DIR\n");
+	fprintf(stderr, "\t-f FILE: use libbpfs on the BPFS image FILE\n");
+	fprintf(stderr, "\t-s SIZE: use libbpfs on a new SIZE byte BPFS in DRAM\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const struct backend *be = NULL;
+	struct bpfs_trace_header header;
+	uint64_t nops[BPFS_TRACE_NOPS] = {0};
+	uint64_t ndiffs[BPFS_TRACE_NOPS] = {0};
+	uint64_t written_start = 0, written_end = 0;
+	bool count_written;
+	bool timed = false;
+	int mode = BPFS_MODE_DEFAULT;
+	const char *image = NULL;
+	size_t size = 0;
+	uint64_t start, end, total = 0, total_diffs = 0;
+	struct op op;
+	FILE *trace;
+	int opt;
+	int r;
+	unsigned i;
+
+	while ((opt = getopt(argc, argv, "tM:m:f:s:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			timed = true;
+			break;
+		case 'M':
+			if ((mode = bpfs_mode_parse(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			be = &mnt_backend;
+			snprintf(mnt_dir, sizeof(mnt_dir), "%s", optarg);
+			break;
+		case 'f':
+			be = &core_backend;
+			image = optarg;
+			break;
+		case 's':
+			be = &core_backend;
+			size = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!be || optind + 1 != argc)
+		usage(argv[0]);
+
+	if (!(trace = fopen(argv[optind], "r")))
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, trace) != 1
+	    || header.magic != BPFS_TRACE_MAGIC
+	    || header.version != BPFS_TRACE_VERSION)
+	{
+		fprintf(stderr, "%s: not a v%u BPFS trace\n", argv[optind],
+		        BPFS_TRACE_VERSION);
+		return 1;
+	}
+	header.mode[sizeof(header.mode) - 1] = 0;
+	printf("Trace recorded in %s with group_max %d\n",
+	       header.mode, header.group_max);
+
+	if (be == &core_backend)
+	{
+		// Commit groups as the recording did: at its syncs and when full
+		struct bpfs_options opts = BPFS_OPTIONS_DEFAULT;
+		opts.group_max = header.group_max;
+		if (mode == BPFS_MODE_DEFAULT)
+		{
+			// header.mode begins with the mode's name
+			char name[sizeof(header.mode)];
+			sscanf(header.mode, "%s", name);
+			if ((mode = bpfs_mode_parse(name)) < 0)
+				mode = BPFS_MODE_DEFAULT;
+		}
+		opts.mode = mode;
+		if (mode == BPFS_MODE_BPFS)
+			opts.group_max = 1; // BPFS mode commits each operation
+		if (image)
+			xcall(bpfs_mount_file(image, &opts));
+		else
+			xcall(bpfs_mount_ephemeral(size, &opts));
+		printf("BPFS running in %s\n", bpfs_mode_str());
+		if (strcmp(header.mode, bpfs_mode_str()))
+			printf("Warning: replaying in a different mode\n");
+		xassert((core_inos = hash_map_create_ptr()));
+	}
+	else
+	{
+		xcall(hash_map_init());
+		xassert((mnt_inos = hash_map_create_ptr()));
+	}
+
+	count_written = be->written(&written_start) >= 0;
+	start = now_ns();
+	while ((r = read_op(trace, &op)) > 0)
+	{
+		int64_t result;
+		bool same;
+
+		if (timed && start + op.rec.time_ns > now_ns())
+		{
+			uint64_t t = start + op.rec.time_ns;
+			struct timespec ts = {t / 1000000000, t % 1000000000};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			       == EINTR)
+				;
+		}
+
+		result = be->replay(&op);
+		if (op_is_entry(&op))
+			same = result < 0 ? result == op.rec.result : op.rec.result >= 0;
+		else
+			same = result == op.rec.result;
+		nops[op.rec.op]++;
+		if (!same)
+			ndiffs[op.rec.op]++;
+	}
+	end = now_ns();
+	if (r < 0)
+		fprintf(stderr, "%s: truncated or corrupt trace\n", argv[optind]);
+	fclose(trace);
+	if (count_written && be->written(&written_end) < 0)
+		count_written = false;
+
+	printf("%-12s %10s %10s\n", "op", "nops", "ndiffs");
+	for (i = 0; i < BPFS_TRACE_NOPS; i++)
+	{
+		if (!nops[i])
+			continue;
+		printf("%-12s %10" PRIu64 " %10" PRIu64 "\n",
+		       op_names[i], nops[i], ndiffs[i]);
+		total += nops[i];
+		total_diffs += ndiffs[i];
+	}
+	printf("%" PRIu64 " ops (%" PRIu64 " results differed) in %.3f s:"
+	       " %.0f ops/s\n", total, total_diffs, (end - start) / 1e9,
+	       total / ((end - start) / 1e9));
+	if (count_written)
+		printf("%" PRIu64 " bytes written to BPRAM\n",
+		       written_end - written_start);
+
+	if (be == &core_backend)
+	{
+		hash_map_destroy(core_inos);
+		bpfs_unmount();
+	}
+	free(data);
+
+	return r < 0;
+}
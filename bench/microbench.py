@@ -506,7 +506,9 @@ class benchmarks:
 
 class filesystem_bpfs:
     _mount_overheads = { 'BPFS': 1 } # the valid field
-    def __init__(self, megabytes):
+    modes = ['sp', 'scsp', 'bpfs']
+    def __init__(self, megabytes, mode=None):
+        self.mode = mode
         self.img = tempfile.NamedTemporaryFile()
         # NOTE: self.mnt should not be in ~/ so that gvfs does not readdir it
         self.mnt = tempfile.mkdtemp()
@@ -528,7 +530,10 @@ class filesystem_bpfs:
         if count:
             bin = './bench/bpramcount'
         self._count = count
-        self.proc = subprocess.Popen([bin, '-f', self.img.name, self.mnt],
+        cmd = [bin, '-f', self.img.name, self.mnt]
+        if self.mode:
+            cmd.extend(['-o', 'mode=' + self.mode])
+        self.proc = subprocess.Popen(cmd,
                                       stdout=subprocess.PIPE,
                                       stderr=subprocess.STDOUT,
                                       close_fds=True,
@@ -655,6 +660,8 @@ def run(fs, benches, profile):
 def usage():
     print 'Usage: ' + sys.argv[0] + ' [-h|--help] [-t FS [-d DEV]] [-p] [BENCHMARK ...]'
     print '\t-t FS: use file system FS (e.g., bpfs or ext4)'
+    print '\t\tbpfs-MODE: use BPFS in commit mode MODE (sp, scsp, or bpfs)'
+    print '\t\tbpfs-all: use BPFS in each commit mode in turn'
     print '\t-d DEV: use DEV for (non-bpfs) file system backing'
     print '\t-p: profile each run (bpfs only)'
     print '\tThree meta benchmark names exist: all, micro, and macro'
@@ -700,18 +707,27 @@ def main():
             else:
                 print '"%s" is not a benchmark' % name
 
-    if fs_name == 'bpfs':
+    if fs_name == 'bpfs' or fs_name.startswith('bpfs-'):
         bpfs_size = 32
         for (name, obj) in benches:
             if hasattr(obj, 'free_space'):
                 bpfs_size = max(bpfs_size, obj.free_space)
-        fs = filesystem_bpfs(bpfs_size)
+        modes = [None]
+        if fs_name == 'bpfs-all':
+            modes = filesystem_bpfs.modes
+        elif fs_name != 'bpfs':
+            modes = [fs_name.split('-', 1)[1]]
+        for mode in modes:
+            if mode:
+                print 'Commit mode ' + mode + ':'
+            fs = filesystem_bpfs(bpfs_size, mode)
+            run(fs, benches, profile)
+            del fs
     else:
         if dev == None:
             raise NameError('Must provide a backing device for ' + fs_name)
         fs = filesystem_kernel(fs_name, dev)
-
-    run(fs, benches, profile)
+        run(fs, benches, profile)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,97 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+// Measure overwrite throughput: repeatedly pwrite() over an existing file.
+// Run against a file system mounted in SCSP mode to measure its CoW cost.
+
+#define _XOPEN_SOURCE 500
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Like assert(), but also with NDEBUG
+#define xassert(x) \
+	do { \
+		if (!(x)) \
+		{ \
+			perror(#x); \
+			exit(1); \
+		} \
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	const char *filename;
+	size_t file_size, write_size;
+	unsigned long nwrites, i;
+	int sequential = 0;
+	struct timeval start, end;
+	double secs;
+	char *buf;
+	int fd;
+	ssize_t r;
+
+	if (argc == 6 && !strcmp(argv[5], "seq"))
+		sequential = 1;
+	else if (argc != 5)
+	{
+		fprintf(stderr, "Overwrite a file and report the throughput.\n");
+		fprintf(stderr, "Usage: %s <FILE> <FILE_SIZE> <WRITE_SIZE> <NWRITES>"
+		        " [seq]\n", argv[0]);
+		return 1;
+	}
+	filename = argv[1];
+	file_size = strtoul(argv[2], NULL, 0);
+	write_size = strtoul(argv[3], NULL, 0);
+	nwrites = strtoul(argv[4], NULL, 0);
+	if (!write_size || write_size > file_size)
+	{
+		fprintf(stderr, "%s: need 0 < WRITE_SIZE <= FILE_SIZE\n", argv[0]);
+		return 1;
+	}
+
+	buf = malloc(file_size);
+	xassert(buf);
+	memset(buf, 'a', file_size);
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	xassert(fd >= 0);
+	r = pwrite(fd, buf, file_size, 0);
+	xassert(r == file_size);
+	r = fsync(fd);
+	xassert(r >= 0);
+
+	srandom(0);
+	r = gettimeofday(&start, NULL);
+	xassert(r >= 0);
+	for (i = 0; i < nwrites; i++)
+	{
+		off_t off;
+		if (sequential)
+			off = (i * write_size) % (file_size - write_size + 1);
+		else
+			off = random() % (file_size - write_size + 1);
+		buf[i % write_size] = 'a' + i % 26;
+		r = pwrite(fd, buf, write_size, off);
+		xassert(r == write_size);
+	}
+	r = gettimeofday(&end, NULL);
+	xassert(r >= 0);
+
+	r = close(fd);
+	xassert(r >= 0);
+	free(buf);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%lu writes of %zu bytes in %.3f s: %.0f writes/s, %.2f MB/s\n",
+	       nwrites, write_size, secs, nwrites / secs,
+	       nwrites * write_size / secs / (1024 * 1024));
+	return 0;
+}
@@ -6,15 +6,25 @@
 #define BPFS_H
 
 #include "bpfs_structs.h"
+#include "bpfs_ioctl.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #define MODE_SP 1
 #define MODE_SCSP 2
 #define MODE_BPFS 3
 
-#define COMMIT_MODE MODE_BPFS
+// The mode to mount in unless bpfs_options.mode selects another
+#define COMMIT_MODE_DEFAULT MODE_BPFS
+
+// The core (libbpfs.c, crawler.c, indirect_cow.c) is compiled once per mode
+// with COMMIT_MODE set, and commit_mode.c dispatches to the mounted mode's
+// copy (see the Makefile). Compiled alone, the core is the default mode's.
+#ifndef COMMIT_MODE
+# define COMMIT_MODE COMMIT_MODE_DEFAULT
+#endif
 
 // Allow in-place append writes
 #define SCSP_OPT_APPEND (1 && COMMIT_MODE == MODE_SCSP)
@@ -26,6 +36,18 @@
 // NOTE: This causes additional writes.
 #define DETECT_ZEROLINKS_WITH_LINKS (0 && !defined(NDEBUG))
 
+// Count writes per operation type for BPFS_IOC_STATS
+#define WRITE_STATS 1
+// Time operations and their phases for bpfs_latency_dump()
+#define LATENCY_STATS 1
+// Count the bytes, cache lines, and words each BPRAM_STORE(), BPRAM_MEMCPY(),
+// and BPRAM_MEMSET() site writes to BPRAM (in the format of bench/bpramcount)
+#define STORE_STATS 0
+// Emulate NVM write and read costs when the nvm_* options are set
+#define NVM_EMULATION 1
+// Compile in the static probes of probes.h (when <sys/sdt.h> is available)
+#define USDT_PROBES 1
+
 #define SCSP_OPT_DIRECT (SCSP_OPT_APPEND || SCSP_OPT_TIME)
 #define INDIRECT_COW (COMMIT_MODE == MODE_SCSP)
 
@@ -45,6 +67,13 @@ enum commit {
 
 // Max size that can be written atomically (hardcoded for unsafe 32b testing)
 #define ATOMIC_SIZE 8
+// Size of the aligned chunks that atomic_write16() writes (with CMPXCHG16B)
+#define ATOMIC16_SIZE 16
+
+// Return whether atomic_write16() can write dst[0, size): whether the CPU
+// supports it and the region is within one aligned ATOMIC16_SIZE chunk
+bool can_atomic_write16(const void *dst, unsigned size);
+void atomic_write16(void *dst, const void *src, unsigned size);
 
 #define BPFS_EOF UINT64_MAX
 
@@ -89,6 +118,102 @@ int truncate_block_zero(struct bpfs_tree_root *root,
                         uint64_t begin, uint64_t end, uint64_t valid,
                         uint64_t *blockno);
 
+#if COMMIT_MODE != MODE_BPFS
+// Note that the current operation changes the file system (for group commit)
+void group_note_write(void);
+// Note that the current operation changes inode ino (for group rollback)
+void group_note_inode(uint64_t ino);
+#endif
+
+#if WRITE_STATS
+// The counts of the current operation
+extern struct bpfs_stats_counts *stats_op;
+# define STATS_ADD(field, n) (stats_op->field += (n))
+// Count the size bytes just copied to dst if dst is in BPRAM
+void stats_bpram_copy(const void *dst, uint64_t size);
+# define STATS_BPRAM_COPY(dst, size) stats_bpram_copy(dst, size)
+// Count the size bytes about to be stored to dst if dst is in BPRAM
+void stats_bpram_store(const void *dst, uint64_t size);
+# define STATS_BPRAM_STORE(dst, size) stats_bpram_store(dst, size)
+#else
+# define STATS_ADD(field, n) ((void) 0)
+# define STATS_BPRAM_COPY(dst, size) ((void) 0)
+# define STATS_BPRAM_STORE(dst, size) ((void) 0)
+#endif
+
+#if LATENCY_STATS
+// Start timing phase (an enum bpfs_latency_phase). Of nested phases of the
+// same type, only the outermost is timed.
+uint64_t latency_begin(unsigned phase);
+// Stop timing phase, for which latency_begin() returned start
+void latency_end(unsigned phase, uint64_t start);
+# define LATENCY_BEGIN(phase) latency_begin(phase)
+# define LATENCY_END(phase, start) latency_end(phase, start)
+#else
+# define LATENCY_BEGIN(phase) ((uint64_t) 0)
+# define LATENCY_END(phase, start) ((void) (start))
+#endif
+
+#if NVM_EMULATION
+// Whether to emulate the cost of stores (bpfs_options.nvm_write_*)
+extern bool nvm_stores;
+// Note the size bytes about to be written to dst if dst is in BPRAM
+void nvm_store(const void *dst, uint64_t size);
+// Delay for the cost of persisting the stores since the last persist
+void nvm_persist(void);
+# define NVM_PERSIST() nvm_persist()
+#else
+# define NVM_PERSIST() ((void) 0)
+#endif
+
+// Stores to BPRAM. BPRAM_STORE()'s lvalue must not have side effects.
+#if STORE_STATS
+struct store_site
+{
+	const char *file;
+	const char *func;
+	unsigned line;
+	const void *ip; // in func, for addr2line
+	uint64_t bytes, lines, words;
+	struct store_site *next;
+};
+// Count the size bytes about to be written to dst if dst is in BPRAM
+void store_count(struct store_site *site, const void *dst, uint64_t size)
+	__attribute__((noinline));
+# define STORE_COUNT(dst, size) \
+	do { \
+		static struct store_site store_site__ = {__FILE__, __func__, __LINE__}; \
+		STATS_BPRAM_STORE(dst, size); \
+		store_count(&store_site__, dst, size); \
+	} while (0)
+#elif NVM_EMULATION
+# define STORE_COUNT(dst, size) \
+	(STATS_BPRAM_STORE(dst, size), \
+	 nvm_stores ? nvm_store(dst, size) : (void) 0)
+#else
+# define STORE_COUNT(dst, size) STATS_BPRAM_STORE(dst, size)
+#endif
+
+#define BPRAM_STORE(lvalue, value) \
+	do { \
+		STORE_COUNT((const void*) &(lvalue), sizeof(lvalue)); \
+		(lvalue) = (value); \
+	} while (0)
+#define BPRAM_MEMCPY(dst, src, n) \
+	do { \
+		void *store_dst__ = (dst); \
+		size_t store_n__ = (n); \
+		STORE_COUNT(store_dst__, store_n__); \
+		memcpy(store_dst__, src, store_n__); \
+	} while (0)
+#define BPRAM_MEMSET(dst, c, n) \
+	do { \
+		void *store_dst__ = (dst); \
+		size_t store_n__ = (n); \
+		STORE_COUNT(store_dst__, store_n__); \
+		memset(store_dst__, c, store_n__); \
+	} while (0)
+
 
 static __inline
 unsigned block_offset(const void *x)
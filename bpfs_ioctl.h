@@ -0,0 +1,116 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef BPFS_IOCTL_H
+#define BPFS_IOCTL_H
+
+// ioctls for BPFS files, for use by applications
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Compact a directory: pack its dirents and free its trailing empty blocks.
+// Returns the number of bytes reclaimed. Fails with EBUSY if the directory
+// has other open handles. Offsets from earlier reads of the directory are
+// invalid afterwards; rewind it before reading again.
+#define BPFS_IOC_COMPACT _IOR('B', 1, uint64_t)
+
+// Transactions: the operations of the process that called BEGIN that
+// change the file system become durable together at COMMIT. Only supported
+// in SP mode (EOPNOTSUPP otherwise). Until the transaction ends, other
+// processes' operations that change the file system (including COMPACT,
+// COMMIT, and ABORT) fail with EBUSY rather than wait, since the kernel
+// holds locks that the owner may need until they complete; retry them
+// later. Their fsyncs succeed. BEGIN fails with EBUSY while a transaction
+// is open. The owner's fsync does not commit its open transaction. An operation of the transaction that fails
+// after changing the file system rolls back the transaction, and COMMIT
+// then fails with EIO. ABORT, or closing the last descriptor of the file
+// that BEGIN was called on, rolls back the transaction.
+#define BPFS_IOC_TXN_BEGIN _IO('B', 2)
+#define BPFS_IOC_TXN_COMMIT _IO('B', 3)
+#define BPFS_IOC_TXN_ABORT _IO('B', 4)
+
+// Write accounting, per operation type (see libbpfs.h). The commits of
+// operation groups (-o group_max) count towards BPFS_STATS_OP_GROUP, and
+// mount and unmount towards BPFS_STATS_OP_OTHER. See bpfsstat.c.
+enum bpfs_stats_op {
+	BPFS_STATS_OP_OTHER,
+	BPFS_STATS_OP_GROUP,
+	BPFS_STATS_OP_STATFS,
+	BPFS_STATS_OP_LOOKUP,
+	BPFS_STATS_OP_GETATTR,
+	BPFS_STATS_OP_SETATTR,
+	BPFS_STATS_OP_READLINK,
+	BPFS_STATS_OP_MKNOD,
+	BPFS_STATS_OP_MKDIR,
+	BPFS_STATS_OP_UNLINK,
+	BPFS_STATS_OP_RMDIR,
+	BPFS_STATS_OP_SYMLINK,
+	BPFS_STATS_OP_RENAME,
+	BPFS_STATS_OP_LINK,
+	BPFS_STATS_OP_OPENDIR,
+	BPFS_STATS_OP_READDIR,
+	BPFS_STATS_OP_RELEASEDIR,
+	BPFS_STATS_OP_FSYNCDIR,
+	BPFS_STATS_OP_CREATE,
+	BPFS_STATS_OP_OPEN,
+	BPFS_STATS_OP_READ,
+	BPFS_STATS_OP_WRITE,
+	BPFS_STATS_OP_FSYNC,
+	BPFS_STATS_OP_IOCTL,
+	BPFS_STATS_NOPS
+};
+
+// Initializer for an array of the names of the operation types
+#define BPFS_STATS_OP_NAMES \
+	{ \
+		[BPFS_STATS_OP_OTHER] = "other", \
+		[BPFS_STATS_OP_GROUP] = "group", \
+		[BPFS_STATS_OP_STATFS] = "statfs", \
+		[BPFS_STATS_OP_LOOKUP] = "lookup", \
+		[BPFS_STATS_OP_GETATTR] = "getattr", \
+		[BPFS_STATS_OP_SETATTR] = "setattr", \
+		[BPFS_STATS_OP_READLINK] = "readlink", \
+		[BPFS_STATS_OP_MKNOD] = "mknod", \
+		[BPFS_STATS_OP_MKDIR] = "mkdir", \
+		[BPFS_STATS_OP_UNLINK] = "unlink", \
+		[BPFS_STATS_OP_RMDIR] = "rmdir", \
+		[BPFS_STATS_OP_SYMLINK] = "symlink", \
+		[BPFS_STATS_OP_RENAME] = "rename", \
+		[BPFS_STATS_OP_LINK] = "link", \
+		[BPFS_STATS_OP_OPENDIR] = "opendir", \
+		[BPFS_STATS_OP_READDIR] = "readdir", \
+		[BPFS_STATS_OP_RELEASEDIR] = "releasedir", \
+		[BPFS_STATS_OP_FSYNCDIR] = "fsyncdir", \
+		[BPFS_STATS_OP_CREATE] = "create", \
+		[BPFS_STATS_OP_OPEN] = "open", \
+		[BPFS_STATS_OP_READ] = "read", \
+		[BPFS_STATS_OP_WRITE] = "write", \
+		[BPFS_STATS_OP_FSYNC] = "fsync", \
+		[BPFS_STATS_OP_IOCTL] = "ioctl", \
+	}
+
+struct bpfs_stats_counts
+{
+	uint64_t nops;           // operations (or group commits)
+	uint64_t store_bytes;    // bytes written to BPRAM by any store
+	uint64_t bpram_bytes;    // bytes memcpy'd into BPRAM
+	uint64_t cow_blocks;     // blocks CoWed
+	uint64_t cow_bytes;      // bytes copied by the CoWs
+	uint64_t zero_bytes;     // bytes zeroed in new blocks and truncated tails
+	uint64_t indir_levels;   // indirect blocks crawled to write
+	uint64_t atomic_commits; // in-place atomic writes that commit changes
+	uint64_t super_commits;  // SP commits by rewriting the superblocks
+};
+
+struct bpfs_stats
+{
+	struct bpfs_stats_counts op[BPFS_STATS_NOPS];
+};
+
+// Copy out the write accounting, for any file. The counts start at zero
+// at mount and are not persistent.
+#define BPFS_IOC_STATS _IOR('B', 5, struct bpfs_stats)
+
+#endif
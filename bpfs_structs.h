@@ -11,7 +11,7 @@
 
 #define BPFS_FS_MAGIC 0xB9F5
 
-#define BPFS_STRUCT_VERSION 7
+#define BPFS_STRUCT_VERSION 8
 
 #define BPFS_BLOCK_SIZE 4096
 
@@ -128,7 +128,11 @@ struct bpfs_inode
 	struct bpfs_time atime;
 	struct bpfs_time ctime;
 	struct bpfs_time mtime;
-	uint8_t pad[68]; // pad to evenly fill a block
+	uint32_t pad_size; // align size
+	// File size when it exceeds root.nbytes, otherwise 0.
+	// root.nbytes is the valid watermark; bytes past it read as zeros.
+	uint64_t size;
+	uint8_t pad[56]; // pad to evenly fill a block
 };
 
 #define BPFS_INODES_PER_BLOCK (BPFS_BLOCK_SIZE / sizeof(struct bpfs_inode))
@@ -0,0 +1,89 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef BPFS_TRACE_H
+#define BPFS_TRACE_H
+
+// The format of the FUSE operation traces that bpfs -o trace=FILE records
+// and bench/bpfsreplay replays: a struct bpfs_trace_header followed by one
+// struct bpfs_trace_rec per operation, each followed by its names and data.
+// Integers are in host byte order.
+
+#include <stdint.h>
+
+#define BPFS_TRACE_MAGIC 0x43525442 // "BTRC"
+#define BPFS_TRACE_VERSION 1
+
+struct bpfs_trace_header
+{
+	uint32_t magic;
+	uint32_t version;
+	// The recording's group commit setting (its syncs are recorded)
+	int32_t group_max;
+	uint32_t pad;
+	char mode[64]; // bpfs_mode_str()
+};
+
+// Each op's arguments. ino is the inode or parent directory, and name and
+// name2 follow the record. Those marked ENTRY set result to the resulting
+// inode number on success (rename: the inode renamed).
+enum bpfs_trace_op
+{
+	BPFS_TRACE_STATFS,     //
+	BPFS_TRACE_LOOKUP,     // ino, name; ENTRY
+	BPFS_TRACE_GETATTR,    // ino
+	BPFS_TRACE_SETATTR,    // ino, arg[0] to_set; struct bpfs_trace_attr data
+	BPFS_TRACE_READLINK,   // ino
+	BPFS_TRACE_MKNOD,      // ino, name, arg[0] mode, arg[1] uid, arg[2] gid; ENTRY
+	BPFS_TRACE_MKDIR,      // ino, name, arg[0] mode, arg[1] uid, arg[2] gid; ENTRY
+	BPFS_TRACE_UNLINK,     // ino, name
+	BPFS_TRACE_RMDIR,      // ino, name
+	BPFS_TRACE_SYMLINK,    // ino, name, name2 link, arg[1] uid, arg[2] gid; ENTRY
+	BPFS_TRACE_RENAME,     // ino, name, arg[0] dst parent, name2 dst; ENTRY
+	BPFS_TRACE_LINK,       // ino, arg[0] parent, name; ENTRY
+	BPFS_TRACE_OPENDIR,    // ino
+	BPFS_TRACE_READDIR,    // ino, arg[0] off, arg[1] max_size
+	BPFS_TRACE_RELEASEDIR, // ino
+	BPFS_TRACE_FSYNCDIR,   // ino, arg[0] datasync
+	BPFS_TRACE_CREATE,     // ino, name, arg[0] mode, arg[1] uid, arg[2] gid; ENTRY
+	BPFS_TRACE_OPEN,       // ino
+	BPFS_TRACE_READ,       // ino, arg[0] off, arg[1] size
+	BPFS_TRACE_WRITE,      // ino, arg[0] off, arg[1] size (data not kept)
+	BPFS_TRACE_FSYNC,      // ino, arg[0] datasync
+	BPFS_TRACE_IOCTL,      // ino, arg[0] cmd
+	BPFS_TRACE_SYNC,       // the frontend committed the group (bpfs_sync())
+	BPFS_TRACE_NOPS
+};
+
+#define BPFS_TRACE_OP_NAMES \
+	{"statfs", "lookup", "getattr", "setattr", "readlink", "mknod", "mkdir", \
+	 "unlink", "rmdir", "symlink", "rename", "link", "opendir", "readdir", \
+	 "releasedir", "fsyncdir", "create", "open", "read", "write", "fsync", \
+	 "ioctl", "sync"}
+
+struct bpfs_trace_rec
+{
+	uint64_t time_ns; // since the trace began
+	uint64_t ino;
+	uint64_t arg[3];
+	int64_t result;   // the operation's return value (see ENTRY)
+	uint16_t op;
+	uint16_t name_len; // not counting a NUL (none is recorded)
+	uint16_t name2_len;
+	uint16_t data_len;
+};
+
+// BPFS_TRACE_SETATTR's data
+struct bpfs_trace_attr
+{
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t pad;
+	uint64_t size;
+	int64_t atime;
+	int64_t mtime;
+};
+
+#endif
@@ -0,0 +1,61 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#include "bpfs_ioctl.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static const char *op_names[BPFS_STATS_NOPS] = BPFS_STATS_OP_NAMES;
+
+int main(int argc, char **argv)
+{
+	struct bpfs_stats stats;
+	unsigned i;
+	int fd;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "Print the write accounting of a mounted BPFS.\n");
+		fprintf(stderr, "Usage: %s <FILE>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, BPFS_IOC_STATS, &stats) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("%-10s %10s %12s %12s %10s %12s %12s %10s %10s %10s\n",
+	       "op", "nops", "store_bytes", "bpram_bytes", "cow_blocks", "cow_bytes",
+	       "zero_bytes", "indir", "atomic", "super");
+	for (i = 0; i < BPFS_STATS_NOPS; i++)
+	{
+		const struct bpfs_stats_counts *c = &stats.op[i];
+		if (!c->nops)
+			continue;
+		printf("%-10s %10" PRIu64 " %12" PRIu64 " %12" PRIu64 " %10" PRIu64 " %12" PRIu64
+		       " %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       op_names[i], c->nops, c->store_bytes, c->bpram_bytes, c->cow_blocks,
+		       c->cow_bytes, c->zero_bytes, c->indir_levels,
+		       c->atomic_commits, c->super_commits);
+	}
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+// Runtime commit mode selection. The Makefile compiles the core once per
+// commit mode, each specialized for its mode, and prefixes the external
+// names of each copy with mode_<mode>_ (e.g., mode_sp_bpfs_lookup). This
+// file implements the libbpfs.h API by calling the copy of the mode that
+// the file system mounted in, or of COMMIT_MODE_DEFAULT when unmounted.
+
+#include "libbpfs.h"
+#include "bpfs.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <strings.h>
+
+// The libbpfs.h functions, as X(prefix, return type, name, parameters,
+// arguments), or V(prefix, name, parameters, arguments) for those that
+// return void. This file implements those in LIBBPFS_MOUNT_FUNCS itself
+// and forwards the others to the current mode.
+#define LIBBPFS_MOUNT_FUNCS(X, V, p) \
+	X(p, int, bpfs_mount_file, \
+	  (const char *filename, const struct bpfs_options *opts), \
+	  (filename, opts)) \
+	X(p, int, bpfs_mount_ephemeral, \
+	  (size_t size, const struct bpfs_options *opts), (size, opts)) \
+	V(p, bpfs_unmount, (void), ()) \
+	V(p, bpfs_set_notify, (const struct bpfs_notify *notify), (notify))
+
+#define LIBBPFS_FUNCS(X, p) \
+	X(p, const char*, bpfs_mode_str, (void), ()) \
+	X(p, int, bpfs_statfs, (struct statvfs *stv), (stv)) \
+	X(p, int, bpfs_lookup, \
+	  (uint64_t parent_ino, const char *name, struct bpfs_entry *e), \
+	  (parent_ino, name, e)) \
+	X(p, int, bpfs_getattr, (uint64_t ino, struct stat *stbuf), \
+	  (ino, stbuf)) \
+	X(p, int, bpfs_setattr, \
+	  (uint64_t ino, const struct stat *attr, int to_set, \
+	   struct stat *stbuf), \
+	  (ino, attr, to_set, stbuf)) \
+	X(p, int, bpfs_readlink, (uint64_t ino, char *buf, size_t size), \
+	  (ino, buf, size)) \
+	X(p, int, bpfs_mknod, \
+	  (uint64_t parent_ino, const char *name, mode_t mode, uid_t uid, \
+	   gid_t gid, struct bpfs_entry *e), \
+	  (parent_ino, name, mode, uid, gid, e)) \
+	X(p, int, bpfs_mkdir, \
+	  (uint64_t parent_ino, const char *name, mode_t mode, uid_t uid, \
+	   gid_t gid, struct bpfs_entry *e), \
+	  (parent_ino, name, mode, uid, gid, e)) \
+	X(p, int, bpfs_unlink, (uint64_t parent_ino, const char *name), \
+	  (parent_ino, name)) \
+	X(p, int, bpfs_rmdir, (uint64_t parent_ino, const char *name), \
+	  (parent_ino, name)) \
+	X(p, int, bpfs_symlink, \
+	  (const char *link, uint64_t parent_ino, const char *name, uid_t uid, \
+	   gid_t gid, struct bpfs_entry *e), \
+	  (link, parent_ino, name, uid, gid, e)) \
+	X(p, int, bpfs_rename, \
+	  (uint64_t src_parent_ino, const char *src_name, \
+	   uint64_t dst_parent_ino, const char *dst_name), \
+	  (src_parent_ino, src_name, dst_parent_ino, dst_name)) \
+	X(p, int, bpfs_link, \
+	  (uint64_t ino, uint64_t parent_ino, const char *name, \
+	   struct bpfs_entry *e), \
+	  (ino, parent_ino, name, e)) \
+	X(p, int, bpfs_opendir, (uint64_t ino), (ino)) \
+	X(p, int, bpfs_readdir, \
+	  (uint64_t ino, int64_t off, bpfs_readdir_filler_t filler, void *user), \
+	  (ino, off, filler, user)) \
+	X(p, int, bpfs_releasedir, (uint64_t ino), (ino)) \
+	X(p, int, bpfs_fsyncdir, (uint64_t ino, int datasync), (ino, datasync)) \
+	X(p, int, bpfs_create, \
+	  (uint64_t parent_ino, const char *name, mode_t mode, uid_t uid, \
+	   gid_t gid, struct bpfs_entry *e), \
+	  (parent_ino, name, mode, uid, gid, e)) \
+	X(p, int, bpfs_open, (uint64_t ino), (ino)) \
+	X(p, int, bpfs_read_iov, \
+	  (uint64_t ino, uint64_t off, size_t size, struct iovec **piov, \
+	   int *pcount), \
+	  (ino, off, size, piov, pcount)) \
+	X(p, ssize_t, bpfs_read, \
+	  (uint64_t ino, void *buf, size_t size, uint64_t off), \
+	  (ino, buf, size, off)) \
+	X(p, ssize_t, bpfs_write, \
+	  (uint64_t ino, const void *buf, size_t size, uint64_t off), \
+	  (ino, buf, size, off)) \
+	X(p, int, bpfs_fsync, (uint64_t ino, int datasync), (ino, datasync)) \
+	X(p, int, bpfs_compact, (uint64_t ino, uint64_t *reclaimed), \
+	  (ino, reclaimed)) \
+	X(p, int, bpfs_txn_begin, (void), ()) \
+	X(p, int, bpfs_txn_commit, (void), ()) \
+	X(p, int, bpfs_txn_abort, (void), ()) \
+	X(p, int, bpfs_get_stats, (struct bpfs_stats *stats), (stats)) \
+	X(p, bool, bpfs_group_pending, (void), ()) \
+	X(p, int, bpfs_group_timeout, (void), ()) \
+	X(p, uint64_t, bpfs_latency_now, (void), ())
+
+#define LIBBPFS_VOID_FUNCS(V, p) \
+	V(p, bpfs_sync, (void), ()) \
+	V(p, bpfs_latency_op, (uint64_t start), (start)) \
+	V(p, bpfs_latency_phase, \
+	  (enum bpfs_latency_phase phase, uint64_t start), (phase, start)) \
+	V(p, bpfs_latency_dump, (FILE *file), (file))
+
+#define ALL_FUNCS(X, V, p) \
+	LIBBPFS_MOUNT_FUNCS(X, V, p) LIBBPFS_FUNCS(X, p) LIBBPFS_VOID_FUNCS(V, p)
+
+#define DECLARE(p, type, name, params, args) type p##name params;
+#define DECLARE_VOID(p, name, params, args) void p##name params;
+ALL_FUNCS(DECLARE, DECLARE_VOID, mode_sp_)
+ALL_FUNCS(DECLARE, DECLARE_VOID, mode_scsp_)
+ALL_FUNCS(DECLARE, DECLARE_VOID, mode_bpfs_)
+
+struct commit_mode
+{
+	enum bpfs_mode mode;
+	const char *name;
+#define FIELD(p, type, name, params, args) type (*name) params;
+#define FIELD_VOID(p, name, params, args) void (*name) params;
+	ALL_FUNCS(FIELD, FIELD_VOID, )
+};
+
+#define INIT(p, type, name, params, args) p##name,
+#define INIT_VOID(p, name, params, args) p##name,
+
+static const struct commit_mode modes[] =
+{
+	{BPFS_MODE_SP, "sp", ALL_FUNCS(INIT, INIT_VOID, mode_sp_)},
+	{BPFS_MODE_SCSP, "scsp", ALL_FUNCS(INIT, INIT_VOID, mode_scsp_)},
+	{BPFS_MODE_BPFS, "bpfs", ALL_FUNCS(INIT, INIT_VOID, mode_bpfs_)},
+};
+
+#define NMODES (sizeof(modes) / sizeof(*modes))
+
+// The mode mounted in, or that operations outside of a mount go to
+static const struct commit_mode *cur_mode = &modes[COMMIT_MODE_DEFAULT - 1];
+static bool mounted;
+
+int bpfs_mode_parse(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < NMODES; i++)
+		if (!strcasecmp(name, modes[i].name))
+			return modes[i].mode;
+	return -EINVAL;
+}
+
+static int select_mode(const struct bpfs_options *opts)
+{
+	enum bpfs_mode mode = opts ? opts->mode : BPFS_MODE_DEFAULT;
+
+	static_assert(BPFS_MODE_SP == MODE_SP && BPFS_MODE_SCSP == MODE_SCSP
+	              && BPFS_MODE_BPFS == MODE_BPFS);
+
+	if (mounted)
+		return -EBUSY;
+	if (mode == BPFS_MODE_DEFAULT)
+		mode = COMMIT_MODE_DEFAULT;
+	if (mode < BPFS_MODE_SP || mode > BPFS_MODE_BPFS)
+		return -EINVAL;
+	cur_mode = &modes[mode - 1];
+	assert(cur_mode->mode == mode);
+	return 0;
+}
+
+int bpfs_mount_file(const char *filename, const struct bpfs_options *opts)
+{
+	int r = select_mode(opts);
+	if (r >= 0 && (r = cur_mode->bpfs_mount_file(filename, opts)) >= 0)
+		mounted = true;
+	return r;
+}
+
+int bpfs_mount_ephemeral(size_t size, const struct bpfs_options *opts)
+{
+	int r = select_mode(opts);
+	if (r >= 0 && (r = cur_mode->bpfs_mount_ephemeral(size, opts)) >= 0)
+		mounted = true;
+	return r;
+}
+
+void bpfs_unmount(void)
+{
+	cur_mode->bpfs_unmount();
+	mounted = false;
+}
+
+// Set each mode's notify, for whichever mounts
+void bpfs_set_notify(const struct bpfs_notify *notify)
+{
+	unsigned i;
+	for (i = 0; i < NMODES; i++)
+		modes[i].bpfs_set_notify(notify);
+}
+
+#define FORWARD(p, type, name, params, args) \
+	type name params { return cur_mode->name args; }
+#define FORWARD_VOID(p, name, params, args) \
+	void name params { cur_mode->name args; }
+LIBBPFS_FUNCS(FORWARD, )
+LIBBPFS_VOID_FUNCS(FORWARD_VOID, )
@@ -4,7 +4,9 @@
 
 #include "crawler.h"
 #include "bpfs.h"
+#include "libbpfs.h"
 #include "indirect_cow.h"
+#include "probes.h"
 #include "util.h"
 
 #include <sys/mman.h>
@@ -56,6 +58,13 @@ static int crawl_leaf(uint64_t prev_blockno, uint64_t blockoff,
 		             crawl_start, child_commit, user, &child_blockno);
 		if (r >= 0 && prev_blockno != child_blockno)
 			*new_blockno = child_blockno;
+#if COMMIT_MODE == MODE_BPFS
+		else if (r >= 0 && child_commit == COMMIT_ATOMIC && off < valid)
+			STATS_ADD(atomic_commits, 1);
+#endif
+		// callbacks may write [off, off + size) in place
+		if (r >= 0 && commit != COMMIT_NONE)
+			indirect_cow_block_dirty(child_blockno, off, size);
 	}
 	else
 	{
@@ -84,7 +93,7 @@ static int crawl_hole(uint64_t blockoff,
 	while (off < end)
 	{
 		unsigned child_off = off % BPFS_BLOCK_SIZE;
-		unsigned child_size = MIN(end - off, BPFS_BLOCK_SIZE);
+		unsigned child_size = MIN(end - off, BPFS_BLOCK_SIZE - child_off);
 		unsigned child_valid = MIN(valid - off_block, BPFS_BLOCK_SIZE);
 		uint64_t child_blockno = BPFS_BLOCKNO_INVALID;
 		int r;
@@ -121,6 +130,10 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 	uint64_t in_hole = false;
 	bool only_invalid = off >= valid;
 	enum commit child_commit;
+	// Old entries [uncopied_no, lastno] that a partial CoW did not copy
+	// (on the stack: 4 KB per level of the crawl)
+	uint64_t uncopied[BPFS_BLOCKNOS_PER_INDIR - 1];
+	uint64_t uncopied_no = lastno + 1;
 	uint64_t no;
 	int ret = 0;
 
@@ -137,6 +150,8 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 		child_commit = commit;
 		break;
 	}
+	if (commit != COMMIT_NONE)
+		STATS_ADD(indir_levels, 1);
 
 	if (blockno == BPFS_BLOCKNO_INVALID)
 	{
@@ -196,6 +211,8 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 
 		if (!child_valid || in_hole)
 			child_blockno = child_new_blockno = BPFS_BLOCKNO_INVALID;
+		else if (no >= uncopied_no)
+			child_blockno = child_new_blockno = uncopied[no - uncopied_no];
 		else
 			child_blockno = child_new_blockno = indir->addr[no];
 
@@ -224,21 +241,48 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 			if (!(prev_blockno != blockno
 			      || (SCSP_OPT_APPEND && only_invalid)
 			      || (COMMIT_MODE == MODE_BPFS
-			          && ((commit == COMMIT_ATOMIC && single)
+			          && ((commit == COMMIT_ATOMIC && (single || only_invalid))
 			              || !child_valid))))
 			{
-#if COMMIT_MODE == MODE_BPFS
-				// Could avoid the CoW in this case, but it should not occur:
-				assert(!(commit == COMMIT_ATOMIC && only_invalid));
+				// Entries [no, lastno] are likely to be overwritten, so
+				// copy only the others. Keep the old ones in DRAM for the
+				// children that turn out not to change.
+				uint64_t ncrawl = lastno + 1 - no;
+				uint64_t new_blockno;
+
+#if INDIRECT_COW
+				// cow_block() copies all of the block to a DRAM shadow
+				ncrawl = 1;
+#elif COMMIT_MODE != MODE_BPFS
+				// cow_block() will keep this block, so there is no copy
+				if (block_freshly_alloced(blockno))
+					ncrawl = 1;
 #endif
-				// TODO: avoid copying data that will be overwritten?
-				if ((blockno = cow_block_entire(blockno))
-				    == BPFS_BLOCKNO_INVALID)
+				assert(uncopied_no == lastno + 1);
+				if (ncrawl > 1)
+				{
+					assert(ncrawl - 1 <= BPFS_BLOCKNOS_PER_INDIR - 1);
+					memcpy(uncopied, &indir->addr[no + 1],
+					       (ncrawl - 1) * sizeof(*uncopied));
+					uncopied_no = no + 1;
+				}
+				new_blockno = cow_block(blockno, no * sizeof(*indir->addr),
+				                        ncrawl * sizeof(*indir->addr),
+				                        validno * sizeof(*indir->addr));
+				if (new_blockno == BPFS_BLOCKNO_INVALID)
 					return -ENOSPC;
+				blockno = new_blockno;
 				// indirect_cow_block_required(blockno) not required
 				indir = (struct bpfs_indir_block*) get_block(blockno);
 			}
-			indir->addr[no] = child_new_blockno;
+#if COMMIT_MODE == MODE_BPFS
+			else if (prev_blockno == blockno && commit == COMMIT_ATOMIC
+			         && !only_invalid && child_valid)
+				STATS_ADD(atomic_commits, 1);
+#endif
+			BPRAM_STORE(indir->addr[no], child_new_blockno);
+			indirect_cow_block_dirty(blockno, no * sizeof(*indir->addr),
+			                         sizeof(*indir->addr));
 #if INDIRECT_COW
 			// Neccessary for plugging a file hole.
 			// There may be broader related problems, e.g, when increasing
@@ -253,6 +297,12 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 				indirect_cow_block_direct(blockno, no * sizeof(*indir->addr),
 				                          sizeof(*indir->addr));
 		}
+		else if (no >= uncopied_no)
+		{
+			BPRAM_STORE(indir->addr[no], child_blockno);
+			indirect_cow_block_dirty(blockno, no * sizeof(*indir->addr),
+			                         sizeof(*indir->addr));
+		}
 		if (r == 1)
 		{
 			assert(!in_hole); // TODO: set the remaining entries to invalid
@@ -261,6 +311,17 @@ static int crawl_indir(uint64_t prev_blockno, uint64_t blockoff,
 		}
 	}
 
+	// Restore the old entries the crawl stopped before reaching
+	if (uncopied_no <= lastno && no < lastno)
+	{
+		uint64_t n = lastno - no;
+		BPRAM_MEMCPY(&indir->addr[no + 1], &uncopied[no + 1 - uncopied_no],
+		       n * sizeof(*indir->addr));
+		STATS_BPRAM_COPY(&indir->addr[no + 1], n * sizeof(*indir->addr));
+		indirect_cow_block_dirty(blockno, (no + 1) * sizeof(*indir->addr),
+		                         n * sizeof(*indir->addr));
+	}
+
 	if (bcallback && !off)
 	{
 		assert(commit == COMMIT_NONE);
@@ -410,7 +471,11 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 	else
 	{
 		assert(end <= root->nbytes);
-		child_size = MIN(size, max_nblocks * BPFS_BLOCK_SIZE - off);
+		// root->nbytes can exceed the tree's capacity (v7 file systems)
+		if (off < max_nblocks * BPFS_BLOCK_SIZE)
+			child_size = MIN(size, max_nblocks * BPFS_BLOCK_SIZE - off);
+		else
+			child_size = 0;
 	}
 	child_valid = MIN(root->nbytes, max_nblocks * BPFS_BLOCK_SIZE);
 
@@ -433,6 +498,8 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 		else
 			r = 0;
 	}
+	else if (!child_size)
+		r = 0;
 	else
 	{
 		r = crawl_indir(child_new_blockno, off / BPFS_BLOCK_SIZE,
@@ -454,16 +521,19 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 			assert(*prev_blockno == new_blockno);
 			if (r == 0)
 				r = crawl_hole((off + child_size) / BPFS_BLOCK_SIZE,
-				               child_size, size - child_size, root->nbytes,
+				               off + child_size, size - child_size, root->nbytes,
 				               off, callback, user);
 		}
 		else if (change_addr || change_size || change_height_holes)
 		{
 			bool overwrite = off < root->nbytes;
 			bool inplace;
+			// Commit the new address and size with one atomic_write16()
+			bool root16 = false;
 
-			// FYI:
-			assert(!(!change_addr && overwrite && change_size));
+			// FYI: !change_addr && overwrite && change_size is possible
+			// when the write is in place into blocks this transaction
+			// already copied or allocated (e.g., by SP group commit).
 
 #if COMMIT_MODE != MODE_BPFS
 			assert(blockno_refed || block_freshly_alloced(*prev_blockno));
@@ -472,13 +542,27 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 			if (*prev_blockno != new_blockno || !blockno_refed)
 				inplace = true;
 			else if (change_addr && overwrite && change_size)
+			{
 				inplace = commit == COMMIT_FREE;
+#if COMMIT_MODE == MODE_BPFS
+				static_assert(sizeof(*root) == ATOMIC16_SIZE);
+				root16 = !inplace && commit == COMMIT_ATOMIC
+				         && can_atomic_write16(root, sizeof(*root));
+				inplace = inplace || root16;
+				if (root16)
+					STATS_ADD(atomic_commits, 1);
+#endif
+			}
 			else
 			{
 				inplace = commit == COMMIT_FREE;
 #if COMMIT_MODE == MODE_BPFS
 				static_assert(COMMIT_ATOMIC != COMMIT_COPY);
-				inplace = inplace || commit == COMMIT_ATOMIC;
+				if (!inplace && commit == COMMIT_ATOMIC)
+				{
+					STATS_ADD(atomic_commits, 1);
+					inplace = true;
+				}
 #endif
 			}
 
@@ -494,8 +578,21 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 				           (get_block(new_blockno) + root_off);
 			}
 
-			if (change_addr)
+			if (root16)
+			{
+				struct bpfs_tree_root new_root = *root;
+				ha_set_addr(&new_root.ha, child_new_blockno);
+				new_root.nbytes = end;
+				atomic_write16(root, &new_root, sizeof(new_root));
+			}
+			else if (change_addr)
 			{
+#if INDIRECT_COW
+				// A new child that is not a CoW of an original block
+				// (e.g., a plugged hole) must be committed through root
+				if (!indirect_cow_block_get(child_new_blockno))
+					indirect_cow_block_required(new_blockno);
+#endif
 				ha_set_addr(&root->ha, child_new_blockno);
 #if SCSP_OPT_APPEND
 				if (!root->nbytes)
@@ -504,8 +601,10 @@ static int crawl_tree_ref(struct bpfs_tree_root *root, uint64_t off,
 					                          sizeof(root->ha));
 #endif
 			}
-			if (change_size)
-				root->nbytes = end;
+			if (change_size && !root16)
+				BPRAM_STORE(root->nbytes, end);
+			indirect_cow_block_dirty(new_blockno, block_offset(root),
+			                         sizeof(*root));
 
 			*prev_blockno = new_blockno;
 		}
@@ -523,8 +622,12 @@ int crawl_tree(struct bpfs_tree_root *root, uint64_t off,
                crawl_callback callback, void *user,
                uint64_t *prev_blockno)
 {
-	return crawl_tree_ref(root, off, size, commit, callback, user, prev_blockno,
-	                      true);
+	uint64_t latency_start = LATENCY_BEGIN(BPFS_LATENCY_CRAWL);
+	int r = crawl_tree_ref(root, off, size, commit, callback, user,
+	                       prev_blockno, true);
+	BPFS_PROBE(crawl, off, size, commit, r);
+	LATENCY_END(BPFS_LATENCY_CRAWL, latency_start);
+	return r;
 }
 
 //
@@ -539,6 +642,10 @@ int crawl_inodes(uint64_t off, uint64_t size, enum commit commit,
 	uint64_t child_blockno = super->inode_root_addr;
 	int r;
 
+#if COMMIT_MODE != MODE_BPFS
+	if (commit != COMMIT_NONE)
+		group_note_write();
+#endif
 	if (commit != COMMIT_NONE)
 		xcall(indirect_cow_parent_push(super_blockno));
 	r = crawl_tree(root, off, size, commit, callback, user,
@@ -557,7 +664,13 @@ int crawl_inodes(uint64_t off, uint64_t size, enum commit commit,
 #if COMMIT_MODE == MODE_SCSP
 		assert(super_blockno != BPFS_BLOCKNO_SUPER);
 #endif
-		super->inode_root_addr = child_blockno;
+		BPRAM_STORE(super->inode_root_addr, child_blockno);
+#if COMMIT_MODE == MODE_BPFS
+		STATS_ADD(atomic_commits, 1);
+#endif
+		indirect_cow_block_dirty(super_blockno,
+		                         block_offset(&super->inode_root_addr),
+		                         sizeof(super->inode_root_addr));
 	}
 
 	return r;
@@ -591,6 +704,10 @@ int crawl_inode(uint64_t ino, enum commit commit,
 	uint64_t ino_off;
 
 	xcall(get_inode_offset(ino, &ino_off));
+#if COMMIT_MODE != MODE_BPFS
+	if (commit != COMMIT_NONE)
+		group_note_inode(ino);
+#endif
 
 	return crawl_inodes(ino_off, sizeof(struct bpfs_inode), commit,
 	                    callback_crawl_inode, &ccid);
@@ -17,6 +17,15 @@
 // Fixed-size cache for now. Must be at least 2, for rename. 1024? Why not.
 #define NMDIRS_MAX 1024
 
+// Each mdirectory has a counting Bloom filter of its dirent names so that
+// most lookups of names that do not exist skip the dirents hash map.
+// BLOOM_NHASHES counters per name; the filter doubles (and is rebuilt)
+// when there are more than 1/BLOOM_MAX_LOAD dirents per counter,
+// giving a false positive rate of about 3%.
+#define BLOOM_NHASHES 3
+#define BLOOM_MAX_LOAD 8
+#define BLOOM_MIN_SIZE 256 // must be a power of 2
+
 struct mdirent_free
 {
 	uint64_t off;
@@ -27,7 +36,10 @@ struct mdirent_free
 struct mdirectory
 {
 	hash_map_t *dirents; // name -> mdirent
+	uint64_t dirents_len; // sum of the rec_len of dirents
 	struct mdirent_free *free_dirents;
+	uint8_t *bloom; // counting Bloom filter of the names in dirents
+	size_t bloom_size; // number of counters in bloom; a power of 2
 	uint64_t ino; // inode number of this directory
 	struct mdirectory **lru_polder, *lru_newer;
 };
@@ -67,8 +79,85 @@ static struct mdirent* mdirent_dup(const struct mdirent *md)
 }
 
 
+// Bloom filter
+
+static uint64_t bloom_hash(const char *name)
+{
+	// 64b FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	for (; *name; name++)
+	{
+		h ^= (uint8_t) *name;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Return the index of the i'th counter for hash (double hashing)
+static __inline
+size_t bloom_index(uint64_t hash, unsigned i, size_t size)
+{
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	return (h1 + i * h2) & (size - 1);
+}
+
+static void bloom_add(uint8_t *bloom, size_t size, uint64_t hash)
+{
+	unsigned i;
+	for (i = 0; i < BLOOM_NHASHES; i++)
+	{
+		uint8_t *c = &bloom[bloom_index(hash, i, size)];
+		if (*c != UINT8_MAX)
+			(*c)++;
+	}
+}
+
+static void bloom_rem(uint8_t *bloom, size_t size, uint64_t hash)
+{
+	unsigned i;
+	for (i = 0; i < BLOOM_NHASHES; i++)
+	{
+		uint8_t *c = &bloom[bloom_index(hash, i, size)];
+		assert(*c);
+		// A saturated counter no longer knows its count
+		if (*c != UINT8_MAX)
+			(*c)--;
+	}
+}
+
+static bool bloom_has(const uint8_t *bloom, size_t size, uint64_t hash)
+{
+	unsigned i;
+	for (i = 0; i < BLOOM_NHASHES; i++)
+		if (!bloom[bloom_index(hash, i, size)])
+			return false;
+	return true;
+}
+
+
 // mdirectory
 
+// Double the size of mdir's Bloom filter.
+// On failure the existing filter is kept; it remains correct.
+static void mdirectory_grow_bloom(struct mdirectory *mdir)
+{
+	size_t size = mdir->bloom_size * 2;
+	uint8_t *bloom = calloc(size, sizeof(*bloom));
+	hash_map_it2_t it;
+
+	if (!bloom)
+		return;
+
+	it = hash_map_it2_create(mdir->dirents);
+	while (hash_map_it2_next(&it))
+		bloom_add(bloom, size, bloom_hash(it.key));
+
+	free(mdir->bloom);
+	mdir->bloom = bloom;
+	mdir->bloom_size = size;
+}
+
 static void mdirectory_touch(struct mdirectory *mdir)
 {
 	assert(dcache.lru_newest && dcache.lru_oldest);
@@ -94,6 +183,7 @@ static void mdirectory_rem(struct mdirectory *mdir)
 	while (hash_map_it2_next(&it))
 		mdirent_free(it.val);
 	hash_map_destroy(mdir->dirents);
+	free(mdir->bloom);
 
 	hash_map_erase(dcache.directories, u64_ptr(mdir->ino));
 
@@ -133,13 +223,19 @@ static struct mdirectory* mdirectory_add(uint64_t ino)
 	if (!mdir->dirents)
 		goto oom_mdir;
 
+	mdir->dirents_len = 0;
 	mdir->free_dirents = NULL;
 
+	mdir->bloom_size = BLOOM_MIN_SIZE;
+	mdir->bloom = calloc(mdir->bloom_size, sizeof(*mdir->bloom));
+	if (!mdir->bloom)
+		goto oom_dirents;
+
 	mdir->ino = ino;
 
 	r = hash_map_insert(dcache.directories, u64_ptr(ino), mdir);
 	if (r < 0)
-		goto oom_dirents;
+		goto oom_bloom;
 
 	// Add mdir to the head of the LRU
 	if (dcache.lru_newest)
@@ -152,6 +248,8 @@ static struct mdirectory* mdirectory_add(uint64_t ino)
 
 	return mdir;
 
+  oom_bloom:
+	free(mdir->bloom);
   oom_dirents:
 	hash_map_destroy(mdir->dirents);
   oom_mdir:
@@ -210,6 +308,14 @@ void dcache_rem_dir(uint64_t ino)
 	mdirectory_rem(mdir);
 }
 
+uint64_t dcache_dir_dirents_len(uint64_t ino)
+{
+	struct mdirectory *mdir = hash_map_find_val(dcache.directories,
+	                                            u64_ptr(ino));
+	assert(mdir);
+	return mdir->dirents_len;
+}
+
 int dcache_add_dirent(uint64_t parent_ino, const char *name,
                       const struct mdirent *mdo)
 {
@@ -232,6 +338,11 @@ int dcache_add_dirent(uint64_t parent_ino, const char *name,
 		return r;
 	}
 	assert(!r);
+	mdir->dirents_len += mdc->rec_len;
+
+	bloom_add(mdir->bloom, mdir->bloom_size, bloom_hash(mdc->name));
+	if (hash_map_size(mdir->dirents) * BLOOM_MAX_LOAD > mdir->bloom_size)
+		mdirectory_grow_bloom(mdir);
 
 	return 0;
 }
@@ -242,9 +353,17 @@ const struct mdirent* dcache_get_dirent(uint64_t parent_ino, const char *name)
 	                                            u64_ptr(parent_ino));
 	assert(mdir);
 	mdirectory_touch(mdir);
+	if (!bloom_has(mdir->bloom, mdir->bloom_size, bloom_hash(name)))
+		return NULL;
 	return hash_map_find_val(mdir->dirents, name);
 }
 
+void dcache_set_dirent_generation(const struct mdirent *md, uint64_t ino_gen)
+{
+	assert(ino_gen != MDIRENT_GENERATION_UNKNOWN);
+	((struct mdirent*) md)->ino_generation = ino_gen;
+}
+
 int dcache_rem_dirent(uint64_t parent_ino, const char *name)
 {
 	struct mdirectory *mdir = hash_map_find_val(dcache.directories,
@@ -258,6 +377,10 @@ int dcache_rem_dirent(uint64_t parent_ino, const char *name)
 	if (!md)
 		return -EINVAL;
 
+	bloom_rem(mdir->bloom, mdir->bloom_size, bloom_hash(name));
+	assert(mdir->dirents_len >= md->rec_len);
+	mdir->dirents_len -= md->rec_len;
+
 	mdirent_free(md);
 
 	return 0;
@@ -13,11 +13,14 @@ struct mdirent
 	const char *name;
 	uint64_t off;
 	uint64_t ino;
-	uint64_t ino_generation;
+	uint64_t ino_generation; // MDIRENT_GENERATION_UNKNOWN until looked up
 	uint16_t rec_len;
 	uint8_t file_type;
 };
 
+// Inode generations start at 1
+#define MDIRENT_GENERATION_UNKNOWN 0
+
 static __inline
 void mdirent_init(struct mdirent *md,
                   const char *name, uint64_t off, uint64_t ino,
@@ -42,6 +45,10 @@ int dcache_add_dir(uint64_t ino);
 // Remove the ino directory and its contents.
 void dcache_rem_dir(uint64_t ino);
 
+// Return the sum of the rec_len of the ino directory's dirents.
+// ino must be in the dcache.
+uint64_t dcache_dir_dirents_len(uint64_t ino);
+
 //
 // Directory entries
 
@@ -53,6 +60,9 @@ int dcache_add_dirent(uint64_t parent_ino, const char *name,
 // parent_ino must be in the dcache.
 const struct mdirent* dcache_get_dirent(uint64_t parent_ino, const char *name);
 
+// Set the inode generation of md, a dirent in the dcache.
+void dcache_set_dirent_generation(const struct mdirent *md, uint64_t ino_gen);
+
 // Remove the dirent for name from the parent_ino directory.
 // parent_ino must be in the dcache.
 int dcache_rem_dirent(uint64_t parent_ino, const char *name);
@@ -0,0 +1,94 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+// A log-linear histogram of 64b values (e.g., latencies), in the manner of
+// HdrHistogram: each power of two range [2^k, 2^(k+1)) is split into
+// HISTOGRAM_SUB buckets, so a recorded value is kept to within a relative
+// error of 1/HISTOGRAM_SUB. Values below HISTOGRAM_SUB are exact.
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NBUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_NBUCKETS];
+};
+
+static inline void histogram_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static inline unsigned histogram_bucket(uint64_t value)
+{
+	unsigned shift;
+	if (value < HISTOGRAM_SUB)
+		return value;
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB + (value >> shift) - HISTOGRAM_SUB;
+}
+
+// Return the largest value that falls in bucket i
+static inline uint64_t histogram_bucket_max(unsigned i)
+{
+	unsigned shift;
+	if (i < HISTOGRAM_SUB)
+		return i;
+	shift = i / HISTOGRAM_SUB - 1;
+	return (((uint64_t) (HISTOGRAM_SUB + i % HISTOGRAM_SUB + 1)) << shift) - 1;
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->buckets[histogram_bucket(value)]++;
+}
+
+static inline void histogram_merge(struct histogram *dst,
+                                   const struct histogram *src)
+{
+	unsigned i;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (i = 0; i < HISTOGRAM_NBUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+// Return the value below or at which percentile percent of the recorded
+// values lie (to within the bucket precision), or 0 if none are recorded
+static inline uint64_t histogram_percentile(const struct histogram *h,
+                                            double percentile)
+{
+	uint64_t rank = percentile / 100 * h->count + 0.5;
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_NBUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return histogram_bucket_max(i) < h->max
+			       ? histogram_bucket_max(i) : h->max;
+	}
+	return h->max;
+}
+
+#endif
@@ -5,12 +5,22 @@
 #include "indirect_cow.h"
 #include "bpfs.h"
 #include "hash_map.h"
+#include "pool.h"
+#include "probes.h"
+#include "vector.h"
 
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #if INDIRECT_COW
 
@@ -22,10 +32,15 @@
 #endif
 
 
+// Granularity of struct block.dirty
+#define LINE_SIZE 64
+#define NLINES (BPFS_BLOCK_SIZE / LINE_SIZE)
+
 struct block {
 	uint64_t orig_blkno; // the block number of the block this block replaces
 	uint64_t cow_blkno; // this block's block number
 	char *dram; // new contents (in DRAM)
+	uint64_t dirty; // bit i set: line i of dram may differ from the original
 	bool required; // whether this block must be commited to DRAM
 	struct block *parent; // block's parent. for integrity assertions.
 	struct block *children_all; // all children of this block
@@ -49,6 +64,85 @@ static hash_map_t *blkno_map_cow;  //  cow block number -> struct block*
 static struct parent_stack parent_stack;
 
 
+// Every CoW in a transaction needs a struct block and a DRAM shadow, so
+// recycle both rather than calling malloc() and posix_memalign() for each.
+
+DECLARE_POOL(block_struct, struct block);
+
+// Set to 1 to back shadows with hugepages (see /proc/sys/vm/nr_hugepages).
+// Falls back to normal pages when none are available.
+#define SHADOW_HUGEPAGES 0
+
+// Shadows are carved from slabs of this size, which are unmapped only by
+// indirect_cow_destroy()
+#define SHADOW_SLAB_SIZE (2 * 1024 * 1024)
+
+static vector_t *shadow_slabs; // char*s
+// Each free shadow's first bytes point to the next free shadow
+static char *shadow_free_list;
+
+static int shadow_slab_alloc(void)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *slab = MAP_FAILED;
+	size_t off;
+	int r;
+
+#if SHADOW_HUGEPAGES
+	slab = mmap(NULL, SHADOW_SLAB_SIZE, PROT_READ | PROT_WRITE,
+	            flags | MAP_HUGETLB, -1, 0);
+#endif
+	if (slab == MAP_FAILED)
+		slab = mmap(NULL, SHADOW_SLAB_SIZE, PROT_READ | PROT_WRITE,
+		            flags, -1, 0);
+	if (slab == MAP_FAILED)
+		return -ENOMEM;
+	r = vector_push_back(shadow_slabs, slab);
+	if (r < 0)
+	{
+		xsyscall(munmap(slab, SHADOW_SLAB_SIZE));
+		return r;
+	}
+
+	static_assert(!(SHADOW_SLAB_SIZE % BPFS_BLOCK_SIZE));
+	for (off = SHADOW_SLAB_SIZE; off; off -= BPFS_BLOCK_SIZE)
+	{
+		char *shadow = slab + off - BPFS_BLOCK_SIZE;
+		*(char**) shadow = shadow_free_list;
+		shadow_free_list = shadow;
+	}
+	return 0;
+}
+
+static char* shadow_alloc(void)
+{
+	char *shadow;
+	if (!shadow_free_list && shadow_slab_alloc() < 0)
+		return NULL;
+	shadow = shadow_free_list;
+	shadow_free_list = *(char**) shadow;
+	assert(!block_offset(shadow));
+	return shadow;
+}
+
+static void shadow_free(char *shadow)
+{
+	if (!shadow)
+		return;
+	*(char**) shadow = shadow_free_list;
+	shadow_free_list = shadow;
+}
+
+static void shadow_free_all(void)
+{
+	size_t i;
+	for (i = 0; i < vector_size(shadow_slabs); i++)
+		xsyscall(munmap(vector_elt(shadow_slabs, i), SHADOW_SLAB_SIZE));
+	vector_clear(shadow_slabs);
+	shadow_free_list = NULL;
+}
+
+
 static struct block* parent_get(void)
 {
 	if (!parent_stack.height)
@@ -70,13 +164,14 @@ static struct block* block_get_either(uint64_t blkno)
 static struct block* block_create(uint64_t orig_blkno, uint64_t cow_blkno)
 {
 	struct block *parent = parent_get();
-	struct block *block = malloc(sizeof(*block));
+	struct block *block = block_struct_alloc();
 	assert(!block_get_either(orig_blkno) && !block_get_either(cow_blkno));
 	if (!block)
 		return NULL;
 	block->orig_blkno = orig_blkno;
 	block->cow_blkno = cow_blkno;
 	block->dram = NULL;
+	block->dirty = 0;
 	block->required = false;
 	block->parent = parent;
 	block->children_all = NULL;
@@ -118,6 +213,13 @@ int indirect_cow_init(void)
 		hash_map_destroy(blkno_map_orig);
 		return -ENOMEM;
 	}
+	shadow_slabs = vector_create();
+	if (!shadow_slabs)
+	{
+		hash_map_destroy(blkno_map_cow);
+		hash_map_destroy(blkno_map_orig);
+		return -ENOMEM;
+	}
 	parent_stack.height = 0;
 	indirect_cow_inited = true;
 	return 0;
@@ -136,11 +238,15 @@ void indirect_cow_destroy(void)
 	assert(super);
 	(void) hash_map_erase(blkno_map_orig, u64_ptr(BPFS_BLOCKNO_SUPER));
 	(void) hash_map_erase(blkno_map_cow, u64_ptr(super->cow_blkno));
-	free(super->dram);
-	free(super);
+	shadow_free(super->dram);
+	block_struct_free(super);
 
 	hash_map_destroy(blkno_map_orig);
 	hash_map_destroy(blkno_map_cow);
+
+	shadow_free_all();
+	vector_destroy(shadow_slabs);
+	block_struct_free_all();
 }
 
 
@@ -206,7 +312,6 @@ int indirect_cow_block_cow(uint64_t orig_blkno, uint64_t cow_blkno)
 	struct block *block = hash_map_find_val(blkno_map_orig,
 	                                        u64_ptr(orig_blkno));
 	bool new_block = !block;
-	void *dram_void;
 	int r;
 	Dprintf("%s(orig_blkno = %" PRIu64 ", cow_blkno = %" PRIu64 ")\n",
 	        __FUNCTION__, orig_blkno, cow_blkno);
@@ -243,14 +348,14 @@ int indirect_cow_block_cow(uint64_t orig_blkno, uint64_t cow_blkno)
 		}
 	}
 
-	r = posix_memalign(&dram_void, BPFS_BLOCK_SIZE, BPFS_BLOCK_SIZE);
-	if (r)
+	block->dram = shadow_alloc();
+	if (!block->dram)
 	{
-		assert(r == ENOMEM);
-		r = -r;
+		r = -ENOMEM;
 		goto abort;
 	}
-	block->dram = dram_void;
+	// The caller copies the original's contents and marks what it does not
+	block->dirty = 0;
 
 	if (new_block)
 	{
@@ -268,13 +373,13 @@ int indirect_cow_block_cow(uint64_t orig_blkno, uint64_t cow_blkno)
 	return 0;
 
   abort:
-	free(block->dram);
+	shadow_free(block->dram);
 	block->cow_blkno = BPFS_BLOCKNO_INVALID;
 	(void) hash_map_erase(blkno_map_cow, u64_ptr(cow_blkno));
 	if (new_block)
 	{
 		(void) hash_map_erase(blkno_map_orig, u64_ptr(orig_blkno));
-		free(block);
+		block_struct_free(block);
 	}
 	return r;
 }
@@ -292,11 +397,32 @@ void indirect_cow_block_required(uint64_t blkno)
 	struct block *block = hash_map_find_val(blkno_map_cow, u64_ptr(blkno));
 	Dprintf("%s(blkno = %" PRIu64 ")\n", __FUNCTION__, blkno);
 	if (block)
+	{
 		block->required = true;
+		// The caller may write anywhere in the block
+		block->dirty = ~(uint64_t) 0;
+	}
 	else
 		assert(block_freshly_alloced(blkno));
 }
 
+void indirect_cow_block_dirty(uint64_t blkno, unsigned off, unsigned size)
+{
+	struct block *block = hash_map_find_val(blkno_map_cow, u64_ptr(blkno));
+	unsigned first, last;
+
+	assert(off + size <= BPFS_BLOCK_SIZE);
+	if (!block || !size)
+		return;
+
+	first = off / LINE_SIZE;
+	last = (off + size - 1) / LINE_SIZE;
+	if (last - first + 1 == NLINES)
+		block->dirty = ~(uint64_t) 0;
+	else
+		block->dirty |= ((((uint64_t) 1) << (last - first + 1)) - 1) << first;
+}
+
 void indirect_cow_block_direct(uint64_t blkno, unsigned off, unsigned size)
 {
 	struct block *block = hash_map_find_val(blkno_map_cow, u64_ptr(blkno));
@@ -312,40 +438,92 @@ void indirect_cow_block_direct(uint64_t blkno, unsigned off, unsigned size)
 	    || block->cow_blkno == BPFS_BLOCKNO_INVALID)
 		return;
 
-	memcpy(get_block(block->orig_blkno) + off, block->dram + off, size);
+	BPRAM_MEMCPY(get_block(block->orig_blkno) + off, block->dram + off, size);
+	STATS_ADD(bpram_bytes, size);
 }
 
 
+// Return whether the LINE_SIZE bytes at a and b are equal
+static bool line_equal(const char *a, const char *b)
+{
+#if defined(__AVX2__)
+	__m256i x0 = _mm256_xor_si256(_mm256_load_si256((const __m256i*) a),
+	                              _mm256_load_si256((const __m256i*) b));
+	__m256i x1 = _mm256_xor_si256(_mm256_load_si256((const __m256i*) a + 1),
+	                              _mm256_load_si256((const __m256i*) b + 1));
+	static_assert(LINE_SIZE == 2 * sizeof(__m256i));
+	x0 = _mm256_or_si256(x0, x1);
+	return _mm256_testz_si256(x0, x0);
+#elif defined(__SSE2__)
+	const __m128i *va = (const __m128i*) a;
+	const __m128i *vb = (const __m128i*) b;
+	__m128i x = _mm_xor_si128(_mm_load_si128(va), _mm_load_si128(vb));
+	unsigned i;
+	static_assert(LINE_SIZE == 4 * sizeof(__m128i));
+	for (i = 1; i < LINE_SIZE / sizeof(__m128i); i++)
+		x = _mm_or_si128(x, _mm_xor_si128(_mm_load_si128(va + i),
+		                                  _mm_load_si128(vb + i)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()))
+	       == 0xFFFF;
+#else
+	return !memcmp(a, b, LINE_SIZE);
+#endif
+}
+
 static bool cow_is_atomically_writable(const struct block *block,
                                        uint64_t *atomic_new,
                                        unsigned *atomic_off)
 {
 	char *block_0 = get_block(block->orig_blkno);
 	char *block_1 = block->dram;
+	uint64_t dirty = block->dirty;
 	bool diff = false;
-	unsigned off;
 
 	assert(!!atomic_new == !!atomic_off);
 	assert(block_0);
 	assert(block_1);
+	assert(!block_offset(block_0) && !block_offset(block_1));
+
+#ifndef NDEBUG
+	{
+		unsigned line;
+		for (line = 0; line < NLINES; line++)
+			if (!(block->dirty & (((uint64_t) 1) << line)))
+				assert(line_equal(block_0 + line * LINE_SIZE,
+				                  block_1 + line * LINE_SIZE));
+	}
+#endif
 
 	// BPFS_BLOCK_SIZE will indicate no difference
 	if (atomic_off)
 		*atomic_off = BPFS_BLOCK_SIZE;
 
+	// Only the dirty lines can differ
+	static_assert(NLINES == 64);
 	static_assert(ATOMIC_SIZE == 8);
-	for (off = 0 ; off < BPFS_BLOCK_SIZE; off += ATOMIC_SIZE)
+	while (dirty)
 	{
-		if (*(uint64_t*) (block_0 + off) != *(uint64_t*) (block_1 + off))
-		{
-			if (diff)
-				return false;
+		unsigned line = __builtin_ctzll(dirty);
+		unsigned off = line * LINE_SIZE;
+		unsigned end = off + LINE_SIZE;
 
-			diff = true;
-			if (atomic_new)
+		dirty &= dirty - 1;
+		if (line_equal(block_0 + off, block_1 + off))
+			continue;
+
+		for (; off < end; off += ATOMIC_SIZE)
+		{
+			if (*(uint64_t*) (block_0 + off) != *(uint64_t*) (block_1 + off))
 			{
-				*atomic_new = *(uint64_t*) (block_1 + off);
-				*atomic_off = off;
+				if (diff)
+					return false;
+
+				diff = true;
+				if (atomic_new)
+				{
+					*atomic_new = *(uint64_t*) (block_1 + off);
+					*atomic_off = off;
+				}
 			}
 		}
 	}
@@ -370,6 +548,7 @@ void indirect_cow_commit(void)
 
 	// Should contain at least the super block:
 	assert(!hash_map_empty(blkno_map_cow));
+	BPFS_PROBE(indirect_cow_commit, hash_map_size(blkno_map_cow));
 
 	if (hash_map_size(blkno_map_cow) == 1)
 	{
@@ -379,7 +558,7 @@ void indirect_cow_commit(void)
 		(void) hash_map_erase(blkno_map_cow, u64_ptr(block->cow_blkno));
 		unfree_block(BPFS_BLOCKNO_SUPER);
 		unalloc_block(block->cow_blkno);
-		free(block->dram);
+		shadow_free(block->dram);
 		block->dram = NULL;
 		block->cow_blkno = BPFS_BLOCKNO_INVALID;
 
@@ -388,7 +567,7 @@ void indirect_cow_commit(void)
 		{
 			block = it.val;
 			assert(!block->dram && block->cow_blkno == BPFS_BLOCKNO_INVALID);
-			free(block);
+			block_struct_free(block);
 		}
 		hash_map_clear(blkno_map_orig);
 		return;
@@ -434,9 +613,9 @@ void indirect_cow_commit(void)
 
 		(void) hash_map_erase(blkno_map_orig, u64_ptr(block->orig_blkno));
 		(void) hash_map_erase(blkno_map_cow, u64_ptr(block->cow_blkno));
-		free(block->dram);
+		shadow_free(block->dram);
 		block = block->children_cow;
-		free(cur);
+		block_struct_free(cur);
 	}
 
 	// Copy CoW blocks to BPRAM
@@ -450,10 +629,11 @@ void indirect_cow_commit(void)
 		(void) hash_map_erase(blkno_map_cow, u64_ptr(block->cow_blkno));
 
 		block_bpram = get_block(block->cow_blkno);
-		memcpy(block_bpram, block->dram, BPFS_BLOCK_SIZE);
+		BPRAM_MEMCPY(block_bpram, block->dram, BPFS_BLOCK_SIZE);
+		STATS_ADD(bpram_bytes, BPFS_BLOCK_SIZE);
 
-		free(block->dram);
-		free(block);
+		shadow_free(block->dram);
+		block_struct_free(block);
 	}
 
 	// Free the blocks that were not CoWed
@@ -467,7 +647,7 @@ void indirect_cow_commit(void)
 		assert(!block->required);
 
 		(void) hash_map_erase(blkno_map_orig, u64_ptr(block->orig_blkno));
-		free(block);
+		block_struct_free(block);
 	}
 
 	// Atomically commit
@@ -475,8 +655,11 @@ void indirect_cow_commit(void)
 	//  or direct.)
 	if (atomic_off != BPFS_BLOCK_SIZE)
 	{
+		// The copies must be persistent before the commit
+		NVM_PERSIST();
 		block_bpram = get_block(atomic_blkno);
-		*(uint64_t*) (block_bpram + atomic_off) = atomic_new;
+		BPRAM_STORE(*(uint64_t*) (block_bpram + atomic_off), atomic_new);
+		STATS_ADD(atomic_commits, 1);
 	}
 }
 
@@ -500,11 +683,11 @@ void indirect_cow_abort(void)
 			unfree_block(block->orig_blkno);
 
 			(void) hash_map_erase(blkno_map_cow, u64_ptr(block->cow_blkno));
-			free(block->dram);
+			shadow_free(block->dram);
 		}
 
 		(void) hash_map_erase(blkno_map_orig, u64_ptr(block->orig_blkno));
-		free(block);
+		block_struct_free(block);
 	}
 }
 
@@ -547,6 +730,9 @@ char* indirect_cow_block_get(uint64_t blkno)
 void indirect_cow_block_required(uint64_t blkno)
 {
 }
+void indirect_cow_block_dirty(uint64_t blkno, unsigned off, unsigned size)
+{
+}
 void indirect_cow_block_direct(uint64_t blkno, unsigned off, unsigned size)
 {
 }
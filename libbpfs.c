@@ -0,0 +1,6225 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#include "libbpfs.h"
+#include "mkbpfs.h"
+#include "bpfs_structs.h"
+#include "bpfs_ioctl.h"
+#include "dcache.h"
+#include "crawler.h"
+#include "indirect_cow.h"
+#include "util.h"
+#include "hash_map.h"
+#include "vector.h"
+#include "histogram.h"
+#include "probes.h"
+
+#include <assert.h>
+#if defined(__x86_64__)
+# include <cpuid.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+// TODO:
+// - make time higher resolution. See ext4, bits/stat.h, linux/time.h.
+// - add gcc flag to warn about ignored return values?
+// - blockno can mean bpram block no or file block no
+// - tell valgrind about block and inode alloc and free functions
+// - merge and breakup empty dirents
+// - don't reuse inflight resources? (work with epoch_barrier()?)
+// - write fsck.bpfs?: check .., check nlinks, more?
+// - can compiler reorder memory writes? watch out for SP and SCSP.
+// - how much simpler would it be to always have a correct height tree?
+// - passing size=1 to crawl(!COMMIT_NONE) forces extra writes
+
+#define DETECT_ALLOCATION_DIFFS (!defined(NDEBUG))
+#define DETECT_NONCOW_WRITES_SP (COMMIT_MODE == MODE_SP && !defined(NDEBUG))
+#define DETECT_NONCOW_WRITES_SCSP \
+	(COMMIT_MODE == MODE_SCSP && !SCSP_OPT_DIRECT && !defined(NDEBUG))
+// Alternatives to valgrind until it knows about our block alloc functions:
+// FIXME: broken with SCSP at the moment
+#define DETECT_STRAY_ACCESSES (COMMIT_MODE == MODE_SP && !defined(NDEBUG))
+#define BLOCK_POISON (0 && !defined(NDEBUG))
+
+// Commit a group early once fewer blocks than this are free, so that an
+// operation is unlikely to run out of space and roll back its group.
+#define GROUP_MIN_NFREE 256
+
+// Offset of the first persistent dirent. Offset 0 is "." and 1 is "..".
+#define DIRENT_FIRST_PERSISTENT_OFFSET 2
+
+// Use this macro to ensure that memory writes are made inbetween calls to
+// this macro. With hardware support this would also issue an epoch barrier.
+#define epoch_barrier() \
+	do { \
+		NVM_PERSIST(); \
+		__asm__ __volatile__("": : :"memory"); \
+	} while (0)
+
+#define DEBUG (0 && !defined(NDEBUG))
+#if DEBUG
+# define Dprintf(x...) fprintf(stderr, x)
+#else
+# define Dprintf(x...) do {} while(0)
+#endif
+
+#define DEBUG_BLOCKS (0 && !defined(NDEBUG))
+#if DEBUG_BLOCKS
+# define DBprintf(x...) fprintf(stderr, x)
+#else
+# define DBprintf(x...) do {} while(0)
+#endif
+
+
+#define DEBUG_INODES (0 && !defined(NDEBUG))
+#if DEBUG_INODES
+# define DIprintf(x...) fprintf(stderr, x)
+#else
+# define DIprintf(x...) do {} while(0)
+#endif
+
+#if DETECT_NONCOW_WRITES_SP
+# define PROT_INUSE_OLD PROT_READ
+#else
+# define PROT_INUSE_OLD (PROT_READ | PROT_WRITE)
+#endif
+
+struct const_str
+{
+	const char *str;
+	size_t len;
+};
+
+struct str_dirent
+{
+	struct const_str str;       /* find the dirent with this name */
+	uint64_t dirent_off;        /* set if str is found */
+	struct bpfs_dirent *dirent; /* set if str is found */
+};
+
+static struct bpfs_options bpfs_options = BPFS_OPTIONS_DEFAULT;
+
+//
+// give access to bpram without passing these variables everywhere
+
+static char *bpram;
+static size_t bpram_size;
+
+static struct bpfs_super *bpfs_super;
+
+void set_super(struct bpfs_super *super)
+{
+	assert(super->magic == BPFS_FS_MAGIC);
+	bpfs_super = super;
+}
+
+struct bpfs_super* get_bpram_super(void)
+{
+	static_assert(BPFS_BLOCKNO_INVALID == 0 && BPFS_BLOCKNO_SUPER == 1);
+	return (struct bpfs_super*) bpram;
+}
+
+struct bpfs_super* get_super(void)
+{
+	return bpfs_super;
+}
+
+
+//
+// write accounting (BPFS_IOC_STATS)
+
+#if WRITE_STATS
+static struct bpfs_stats stats;
+struct bpfs_stats_counts *stats_op = &stats.op[BPFS_STATS_OP_OTHER];
+
+// Count the current operation, and its writes, towards op
+static void stats_begin_op(enum bpfs_stats_op op)
+{
+	stats_op = &stats.op[op];
+	stats_op->nops++;
+}
+
+void stats_bpram_copy(const void *dst, uint64_t size)
+{
+	const char *c = (const char*) dst;
+	if (bpram <= c && c < bpram + bpram_size)
+		stats_op->bpram_bytes += size;
+}
+
+void stats_bpram_store(const void *dst, uint64_t size)
+{
+	const char *c = (const char*) dst;
+	if (bpram <= c && c < bpram + bpram_size)
+		stats_op->store_bytes += size;
+}
+#else
+# define stats_begin_op(op) ((void) 0)
+#endif
+
+
+//
+// store accounting (STORE_STATS)
+
+// Counts the writes of each BPRAM store site, as bench/bpramcount does with
+// Pin, but at only the sites that write BPRAM through the store macros.
+// Set BPRAMCOUNT_LOG to the file to log each site's writes to.
+
+#if STORE_STATS
+static uint64_t store_nbytes;
+static struct store_site *store_sites;
+
+void store_count(struct store_site *site, const void *dst, uint64_t size)
+{
+	const char *c = (const char*) dst;
+
+#if NVM_EMULATION
+	if (nvm_stores)
+		nvm_store(dst, size);
+#endif
+	if (!(bpram <= c && c < bpram + bpram_size) || !size)
+		return;
+	if (!site->ip)
+	{
+		site->ip = __builtin_return_address(0);
+		site->next = store_sites;
+		store_sites = site;
+	}
+	site->bytes += size;
+	site->lines += ((uintptr_t) c + size - 1) / 64 - (uintptr_t) c / 64 + 1;
+	site->words += ((uintptr_t) c + size - 1) / 8 - (uintptr_t) c / 8 + 1;
+	store_nbytes += size;
+}
+
+static void store_stats_mount(void)
+{
+	printf("pin: detected %zu MiB (%zu bytes) of BPRAM\n",
+	       bpram_size / (1024 * 1024), bpram_size);
+}
+
+static void store_stats_unmount(void)
+{
+	const char *log = getenv("BPRAMCOUNT_LOG");
+	struct store_site *site;
+	FILE *trace;
+
+	printf("pin: %" PRIu64 " bytes written to BPRAM\n", store_nbytes);
+	if (!log)
+		return;
+	if (!(trace = fopen(log, "w")))
+	{
+		fprintf(stderr, "pin: unable to open trace file\n");
+		return;
+	}
+
+	fprintf(trace, "detected %zu MiB (%zu bytes) of BPRAM @ %p\n",
+	        bpram_size / (1024 * 1024), bpram_size, (void*) bpram);
+	fprintf(trace, "total number of bytes written: %" PRIu64 "\n",
+	        store_nbytes);
+	fprintf(trace, "write backtraces start:\n");
+	for (site = store_sites; site; site = site->next)
+		fprintf(trace, "%" PRIu64 " %p\n", site->bytes, site->ip);
+	fprintf(trace, "write backtraces end\n");
+
+	// Not written by Pin; after the backtraces so that parsers stop first
+	fprintf(trace, "write sites start:\n");
+	for (site = store_sites; site; site = site->next)
+		fprintf(trace, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %s:%u %s\n",
+		        site->bytes, site->lines, site->words,
+		        site->file, site->line, site->func);
+	fprintf(trace, "write sites end\n");
+
+	fclose(trace);
+}
+#else
+# define store_stats_mount() ((void) 0)
+# define store_stats_unmount() ((void) 0)
+#endif
+
+
+//
+// NVM emulation (bpfs_options.nvm_*)
+
+// BPRAM is DRAM here. To approximate NVM, stores mark their cache lines
+// dirty and each persist waits for writing the dirty lines; an operation
+// also waits when it first reads each block.
+
+#if NVM_EMULATION
+// Tags of recently dirtied lines, so repeated stores to a line count once
+// per persist. Direct mapped, so a conflict can count a line again.
+# define NVM_DIRTY_NLINES 512
+# define NVM_LINE_SIZE 64
+
+bool nvm_stores;
+static uintptr_t nvm_dirty[NVM_DIRTY_NLINES];
+static uint64_t nvm_dirty_nlines;
+// The time at which the emulated NVM finishes writing the persisted lines
+static uint64_t nvm_busy_until;
+// Each block's last reading operation, if nvm_read_ns
+static uint32_t *nvm_touched;
+static uint32_t nvm_op_gen = 1;
+
+static uint64_t nvm_now(void)
+{
+	struct timespec ts;
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Spin, rather than sleep, for sub-microsecond accuracy
+static void nvm_wait_until(uint64_t ns)
+{
+	while (nvm_now() < ns)
+		;
+}
+
+void nvm_store(const void *dst, uint64_t size)
+{
+	const char *c = (const char*) dst;
+	uintptr_t line, last;
+
+	if (!(bpram <= c && c < bpram + bpram_size) || !size)
+		return;
+	last = ((uintptr_t) c + size - 1) / NVM_LINE_SIZE;
+	for (line = (uintptr_t) c / NVM_LINE_SIZE; line <= last; line++)
+	{
+		uintptr_t *tag = &nvm_dirty[line % NVM_DIRTY_NLINES];
+		if (*tag != line)
+		{
+			*tag = line;
+			nvm_dirty_nlines++;
+		}
+	}
+}
+
+void nvm_persist(void)
+{
+	uint64_t now, done;
+
+	if (!nvm_dirty_nlines)
+		return;
+	now = nvm_now();
+	done = now + nvm_dirty_nlines * bpfs_options.nvm_write_ns;
+	if (bpfs_options.nvm_write_mbps)
+	{
+		// 1 MB/s is 1 B/us
+		uint64_t busy = MAX(now, nvm_busy_until)
+		                + nvm_dirty_nlines * NVM_LINE_SIZE * 1000
+		                  / bpfs_options.nvm_write_mbps;
+		nvm_busy_until = busy;
+		done = MAX(done, busy);
+	}
+	nvm_wait_until(done);
+
+	nvm_dirty_nlines = 0;
+	memset(nvm_dirty, 0, sizeof(nvm_dirty));
+}
+
+// Wait for the first read of blockno in this operation
+static void nvm_read(uint64_t blockno)
+{
+	if (nvm_touched[blockno - 1] != nvm_op_gen)
+	{
+		nvm_touched[blockno - 1] = nvm_op_gen;
+		nvm_wait_until(nvm_now() + bpfs_options.nvm_read_ns);
+	}
+}
+
+static void nvm_begin_op(void)
+{
+	if (nvm_touched && !++nvm_op_gen)
+	{
+		memset(nvm_touched, 0, bpfs_super->nblocks * sizeof(*nvm_touched));
+		nvm_op_gen = 1;
+	}
+}
+
+static void nvm_init(void)
+{
+	nvm_stores = bpfs_options.nvm_write_ns || bpfs_options.nvm_write_mbps;
+	if (bpfs_options.nvm_read_ns)
+		xassert((nvm_touched = calloc(bpfs_super->nblocks,
+		                              sizeof(*nvm_touched))));
+}
+
+static void nvm_destroy(void)
+{
+	nvm_persist();
+	nvm_stores = false;
+	free(nvm_touched);
+	nvm_touched = NULL;
+}
+#else
+# define nvm_begin_op() ((void) 0)
+# define nvm_init() ((void) 0)
+# define nvm_destroy() ((void) 0)
+#endif
+
+//
+// latency instrumentation (bpfs_latency_dump())
+
+// Only the one thread that runs operations records, so recording takes no
+// locks. A dump that interrupts a recording may see it partly counted.
+
+#if LATENCY_STATS
+struct latency_op
+{
+	struct histogram requests; // see bpfs_latency_op()
+	uint64_t phase_ticks[BPFS_LATENCY_NPHASES];
+};
+
+static struct latency_op latency_ops[BPFS_STATS_NOPS];
+static struct histogram latency_phases[BPFS_LATENCY_NPHASES];
+// The nesting depth of each phase
+static unsigned latency_depth[BPFS_LATENCY_NPHASES];
+// The type of the current request's operation
+static enum bpfs_stats_op latency_op;
+// Timestamp counter ticks per nanosecond
+static double latency_ticks_per_ns = 1;
+
+static uint64_t latency_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Measure the timestamp counter's frequency
+static void latency_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	const struct timespec delay = {0, 10 * 1000 * 1000};
+	struct timespec start, end;
+	uint64_t start_ticks, end_ticks;
+	double ns;
+
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &start));
+	start_ticks = latency_ticks();
+	nanosleep(&delay, NULL);
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &end));
+	end_ticks = latency_ticks();
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	if (ns > 0 && end_ticks > start_ticks)
+		latency_ticks_per_ns = (end_ticks - start_ticks) / ns;
+#endif
+}
+
+static void latency_record(unsigned phase, uint64_t ticks)
+{
+	histogram_record(&latency_phases[phase], ticks);
+	latency_ops[latency_op].phase_ticks[phase] += ticks;
+}
+
+uint64_t latency_begin(unsigned phase)
+{
+	assert(phase < BPFS_LATENCY_NPHASES);
+	if (latency_depth[phase]++)
+		return 0;
+	return latency_ticks();
+}
+
+void latency_end(unsigned phase, uint64_t start)
+{
+	assert(latency_depth[phase]);
+	if (!--latency_depth[phase])
+		latency_record(phase, latency_ticks() - start);
+}
+
+// Print h's count and distribution, in microseconds
+static void latency_print_histogram(FILE *file, const char *name,
+                                    const struct histogram *h)
+{
+	double us = latency_ticks_per_ns * 1000;
+	fprintf(file, "%-10s %10" PRIu64 " %9.2f %9.2f %9.2f %9.2f %9.2f",
+	        name, h->count, h->sum / us / h->count,
+	        histogram_percentile(h, 50) / us,
+	        histogram_percentile(h, 99) / us,
+	        histogram_percentile(h, 99.9) / us, h->max / us);
+}
+#else
+# define latency_calibrate() ((void) 0)
+#endif
+
+uint64_t bpfs_latency_now(void)
+{
+#if LATENCY_STATS
+	return latency_ticks();
+#else
+	return 0;
+#endif
+}
+
+void bpfs_latency_op(uint64_t start)
+{
+#if LATENCY_STATS
+	histogram_record(&latency_ops[latency_op].requests,
+	                 latency_ticks() - start);
+	latency_op = BPFS_STATS_OP_OTHER;
+#endif
+}
+
+void bpfs_latency_phase(enum bpfs_latency_phase phase, uint64_t start)
+{
+#if LATENCY_STATS
+	latency_record(phase, latency_ticks() - start);
+#endif
+}
+
+void bpfs_latency_dump(FILE *file)
+{
+#if LATENCY_STATS
+	static const char *op_names[BPFS_STATS_NOPS] = BPFS_STATS_OP_NAMES;
+	static const char *phase_names[BPFS_LATENCY_NPHASES] =
+		{"crawl", "cow", "commit", "fsck", "reply"};
+	double us = latency_ticks_per_ns * 1000;
+	unsigned i, j;
+
+	fprintf(file, "Latency in us (%.3f GHz timestamp counter)\n",
+	        latency_ticks_per_ns);
+	fprintf(file, "%-10s %10s %9s %9s %9s %9s %9s", "request", "count",
+	        "mean", "p50", "p99", "p999", "max");
+	for (j = 0; j < BPFS_LATENCY_NPHASES; j++)
+		fprintf(file, " %8s", phase_names[j]);
+	fprintf(file, "\n");
+	for (i = 0; i < BPFS_STATS_NOPS; i++)
+	{
+		const struct latency_op *lop = &latency_ops[i];
+		if (!lop->requests.count)
+			continue;
+		latency_print_histogram(file, op_names[i], &lop->requests);
+		// The mean time per request in each phase
+		for (j = 0; j < BPFS_LATENCY_NPHASES; j++)
+			fprintf(file, " %8.2f",
+			        lop->phase_ticks[j] / us / lop->requests.count);
+		fprintf(file, "\n");
+	}
+
+	fprintf(file, "%-10s %10s %9s %9s %9s %9s %9s\n", "phase", "count",
+	        "mean", "p50", "p99", "p999", "max");
+	for (j = 0; j < BPFS_LATENCY_NPHASES; j++)
+	{
+		if (!latency_phases[j].count)
+			continue;
+		latency_print_histogram(file, phase_names[j], &latency_phases[j]);
+		fprintf(file, "\n");
+	}
+	fflush(file);
+#else
+	fprintf(file, "Latency instrumentation is disabled (LATENCY_STATS)\n");
+#endif
+}
+
+
+//
+// BPFS-POSIX type conversion
+
+static mode_t b2f_filetype(uint32_t bpfs_file_type)
+{
+	mode_t mode = 0;
+	switch (bpfs_file_type)
+	{
+		case BPFS_TYPE_SOCK:
+			mode |= S_IFSOCK;
+			break;
+		case BPFS_TYPE_FILE:
+			mode |= S_IFREG;
+			break;
+		case BPFS_TYPE_BLKDEV:
+			mode |= S_IFBLK;
+			break;
+		case BPFS_TYPE_DIR:
+			mode |= S_IFDIR;
+			break;
+		case BPFS_TYPE_CHRDEV:
+			mode |= S_IFCHR;
+			break;
+		case BPFS_TYPE_FIFO:
+			mode |= S_IFIFO;
+			break;
+		case BPFS_TYPE_SYMLINK:
+			mode |= S_IFLNK;
+			break;
+		default:
+			xassert(0);
+	}
+	return mode;
+}
+
+static uint32_t f2b_filetype(mode_t mode)
+{
+	uint32_t file_type = 0;
+	switch (mode & S_IFMT)
+	{
+		case S_IFSOCK:
+			file_type |= BPFS_TYPE_SOCK;
+			break;
+		case S_IFREG:
+			file_type |= BPFS_TYPE_FILE;
+			break;
+		case S_IFBLK:
+			file_type |= BPFS_TYPE_BLKDEV;
+			break;
+		case S_IFDIR:
+			file_type |= BPFS_TYPE_DIR;
+			break;
+		case S_IFCHR:
+			file_type |= BPFS_TYPE_CHRDEV;
+			break;
+		case S_IFIFO:
+			file_type |= BPFS_TYPE_FIFO;
+			break;
+		case S_IFLNK:
+			file_type |= BPFS_TYPE_SYMLINK;
+			break;
+		default:
+			xassert(0);
+	}
+	return file_type;
+}
+
+static mode_t b2f_mode(uint32_t bmode)
+{
+	mode_t fmode = 0;
+	switch (bmode & BPFS_S_IFMT)
+	{
+		case BPFS_S_IFSOCK: fmode |= S_IFSOCK; break;
+		case BPFS_S_IFLNK:  fmode |= S_IFLNK;  break;
+		case BPFS_S_IFREG:  fmode |= S_IFREG;  break;
+		case BPFS_S_IFBLK:  fmode |= S_IFBLK;  break;
+		case BPFS_S_IFDIR:  fmode |= S_IFDIR;  break;
+		case BPFS_S_IFCHR:  fmode |= S_IFCHR;  break;
+		case BPFS_S_IFIFO:  fmode |= S_IFIFO;  break;
+		default: xassert(0);
+	}
+	fmode |= bmode & BPFS_S_IPERM;
+	return fmode;
+}
+
+static uint32_t f2b_mode(mode_t fmode)
+{
+	uint32_t bmode = 0;
+	switch (fmode & S_IFMT)
+	{
+		case S_IFSOCK: bmode |= BPFS_S_IFSOCK; break;
+		case S_IFLNK:  bmode |= BPFS_S_IFLNK;  break;
+		case S_IFREG:  bmode |= BPFS_S_IFREG;  break;
+		case S_IFBLK:  bmode |= BPFS_S_IFBLK;  break;
+		case S_IFDIR:  bmode |= BPFS_S_IFDIR;  break;
+		case S_IFCHR:  bmode |= BPFS_S_IFCHR;  break;
+		case S_IFIFO:  bmode |= BPFS_S_IFIFO;  break;
+		default: xassert(0);
+	}
+	bmode |= fmode & BPFS_S_IPERM;
+	return bmode;
+}
+
+
+//
+// bitmap
+
+struct staged_entry {
+	uint64_t index;
+	struct staged_entry *next;
+};
+
+static void staged_list_free(struct staged_entry **head)
+{
+	while (*head)
+	{
+		struct staged_entry *cur = *head;
+		*head = (*head)->next;
+		free(cur);
+	}
+}
+
+#if (COMMIT_MODE != MODE_BPFS) || !defined(NDEBUG)
+static bool staged_list_freshly_alloced(struct staged_entry *head, uint64_t no)
+{
+	struct staged_entry *entry;
+	for (entry = head; entry; entry = entry->next)
+		if (no == entry->index)
+			return true;
+	return false;
+}
+#endif
+
+
+struct bitmap {
+	char *bitmap;
+	uint64_t ntotal;
+	uint64_t nfree;
+	struct staged_entry *allocs;
+	struct staged_entry *frees;
+	uint64_t prev_ntotal;
+};
+
+#define BITMAP_SCAN_MAX UINT64_MAX
+
+static int bitmap_init(struct bitmap *bitmap, uint64_t ntotal)
+{
+	size_t size = ntotal / 8;
+	xassert(!(ntotal % (sizeof(bitmap_scan_t) * 8)));
+	assert(!bitmap->bitmap);
+	bitmap->bitmap = malloc(size);
+	if (!bitmap->bitmap)
+		return -ENOMEM;
+	memset(bitmap->bitmap, 0, size);
+	bitmap->nfree = bitmap->ntotal = ntotal;
+	bitmap->allocs = bitmap->frees = NULL;
+	bitmap->prev_ntotal = 0;
+	return 0;
+}
+
+static void bitmap_destroy(struct bitmap *bitmap)
+{
+	free(bitmap->bitmap);
+	bitmap->bitmap = NULL;
+	staged_list_free(&bitmap->allocs);
+	staged_list_free(&bitmap->frees);
+}
+
+static int bitmap_resize(struct bitmap *bitmap, uint64_t ntotal)
+{
+	char *new_bitmap;
+
+	if (bitmap->ntotal == ntotal)
+		return 0;
+
+#ifndef NDEBUG
+	if (bitmap->ntotal > ntotal)
+	{
+		uint64_t i;
+		assert(!(ntotal % (sizeof(bitmap_scan_t) * 8)));
+		assert(!(bitmap->ntotal % (sizeof(bitmap_scan_t) * 8)));
+		for (i = ntotal; i < bitmap->ntotal; i += sizeof(bitmap_scan_t) * 8)
+			assert(!((bitmap_scan_t*) bitmap->bitmap)[i / 8]);
+	}
+#endif
+
+	new_bitmap = realloc(bitmap->bitmap, ntotal);
+	if (!new_bitmap)
+		return -ENOMEM;
+	bitmap->bitmap = new_bitmap;
+
+	if (!bitmap->prev_ntotal)
+		bitmap->prev_ntotal = bitmap->ntotal;
+
+	if (bitmap->ntotal < ntotal)
+	{
+		uint64_t delta = ntotal - bitmap->ntotal;
+		memset(bitmap->bitmap + bitmap->ntotal / 8, 0, delta / 8);
+		bitmap->nfree += delta;
+		bitmap->ntotal = ntotal;
+	}
+	else
+	{
+		uint64_t delta = bitmap->ntotal - ntotal;
+
+		// easier if these are NULL
+		assert(!bitmap->allocs);
+		assert(!bitmap->frees);
+
+		bitmap->nfree -= delta;
+		bitmap->ntotal = ntotal;
+	}
+
+	return 0;
+}
+
+static uint64_t bitmap_alloc(struct bitmap *bitmap)
+{
+	uint64_t i;
+	for (i = 0; i < bitmap->ntotal; i += sizeof(bitmap_scan_t) * 8)
+	{
+		bitmap_scan_t *word = (bitmap_scan_t*) (bitmap->bitmap + i / 8);
+		if (*word != BITMAP_SCAN_MAX)
+		{
+			int j;
+			for (j = 0; j < sizeof(*word) * 8; j++)
+			{
+				if (!(*word & (((bitmap_scan_t) 1) << j)))
+				{
+					struct staged_entry *found = malloc(sizeof(*found));
+					xassert(found); // No way to return non-ENOSPC error
+					found->index = i + j;
+					found->next = bitmap->allocs;
+					bitmap->allocs = found;
+					*word |= ((bitmap_scan_t) 1) << j;
+					bitmap->nfree--;
+					return found->index;
+				}
+			}
+		}
+	}
+	return bitmap->ntotal;
+}
+
+static void bitmap_set(struct bitmap *bitmap, uint64_t no)
+{
+	char *word = bitmap->bitmap + no / 8;
+	assert(no < bitmap->ntotal);
+	assert(!(*word & (1 << (no % 8))));
+	*word |= (1 << (no % 8));
+	bitmap->nfree--;
+}
+
+static bool bitmap_ensure_set(struct bitmap *bitmap, uint64_t no)
+{
+	char *word = bitmap->bitmap + no / 8;
+	bool was_set;
+	assert(no < bitmap->ntotal);
+	was_set = *word & (1 << (no % 8));
+	*word |= (1 << (no % 8));
+	if (!was_set)
+		bitmap->nfree--;
+	return was_set;
+}
+
+static void bitmap_free(struct bitmap *bitmap, uint64_t no)
+{
+	struct staged_entry *staged = malloc(sizeof(*staged));
+
+	assert(no < bitmap->ntotal);
+	assert(bitmap->bitmap[no / 8] & (1 << (no % 8)));
+	assert(!staged_list_freshly_alloced(bitmap->frees, no));
+
+	xassert(staged); // TODO/FIXME: recover
+
+	staged->index = no;
+	staged->next = bitmap->frees;
+	bitmap->frees = staged;
+}
+
+static void bitmap_unfree(struct bitmap *bitmap, uint64_t no)
+{
+	struct staged_entry *pstaged = NULL;
+	struct staged_entry *staged = bitmap->frees;
+	bool was_set;
+
+	assert(no < bitmap->ntotal);
+	assert(bitmap->bitmap[no / 8] & (1 << (no % 8)));
+
+	for (; staged; pstaged = staged, staged = staged->next)
+		if (no == staged->index)
+			break;
+	xassert(staged);
+
+	if (!pstaged)
+		bitmap->frees = staged->next;
+	else
+		pstaged->next = staged->next;
+	free(staged);
+
+	was_set = bitmap_ensure_set(bitmap, no);
+	assert(was_set);
+}
+
+static void bitmap_clear(struct bitmap *bitmap, uint64_t no)
+{
+	char *word = bitmap->bitmap + no / 8;
+
+	assert(no < bitmap->ntotal);
+	assert(*word & (1 << (no % 8)));
+
+	*word &= ~(1 << (no % 8));
+	bitmap->nfree++;
+}
+
+static void bitmap_unalloc(struct bitmap *bitmap, uint64_t no)
+{
+	struct staged_entry *pstaged = NULL;
+	struct staged_entry *staged = bitmap->allocs;
+
+	assert(no < bitmap->ntotal);
+	assert(bitmap->bitmap[no / 8] & (1 << (no % 8)));
+
+	for (; staged; pstaged = staged, staged = staged->next)
+		if (no == staged->index)
+			break;
+	xassert(staged);
+
+	if (!pstaged)
+		bitmap->allocs = staged->next;
+	else
+		pstaged->next = staged->next;
+	free(staged);
+
+	bitmap_clear(bitmap, no);
+}
+
+static void bitmap_abort(struct bitmap *bitmap)
+{
+	while (bitmap->allocs)
+	{
+		struct staged_entry *cur = bitmap->allocs;
+		bitmap_clear(bitmap, cur->index);
+		bitmap->allocs = bitmap->allocs->next;
+		free(cur);
+	}
+
+	staged_list_free(&bitmap->frees);
+
+	if (bitmap->prev_ntotal && bitmap->ntotal != bitmap->prev_ntotal)
+	{
+		uint64_t prev_ntotal = bitmap->prev_ntotal;
+		int r;
+		r = bitmap_resize(bitmap, prev_ntotal);
+		xassert(r >= 0); // TODO: recover
+	}
+	bitmap->prev_ntotal = 0;
+}
+
+static void bitmap_commit(struct bitmap *bitmap)
+{
+	staged_list_free(&bitmap->allocs);
+
+	while (bitmap->frees)
+	{
+		struct staged_entry *cur = bitmap->frees;
+		bitmap_clear(bitmap, cur->index);
+		bitmap->frees = bitmap->frees->next;
+		free(cur);
+	}
+
+	bitmap->prev_ntotal = 0;
+}
+
+#if DETECT_STRAY_ACCESSES
+// Limit the define only because the function is otherwise not referenced
+static bool bitmap_is_alloced(const struct bitmap *bitmap, uint64_t no)
+{
+	assert(no < bitmap->ntotal);
+	// right now this function is only used with no outstanding allocs or frees
+	assert(!bitmap->allocs);
+	assert(!bitmap->frees);
+	return bitmap->bitmap[no / 8] & (1 << (no % 8));
+}
+#endif
+
+
+//
+// block allocation
+
+struct block_allocation {
+	struct bitmap bitmap;
+};
+
+static struct block_allocation block_alloc;
+
+static bool reclaim_orphans(bool all);
+static void fsck_note_alloc_block(uint64_t blockno);
+
+static int init_block_allocations(void)
+{
+	return bitmap_init(&block_alloc.bitmap, bpfs_super->nblocks);
+}
+
+static void destroy_block_allocations(void)
+{
+	bitmap_destroy(&block_alloc.bitmap);
+}
+
+#if BLOCK_POISON
+static void poison_block(uint64_t blockno)
+{
+	uint32_t *block = (uint32_t*) get_block(blockno);
+	unsigned i;
+	for (i = 0; i < BPFS_BLOCK_SIZE / sizeof(*block); i++)
+		block[i] = 0xdeadbeef;
+}
+#endif
+
+static uint64_t alloc_block(void)
+{
+	uint64_t no = bitmap_alloc(&block_alloc.bitmap);
+	if (no == block_alloc.bitmap.ntotal && reclaim_orphans(true))
+		no = bitmap_alloc(&block_alloc.bitmap);
+#if COMMIT_MODE != MODE_BPFS
+	group_note_write();
+#endif
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, no + 1);
+	BPFS_PROBE(alloc_block,
+	           no == block_alloc.bitmap.ntotal ? BPFS_BLOCKNO_INVALID : no + 1,
+	           block_alloc.bitmap.nfree);
+	if (no == block_alloc.bitmap.ntotal)
+		return BPFS_BLOCKNO_INVALID;
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	assert(no + 1 >= BPFS_BLOCKNO_FIRST_ALLOC);
+	fsck_note_alloc_block(no + 1);
+#if (DETECT_STRAY_ACCESSES || DETECT_NONCOW_WRITES_SP || DETECT_NONCOW_WRITES_SCSP)
+	xsyscall(mprotect(get_block(no + 1), BPFS_BLOCK_SIZE, PROT_READ | PROT_WRITE));
+#endif
+#if BLOCK_POISON
+	poison_block(no + 1);
+#endif
+	return no + 1;
+}
+
+void unfree_block(uint64_t blockno)
+{
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, blockno);
+	assert(blockno != BPFS_BLOCKNO_INVALID);
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	bitmap_unfree(&block_alloc.bitmap, blockno - 1);
+#if (DETECT_STRAY_ACCESSES || DETECT_NONCOW_WRITES_SP)
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_READ | PROT_WRITE));
+#endif
+#if BLOCK_POISON
+	poison_block(blockno);
+#endif
+}
+
+#if COMMIT_MODE != MODE_BPFS
+bool block_freshly_alloced(uint64_t blockno)
+{
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	return staged_list_freshly_alloced(block_alloc.bitmap.allocs, blockno - 1);
+}
+#endif
+
+static void set_block(uint64_t blockno)
+{
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, blockno);
+	assert(blockno != BPFS_BLOCKNO_INVALID);
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	bitmap_set(&block_alloc.bitmap, blockno - 1);
+}
+
+static void free_block(uint64_t blockno)
+{
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, blockno);
+	assert(blockno != BPFS_BLOCKNO_INVALID);
+#if INDIRECT_COW
+	// indirect_cow may temporarily free the super block
+	assert(blockno == BPFS_BLOCKNO_SUPER
+	       || blockno >= BPFS_BLOCKNO_FIRST_ALLOC);
+#else
+	assert(blockno >= BPFS_BLOCKNO_FIRST_ALLOC);
+#endif
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	bitmap_free(&block_alloc.bitmap, blockno - 1);
+	BPFS_PROBE(free_block, blockno, block_alloc.bitmap.nfree);
+#if COMMIT_MODE != MODE_BPFS
+	group_note_write();
+#endif
+#if DETECT_STRAY_ACCESSES
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_NONE));
+#else
+# if BLOCK_POISON
+	poison_block(blockno);
+# endif
+# if DETECT_NONCOW_WRITES_SP
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_READ));
+# endif
+#endif
+}
+
+void unalloc_block(uint64_t blockno)
+{
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, blockno);
+	assert(blockno != BPFS_BLOCKNO_INVALID);
+	assert(blockno >= BPFS_BLOCKNO_FIRST_ALLOC);
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	bitmap_unalloc(&block_alloc.bitmap, blockno - 1);
+#if DETECT_STRAY_ACCESSES
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_NONE));
+#else
+# if BLOCK_POISON
+	poison_block(blockno);
+# endif
+# if DETECT_NONCOW_WRITES_SP
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_READ));
+# endif
+#endif
+}
+
+// Free a block of a committed orphan (see reclaim_orphans()). Unlike
+// free_block(), the block is free at once: no committed tree refers to it.
+static void reclaim_block(uint64_t blockno)
+{
+	DBprintf("%s() = %" PRIu64 "\n", __FUNCTION__, blockno);
+	assert(blockno >= BPFS_BLOCKNO_FIRST_ALLOC);
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	bitmap_clear(&block_alloc.bitmap, blockno - 1);
+#if DETECT_STRAY_ACCESSES
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_NONE));
+#else
+# if BLOCK_POISON
+	poison_block(blockno);
+# endif
+# if DETECT_NONCOW_WRITES_SP
+	xsyscall(mprotect(get_block(blockno), BPFS_BLOCK_SIZE, PROT_READ));
+# endif
+#endif
+}
+
+static void protect_bpram_abort(void)
+{
+#if DETECT_STRAY_ACCESSES
+	struct staged_entry *cur;
+	for (cur = block_alloc.bitmap.frees; cur; cur = cur->next)
+		xsyscall(mprotect(bpram + cur->index * BPFS_BLOCK_SIZE,
+		                  BPFS_BLOCK_SIZE, PROT_INUSE_OLD));
+	for (cur = block_alloc.bitmap.allocs; cur; cur = cur->next)
+		xsyscall(mprotect(bpram + cur->index * BPFS_BLOCK_SIZE,
+		                  BPFS_BLOCK_SIZE, PROT_NONE));
+#elif DETECT_NONCOW_WRITES_SP
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ));
+#endif
+}
+
+static void protect_bpram_commit(void)
+{
+#if DETECT_NONCOW_WRITES_SP
+# if DETECT_STRAY_ACCESSES
+	struct staged_entry *cur;
+	for (cur = block_alloc.bitmap.allocs; cur; cur = cur->next)
+		xsyscall(mprotect(bpram + cur->index * BPFS_BLOCK_SIZE,
+		                  BPFS_BLOCK_SIZE, PROT_READ));
+# else
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ));
+# endif
+#endif
+}
+
+static void abort_blocks(void)
+{
+	protect_bpram_abort();
+	bitmap_abort(&block_alloc.bitmap);
+}
+
+static void commit_blocks(void)
+{
+	protect_bpram_commit();
+	bitmap_commit(&block_alloc.bitmap);
+}
+
+char* get_block(uint64_t blockno)
+{
+#if INDIRECT_COW
+	char *block;
+#endif
+
+	if (blockno == BPFS_BLOCKNO_INVALID)
+	{
+		assert(0);
+		return NULL;
+	}
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	if (blockno > bpfs_super->nblocks)
+	{
+		assert(0);
+		return NULL;
+	}
+
+#if INDIRECT_COW
+	if ((block = indirect_cow_block_get(blockno)))
+	{
+		assert(!block_offset(block));
+		return block;
+	}
+#endif
+#if NVM_EMULATION
+	if (nvm_touched)
+		nvm_read(blockno);
+#endif
+	return bpram + (blockno - 1) * BPFS_BLOCK_SIZE;
+}
+
+#if DETECT_STRAY_ACCESSES
+// Limit the define only because the function is otherwise not referenced
+static bool block_is_alloced(uint64_t blockno)
+{
+	xassert(blockno != BPFS_BLOCKNO_INVALID);
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	return bitmap_is_alloced(&block_alloc.bitmap, blockno - 1);
+}
+#endif
+
+
+//
+// block utility functions
+
+// Allocate the block to copy old_blockno into
+static uint64_t cow_block_alloc(uint64_t old_blockno)
+{
+	uint64_t new_blockno;
+	int r;
+
+	new_blockno = alloc_block();
+	if (new_blockno == BPFS_BLOCKNO_INVALID)
+		return BPFS_BLOCKNO_INVALID;
+#if DETECT_NONCOW_WRITES_SCSP
+	xsyscall(mprotect(get_block(new_blockno), BPFS_BLOCK_SIZE, PROT_READ));
+#endif
+	r = indirect_cow_block_cow(old_blockno, new_blockno);
+	if (r < 0)
+	{
+		unalloc_block(new_blockno);
+		set_block(old_blockno);
+		return BPFS_BLOCKNO_INVALID;
+	}
+	return new_blockno;
+}
+
+uint64_t cow_block(uint64_t old_blockno,
+                   unsigned off, unsigned size, unsigned valid)
+{
+	uint64_t latency_start;
+	uint64_t new_blockno;
+	char *old_block;
+	char *new_block;
+	uint64_t end = off + size;
+
+	assert(off + size <= BPFS_BLOCK_SIZE);
+	assert(valid <= BPFS_BLOCK_SIZE);
+
+#if COMMIT_MODE != MODE_BPFS
+	if (block_freshly_alloced(old_blockno))
+		return old_blockno;
+#endif
+
+	latency_start = LATENCY_BEGIN(BPFS_LATENCY_COW);
+	new_blockno = cow_block_alloc(old_blockno);
+	if (new_blockno == BPFS_BLOCKNO_INVALID)
+	{
+		LATENCY_END(BPFS_LATENCY_COW, latency_start);
+		return BPFS_BLOCKNO_INVALID;
+	}
+
+	old_block = get_block(old_blockno);
+	new_block = get_block(new_blockno);
+#if INDIRECT_COW
+	// new_block is a DRAM shadow, so copying all of it is cheap. Then only
+	// the lines the caller writes are dirty, and the commit diffs only
+	// them to look for an in-place atomic write. (A block committed by
+	// CoW is still copied whole to its new BPRAM block.)
+	BPRAM_MEMCPY(new_block, old_block, BPFS_BLOCK_SIZE);
+#else
+	BPRAM_MEMCPY(new_block, old_block, off);
+	if (end < valid)
+		BPRAM_MEMCPY(new_block + end, old_block + end, valid - end);
+#endif
+	STATS_ADD(cow_bytes, off);
+	STATS_BPRAM_COPY(new_block, off);
+	if (end < valid)
+	{
+		STATS_ADD(cow_bytes, valid - end);
+		STATS_BPRAM_COPY(new_block + end, valid - end);
+	}
+	if (off || end < valid)
+		STATS_ADD(cow_blocks, 1);
+	// The caller writes [off, end); [valid, BPFS_BLOCK_SIZE) is undefined
+	indirect_cow_block_dirty(new_blockno, off, size);
+#if !INDIRECT_COW
+	indirect_cow_block_dirty(new_blockno, MAX(end, valid),
+	                         BPFS_BLOCK_SIZE - MAX(end, valid));
+#endif
+	free_block(old_blockno);
+	BPFS_PROBE(cow_block, old_blockno, new_blockno, off, size, valid);
+	LATENCY_END(BPFS_LATENCY_COW, latency_start);
+	return new_blockno;
+}
+
+uint64_t cow_block_hole(unsigned off, unsigned size, unsigned valid)
+{
+	uint64_t latency_start;
+	uint64_t blockno;
+	char *block;
+	uint64_t end = off + size;
+
+	assert(off + size <= BPFS_BLOCK_SIZE);
+	assert(valid <= BPFS_BLOCK_SIZE);
+
+	latency_start = LATENCY_BEGIN(BPFS_LATENCY_COW);
+	blockno = alloc_block();
+	if (blockno == BPFS_BLOCKNO_INVALID)
+	{
+		LATENCY_END(BPFS_LATENCY_COW, latency_start);
+		return BPFS_BLOCKNO_INVALID;
+	}
+	// DETECT_NONCOW_WRITES_SCSP: do not mark read-only; no dram copy
+
+	block = get_block(blockno);
+	BPRAM_MEMSET(block, 0, off);
+	STATS_ADD(zero_bytes, off);
+	if (end < valid)
+	{
+		BPRAM_MEMSET(block + end, 0, valid - end);
+		STATS_ADD(zero_bytes, valid - end);
+	}
+	BPFS_PROBE(cow_block_hole, blockno, off, size, valid);
+	LATENCY_END(BPFS_LATENCY_COW, latency_start);
+	return blockno;
+}
+
+uint64_t cow_block_entire(uint64_t old_blockno)
+{
+	uint64_t latency_start;
+	uint64_t new_blockno;
+	char *old_block;
+	char *new_block;
+
+#if COMMIT_MODE != MODE_BPFS
+	if (block_freshly_alloced(old_blockno))
+		return old_blockno;
+#endif
+
+	latency_start = LATENCY_BEGIN(BPFS_LATENCY_COW);
+	new_blockno = cow_block_alloc(old_blockno);
+	if (new_blockno == BPFS_BLOCKNO_INVALID)
+	{
+		LATENCY_END(BPFS_LATENCY_COW, latency_start);
+		return BPFS_BLOCKNO_INVALID;
+	}
+
+	old_block = get_block(old_blockno);
+	new_block = get_block(new_blockno);
+	BPRAM_MEMCPY(new_block, old_block, BPFS_BLOCK_SIZE);
+	STATS_ADD(cow_bytes, BPFS_BLOCK_SIZE);
+	STATS_ADD(cow_blocks, 1);
+	STATS_BPRAM_COPY(new_block, BPFS_BLOCK_SIZE);
+	free_block(old_blockno);
+	BPFS_PROBE(cow_block_entire, old_blockno, new_blockno);
+	LATENCY_END(BPFS_LATENCY_COW, latency_start);
+	return new_blockno;
+}
+
+static void callback_truncate_block_free(uint64_t blockno, bool leaf)
+{
+	free_block(blockno);
+}
+
+static void truncate_block_free(struct bpfs_tree_root *root, uint64_t new_size)
+{
+	uint64_t off = ROUNDUP64(new_size, BPFS_BLOCK_SIZE);
+	if (off < root->nbytes)
+		crawl_blocknos(root, off, BPFS_EOF, callback_truncate_block_free);
+}
+
+
+//
+// inode allocation
+
+struct bpfs_tree_root* get_inode_root(void)
+{
+	return (struct bpfs_tree_root*) get_block(bpfs_super->inode_root_addr);
+}
+
+struct inode_allocation {
+	struct bitmap bitmap;
+};
+
+static struct inode_allocation inode_alloc;
+
+static int init_inode_allocations(void)
+{
+	struct bpfs_tree_root *inode_root = get_inode_root();
+
+	// This code assumes that inodes are contiguous in the inode tree
+	static_assert(!(BPFS_BLOCK_SIZE % sizeof(struct bpfs_inode)));
+
+	return bitmap_init(&inode_alloc.bitmap,
+	                   NBLOCKS_FOR_NBYTES(inode_root->nbytes)
+	                   * BPFS_INODES_PER_BLOCK);
+}
+
+static void destroy_inode_allocations(void)
+{
+	bitmap_destroy(&inode_alloc.bitmap);
+}
+
+static int callback_init_inodes(uint64_t blockoff, char *block,
+                                unsigned off, unsigned size, unsigned valid,
+                                uint64_t crawl_start, enum commit commit,
+                                void *user, uint64_t *blockno)
+{
+#if APPEASE_VALGRIND || DETECT_ZEROLINKS_WITH_LINKS
+	assert(!(off % sizeof(struct bpfs_inode)));
+	for (; off + sizeof(struct bpfs_inode) <= size; off += sizeof(struct bpfs_inode))
+	{
+		struct bpfs_inode *inode = (struct bpfs_inode*) (block + off);
+# if APPEASE_VALGRIND
+		// init the generation field. not required, but appeases valgrind.
+		BPRAM_STORE(inode->generation, 0);
+# endif
+# if DETECT_ZEROLINKS_WITH_LINKS
+		BPRAM_STORE(inode->nlinks, 0);
+# endif
+	}
+#endif
+	return 0;
+}
+
+static struct bpfs_inode* get_inode(uint64_t ino);
+static void fsck_reach_inode(uint64_t ino);
+static void group_note_new_inode(uint64_t ino);
+static void group_note_name(uint64_t parent_ino, const char *name);
+static uint64_t next_generation(uint64_t ino);
+
+static uint64_t alloc_inode(void)
+{
+	uint64_t no = bitmap_alloc(&inode_alloc.bitmap);
+	if (no == inode_alloc.bitmap.ntotal && reclaim_orphans(true))
+		no = bitmap_alloc(&inode_alloc.bitmap);
+#if COMMIT_MODE != MODE_BPFS
+	group_note_write();
+#endif
+	if (no == inode_alloc.bitmap.ntotal)
+	{
+		struct bpfs_tree_root *inode_root = get_inode_root();
+		if (crawl_inodes(inode_root->nbytes, inode_root->nbytes,
+		                 COMMIT_ATOMIC, callback_init_inodes, NULL) < 0)
+			return BPFS_INO_INVALID;
+		inode_root = get_inode_root();
+		xcall(bitmap_resize(&inode_alloc.bitmap,
+		                    inode_root->nbytes / sizeof(struct bpfs_inode)));
+		no = bitmap_alloc(&inode_alloc.bitmap);
+		assert(no != inode_alloc.bitmap.ntotal);
+	}
+	static_assert(BPFS_INO_INVALID == 0);
+#if DETECT_ZEROLINKS_WITH_LINKS
+	assert(!get_inode(no + 1)->nlinks);
+#endif
+	DIprintf("%s() -> ino %" PRIu64 "\n", __FUNCTION__, no + 1);
+	BPFS_PROBE(alloc_inode, no + 1);
+	fsck_reach_inode(no + 1);
+	group_note_new_inode(no + 1);
+	return no + 1;
+}
+
+static bool set_inode(uint64_t ino)
+{
+	assert(ino != BPFS_INO_INVALID);
+	static_assert(BPFS_INO_INVALID == 0);
+	return bitmap_ensure_set(&inode_alloc.bitmap, ino - 1);
+}
+
+static void abort_inodes(void)
+{
+	bitmap_abort(&inode_alloc.bitmap);
+}
+
+static void commit_inodes(void)
+{
+	bitmap_commit(&inode_alloc.bitmap);
+}
+
+int get_inode_offset(uint64_t ino, uint64_t *poffset)
+{
+	uint64_t no;
+	uint64_t offset;
+
+	if (ino == BPFS_INO_INVALID)
+	{
+		assert(0);
+		return -EINVAL;
+	}
+
+	static_assert(BPFS_INO_INVALID == 0);
+	no = ino - 1;
+
+	if (no >= inode_alloc.bitmap.ntotal)
+	{
+		assert(0);
+		return -EINVAL;
+	}
+
+	offset = no * sizeof(struct bpfs_inode);
+	if (offset + sizeof(struct bpfs_inode) > get_inode_root()->nbytes)
+	{
+		assert(0);
+		return -EINVAL;
+	}
+	*poffset = offset;
+	return 0;
+}
+
+static int callback_get_inode(char *block, unsigned off,
+                              struct bpfs_inode *inode, enum commit commit,
+                              void *pinode_void, uint64_t *blockno)
+{
+	struct bpfs_inode **pinode = pinode_void;
+	*pinode = inode;
+	return 0;
+}
+
+static struct bpfs_inode* get_inode(uint64_t ino)
+{
+	struct bpfs_inode *inode;
+	xcall(crawl_inode(ino, COMMIT_NONE, callback_get_inode, &inode));
+	return inode;
+}
+
+
+//
+// misc internal functions
+
+/* Return whether a write can be made atomically.
+ * 'offset': byte offset into the block.
+ * 'size': number of bytes to write.
+ */
+static bool can_atomic_write(unsigned offset, unsigned size)
+{
+	unsigned last = offset + size - 1;
+	return last - offset < ATOMIC_SIZE
+	       && (offset % ATOMIC_SIZE) <= (last % ATOMIC_SIZE);
+}
+
+// Whether the CPU has CMPXCHG16B (see detect_atomic16())
+static bool atomic16;
+
+static void detect_atomic16(void)
+{
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		atomic16 = !!(ecx & bit_CMPXCHG16B);
+#endif
+}
+
+bool can_atomic_write16(const void *dst, unsigned size)
+{
+	return atomic16 && size
+	       && ((uintptr_t) dst) % ATOMIC16_SIZE + size <= ATOMIC16_SIZE;
+}
+
+void atomic_write16(void *dst, const void *src, unsigned size)
+{
+#if defined(__x86_64__)
+	uint64_t *chunk = (uint64_t*) ((uintptr_t) dst & ~(ATOMIC16_SIZE - 1));
+	uint64_t new[2];
+	uint64_t old_lo = chunk[0], old_hi = chunk[1];
+	bool done;
+
+	assert(can_atomic_write16(dst, size));
+	STORE_COUNT(chunk, ATOMIC16_SIZE);
+	do
+	{
+		new[0] = old_lo;
+		new[1] = old_hi;
+		memcpy((char*) new + ((char*) dst - (char*) chunk), src, size);
+		// On failure, loads the chunk's current value into old_hi:old_lo
+		__asm__ __volatile__("lock cmpxchg16b %1; setz %0"
+		                     : "=q" (done), "+m" (*chunk),
+		                       "+a" (old_lo), "+d" (old_hi)
+		                     : "b" (new[0]), "c" (new[1])
+		                     : "cc", "memory");
+	} while (!done);
+#else
+	assert(0);
+#endif
+}
+
+static uint64_t tree_nblocks_nblocks;
+
+static void callback_tree_nblocks(uint64_t blockno, bool leaf)
+{
+	assert(blockno != BPFS_BLOCKNO_INVALID);
+	if (leaf)
+		tree_nblocks_nblocks++;
+}
+
+static uint64_t tree_nblocks(const struct bpfs_tree_root *root)
+{
+	uint64_t nblocks;
+
+	assert(!tree_nblocks_nblocks);
+
+	crawl_blocknos(root, 0, BPFS_EOF, callback_tree_nblocks);
+
+	nblocks = tree_nblocks_nblocks;
+	tree_nblocks_nblocks = 0;
+	return nblocks;
+}
+
+#if (COMMIT_MODE == MODE_SP) && !defined(NDEBUG)
+// Limit the define only because the function is otherwise not referenced
+static uint64_t bpram_blockno(const void *x)
+{
+	const char *c = (const char*) x;
+	assert(bpram <= c && c < bpram + bpram_size);
+	if (c < bpram || bpram + bpram_size <= c)
+		return BPFS_BLOCKNO_INVALID;
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	return (((uintptr_t) (c - bpram)) / BPFS_BLOCK_SIZE) + 1;
+}
+#endif
+
+// Bytes past root.nbytes and before inode->size read as zeros
+static uint64_t inode_size(const struct bpfs_inode *inode)
+{
+	return MAX(inode->size, inode->root.nbytes);
+}
+
+static int bpfs_stat(uint64_t ino, struct stat *stbuf)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+	if (!inode)
+		return -ENOENT;
+	assert(inode->nlinks);
+	memset(stbuf, 0, sizeof(stbuf));
+	/* stbuf->st_dev */
+	stbuf->st_ino = ino;
+	stbuf->st_nlink = inode->nlinks;
+	stbuf->st_mode = b2f_mode(inode->mode);
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	/* stbuf->st_rdev */
+	stbuf->st_size = inode_size(inode);
+	stbuf->st_blksize = BPFS_BLOCK_SIZE;
+	stbuf->st_blocks = tree_nblocks(&inode->root) * BPFS_BLOCK_SIZE / 512;
+	stbuf->st_atime = inode->atime.sec;
+	stbuf->st_atim.tv_nsec = 0; // TODO: read nsec from inode
+	stbuf->st_mtime = inode->mtime.sec;
+	stbuf->st_mtim.tv_nsec = 0; // TODO: read nsec from inode
+	stbuf->st_ctime = inode->ctime.sec;
+	stbuf->st_ctim.tv_nsec = 0; // TODO: read nsec from inode
+	return 0;
+}
+
+static void mdirent_init_dirent(struct mdirent *md,
+                          const struct bpfs_dirent *d, uint64_t off)
+{
+	mdirent_init(md, d->name, off, d->ino, get_inode(d->ino)->generation,
+	             d->rec_len, d->file_type);
+}
+
+// Counts per inode, kept in a map of ino -> count.
+// Inodes with a count of zero are not in the map.
+
+static uint64_t ino_count_get(hash_map_t *counts, uint64_t ino)
+{
+	return (uintptr_t) hash_map_find_val(counts, u64_ptr(ino));
+}
+
+static void ino_count_add(hash_map_t *counts, uint64_t ino, uint64_t n)
+{
+	uint64_t count = ino_count_get(counts, ino);
+	int r = hash_map_insert(counts, u64_ptr(ino), u64_ptr(count + n));
+	xassert(r >= 0); // FIXME: recover from OOM
+}
+
+static void ino_count_sub(hash_map_t *counts, uint64_t ino, uint64_t n)
+{
+	uint64_t count = ino_count_get(counts, ino);
+	assert(count >= n);
+	if (count == n)
+		(void) hash_map_erase(counts, u64_ptr(ino));
+	else
+		xcall(hash_map_insert(counts, u64_ptr(ino), u64_ptr(count - n)));
+}
+
+
+//
+// atomic setters for struct height_addr
+
+void ha_set_addr(struct height_addr *pha, uint64_t addr)
+{
+	struct height_addr ha = { .height = pha->height, .addr = addr };
+	assert(addr <= BPFS_TREE_ROOT_MAX_ADDR);
+	BPRAM_STORE(*pha, ha);
+}
+
+void ha_set(struct height_addr *pha, uint64_t height, uint64_t addr)
+{
+	struct height_addr ha = { .height = height, .addr = addr };
+	assert(height <= BPFS_TREE_MAX_HEIGHT);
+	assert(addr <= BPFS_TREE_ROOT_MAX_ADDR);
+	BPRAM_STORE(*pha, ha);
+}
+
+
+//
+// tree functions
+
+uint64_t tree_max_nblocks(uint64_t height)
+{
+	uint64_t max_nblocks = 1;
+	while (height--)
+		max_nblocks *= BPFS_BLOCKNOS_PER_INDIR;
+	return max_nblocks;
+}
+
+uint64_t tree_height(uint64_t nblocks)
+{
+	uint64_t height = 0;
+	uint64_t max_nblocks = 1;
+	while (nblocks > max_nblocks)
+	{
+		max_nblocks *= BPFS_BLOCKNOS_PER_INDIR;
+		height++;
+	}
+	return height;
+}
+
+int tree_change_height(struct bpfs_tree_root *root,
+                       unsigned new_height,
+                       enum commit commit, uint64_t *blockno)
+{
+	uint64_t height = tree_root_height(root);
+	uint64_t new_root_addr;
+
+	assert(commit != COMMIT_NONE);
+
+	if (height == new_height)
+		return 0;
+
+	if (new_height > height)
+	{
+		if (root->nbytes && tree_root_addr(root) != BPFS_BLOCKNO_INVALID)
+		{
+			uint64_t child_max_nbytes = BPFS_BLOCK_SIZE
+			                            * tree_max_nblocks(height);
+			new_root_addr = tree_root_addr(root);
+			for (; height < new_height; height++)
+			{
+				uint64_t max_nbytes = BPFS_BLOCKNOS_PER_INDIR
+				                      * child_max_nbytes;
+				uint64_t new_blockno;
+				struct bpfs_indir_block *new_indir;
+
+				if ((new_blockno = alloc_block()) == BPFS_BLOCKNO_INVALID)
+					return -ENOSPC;
+				new_indir = (struct bpfs_indir_block*) get_block(new_blockno);
+
+				BPRAM_STORE(new_indir->addr[0], new_root_addr);
+
+				// If the file was larger than the tree we need to mark the
+				//   newly valid block entries as sparse.
+				// This is truncate_block_zero(), but simpler.
+				if (child_max_nbytes < root->nbytes)
+				{
+					uint64_t valid = child_max_nbytes;
+					uint64_t next_valid = MIN(root->nbytes, max_nbytes);
+					int i = 1;
+					for (; valid < next_valid; i++, valid += child_max_nbytes)
+						BPRAM_STORE(new_indir->addr[i], BPFS_BLOCKNO_INVALID);
+				}
+
+				new_root_addr = new_blockno;
+				child_max_nbytes = max_nbytes;
+			}
+		}
+		else
+			new_root_addr = BPFS_BLOCKNO_INVALID;
+	}
+	else
+	{
+		unsigned height_delta = height - new_height;
+		new_root_addr = tree_root_addr(root);
+		while (height_delta-- && new_root_addr != BPFS_BLOCKNO_INVALID)
+		{
+			struct bpfs_indir_block *indir = (struct bpfs_indir_block*) get_block(new_root_addr);
+			// truncate_block_free() has freed the rest of the block's tree
+			uint64_t child_addr = indir->addr[0];
+			free_block(new_root_addr);
+			new_root_addr = child_addr;
+		}
+	}
+
+	if (commit == COMMIT_COPY)
+	{
+		unsigned root_off = block_offset(root);
+		uint64_t new_blockno = cow_block_entire(*blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		root = (struct bpfs_tree_root*) (get_block(new_blockno) + root_off);
+		*blockno = new_blockno;
+	}
+
+	ha_set(&root->ha, new_height, new_root_addr);
+	return 0;
+}
+
+uint64_t tree_root_height(const struct bpfs_tree_root *root)
+{
+	if (!root->nbytes)
+		return BPFS_BLOCKNO_INVALID;
+	return root->ha.height;
+}
+
+uint64_t tree_root_addr(const struct bpfs_tree_root *root)
+{
+	if (!root->nbytes)
+		return BPFS_BLOCKNO_INVALID;
+	return root->ha.addr;
+}
+
+
+//
+// orphan reclamation
+
+// Unlinking an inode's last dirent makes the inode an orphan: the inode
+// and its blocks stay allocated until reclaim_orphans() frees them, a
+// chunk at a time, so that unlinking takes the same time for any file.
+// Orphans need no persistent record: once the dirent removal commits, the
+// inode is unreachable and mounting does not discover its allocations.
+
+// The most blocks of file data that one reclamation step frees
+#define ORPHAN_RECLAIM_NBLOCKS 256
+
+struct orphan
+{
+	uint64_t ino;
+	struct bpfs_tree_root root; // the part of the tree not yet freed
+};
+
+// struct orphan*s, oldest first. Only the first norphans_committed have
+// had their unlink commit, so only they can be reclaimed.
+static vector_t *orphans;
+static size_t norphans_committed;
+// The orphans by inode number
+static hash_map_t *orphan_inos;
+
+static int add_orphan(uint64_t ino)
+{
+	struct orphan *orphan = malloc(sizeof(*orphan));
+	int r;
+
+	if (!orphan)
+		return -ENOMEM;
+	orphan->ino = ino;
+	orphan->root = get_inode(ino)->root;
+	r = hash_map_insert(orphan_inos, u64_ptr(ino), orphan);
+	if (r < 0)
+	{
+		free(orphan);
+		return r;
+	}
+	r = vector_push_back(orphans, orphan);
+	if (r < 0)
+	{
+		(void) hash_map_erase(orphan_inos, u64_ptr(ino));
+		free(orphan);
+		return r;
+	}
+	return 0;
+}
+
+static void commit_orphans(void)
+{
+	norphans_committed = vector_size(orphans);
+}
+
+static void abort_orphans(void)
+{
+	while (vector_size(orphans) > norphans_committed)
+	{
+		struct orphan *orphan = vector_elt_end(orphans);
+		(void) hash_map_erase(orphan_inos, u64_ptr(orphan->ino));
+		free(orphan);
+		vector_pop_back(orphans);
+	}
+}
+
+static void destroy_orphans(void)
+{
+	norphans_committed = 0;
+	abort_orphans();
+	vector_destroy(orphans);
+	orphans = NULL;
+	hash_map_destroy(orphan_inos);
+	orphan_inos = NULL;
+}
+
+static void callback_reclaim_block(uint64_t blockno, bool leaf)
+{
+	reclaim_block(blockno);
+}
+
+// Free the oldest committed orphan's last ORPHAN_RECLAIM_NBLOCKS blocks of
+// data, and the orphan itself once nothing else remains. If all, free all
+// committed orphans. Return whether there was anything to free.
+static bool reclaim_orphans(bool all)
+{
+	const uint64_t chunk = ORPHAN_RECLAIM_NBLOCKS * BPFS_BLOCK_SIZE;
+	bool reclaimed = false;
+
+	while (norphans_committed)
+	{
+		struct orphan *orphan = vector_elt_front(orphans);
+		uint64_t nbytes = orphan->root.nbytes;
+
+		if (nbytes)
+		{
+			uint64_t off = 0;
+			if (nbytes > chunk)
+				off = ROUNDUP64(nbytes - chunk, BPFS_BLOCK_SIZE);
+			crawl_blocknos(&orphan->root, off, BPFS_EOF,
+			               callback_reclaim_block);
+			orphan->root.nbytes = off;
+		}
+		if (!orphan->root.nbytes)
+		{
+			static_assert(BPFS_INO_INVALID == 0);
+			bitmap_clear(&inode_alloc.bitmap, orphan->ino - 1);
+			vector_erase(orphans, 0);
+			norphans_committed--;
+			(void) hash_map_erase(orphan_inos, u64_ptr(orphan->ino));
+			free(orphan);
+		}
+		reclaimed = true;
+		if (!all)
+			break;
+	}
+	return reclaimed;
+}
+
+
+//
+// block and inode allocation discovery
+
+static void discover_indir_allocations(struct bpfs_indir_block *indir,
+                                       unsigned height,
+                                       uint64_t max_nblocks,
+                                       uint64_t valid)
+{
+	uint64_t child_max_nblocks = max_nblocks / BPFS_BLOCKNOS_PER_INDIR;
+	uint64_t child_max_nbytes = child_max_nblocks * BPFS_BLOCK_SIZE;
+	uint64_t lastno = (valid - 1) / (BPFS_BLOCK_SIZE * child_max_nblocks);
+	unsigned no;
+	for (no = 0; no <= lastno; no++)
+	{
+		if (indir->addr[no] != BPFS_BLOCKNO_INVALID)
+		{
+			set_block(indir->addr[no]);
+			if (height > 1)
+			{
+				struct bpfs_indir_block *child_indir = (struct bpfs_indir_block*) get_block(indir->addr[no]);
+				uint64_t child_valid;
+				if (no < lastno)
+					child_valid = child_max_nbytes;
+				else
+					child_valid = valid - no * child_max_nbytes;
+				discover_indir_allocations(child_indir, height - 1,
+				                           child_max_nblocks, child_valid);
+			}
+		}
+	}
+}
+
+static void discover_tree_allocations(struct bpfs_tree_root *root)
+{
+	// TODO: better to call crawl_tree()?
+	if (tree_root_addr(root) == BPFS_BLOCKNO_INVALID)
+		return;
+
+	set_block(tree_root_addr(root));
+	if (tree_root_height(root))
+	{
+		struct bpfs_indir_block *indir =
+			(struct bpfs_indir_block*) get_block(tree_root_addr(root));
+		uint64_t max_nblocks = tree_max_nblocks(tree_root_height(root));
+		discover_indir_allocations(indir, tree_root_height(root), max_nblocks,
+		                           root->nbytes);
+	}
+}
+
+static void discover_orphan_allocations(void)
+{
+	size_t i;
+	for (i = 0; i < vector_size(orphans); i++)
+	{
+		struct orphan *orphan = vector_elt(orphans, i);
+		xassert(!set_inode(orphan->ino));
+		discover_tree_allocations(&orphan->root);
+	}
+}
+
+static void discover_inode_allocations(uint64_t ino, bool mounting);
+
+struct mount_ino {
+	bool mounting;
+	uint64_t ino;
+};
+
+static int callback_discover_inodes(uint64_t blockoff, char *block,
+                                    unsigned off, unsigned size,
+                                    unsigned valid, uint64_t crawl_start,
+                                    enum commit commit, void *mi_void,
+                                    uint64_t *blockno)
+{
+	const struct mount_ino *mi = (const struct mount_ino*) mi_void;
+	unsigned end = off + size;
+
+	while (off + BPFS_DIRENT_MIN_LEN <= end)
+	{
+		struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+		if (!dirent->rec_len)
+		{
+			// end of directory entries in this block
+			break;
+		}
+		off += dirent->rec_len;
+		xassert(off <= BPFS_BLOCK_SIZE);
+
+		if (dirent->ino != BPFS_INO_INVALID)
+		{
+			discover_inode_allocations(dirent->ino, mi->mounting);
+
+			// Account for child's ".." dirent (not stored on disk):
+			if (mi->mounting && !bpfs_super->ephemeral_valid
+			    && dirent->file_type == BPFS_TYPE_DIR)
+			{
+				struct bpfs_inode *inode = get_inode(mi->ino);
+				BPRAM_STORE(inode->nlinks, inode->nlinks + 1);
+				xassert(inode->nlinks);
+			}
+		}
+	}
+	return 0;
+}
+
+static void discover_inode_allocations(uint64_t ino, bool mounting)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+	struct mount_ino mi = {.mounting = mounting, .ino = ino};
+	bool is_dir = BPFS_S_ISDIR(inode->mode);
+	bool was_set;
+
+	was_set = set_inode(ino);
+	xassert(!is_dir || !was_set); // a dir has only one non-".." dirent
+
+	if (mounting && !bpfs_super->ephemeral_valid)
+	{
+		BPRAM_STORE(inode->nlinks, inode->nlinks + 1);
+		xassert(inode->nlinks);
+		if (is_dir)
+		{
+			// Account for inode's "." dirent (not stored on disk):
+			BPRAM_STORE(inode->nlinks, inode->nlinks + 1);
+			xassert(inode->nlinks);
+		}
+	}
+	else
+	{
+		if (is_dir)
+			xassert(inode->nlinks >= 2);
+		else
+			xassert(inode->nlinks >= 1);
+	}
+
+	if (!was_set)
+	{
+		// TODO: combine the inode and block discovery loops?
+		discover_tree_allocations(&inode->root);
+		if (is_dir)
+			xcall(crawl_data(ino, 0, BPFS_EOF, COMMIT_NONE,
+			                 callback_discover_inodes, &mi));
+	}
+}
+
+static int callback_reset_inodes_nlinks(uint64_t blockoff, char *block,
+                                        unsigned off, unsigned size,
+                                        unsigned valid, uint64_t crawl_start,
+                                        enum commit commit, void *user,
+                                        uint64_t *blockno)
+{
+	assert(!(off % sizeof(struct bpfs_inode)));
+	assert(commit == COMMIT_FREE || commit == COMMIT_ATOMIC);
+
+	for (; off + sizeof(struct bpfs_inode) <= size; off += sizeof(struct bpfs_inode))
+	{
+		struct bpfs_inode *inode = (struct bpfs_inode*) (block + off);
+		BPRAM_STORE(inode->nlinks, 0);
+	}
+	return 0;
+}
+
+static void reset_inodes_nlinks(void)
+{
+	xcall(crawl_inodes(0, get_inode_root()->nbytes, COMMIT_FREE,
+	                   callback_reset_inodes_nlinks, NULL));
+}
+
+static int init_allocations(bool mounting)
+{
+	uint64_t i;
+
+	xcall(init_block_allocations());
+	xcall(init_inode_allocations());
+
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	for (i = 1; i < BPFS_BLOCKNO_FIRST_ALLOC; i++)
+		set_block(i);
+	set_block(bpfs_super->inode_root_addr);
+
+	discover_tree_allocations(get_inode_root());
+
+	// Only reset inode nlinks during mounting so that we do not distrub
+	// write counting
+	if (mounting && !bpfs_super->ephemeral_valid)
+		reset_inodes_nlinks();
+	discover_inode_allocations(BPFS_INO_ROOT, mounting);
+	discover_orphan_allocations();
+	if (mounting && !bpfs_super->ephemeral_valid)
+	{
+		BPRAM_STORE(bpfs_super->ephemeral_valid, 1);
+		indirect_cow_block_dirty(get_super_blockno(),
+		                         block_offset(&bpfs_super->ephemeral_valid),
+		                         sizeof(bpfs_super->ephemeral_valid));
+	}
+
+	return 0;
+}
+
+static void destroy_allocations(void)
+{
+	destroy_inode_allocations();
+	destroy_block_allocations();
+}
+
+
+
+//
+// online fsck
+
+// With bpfs_options.fsck_budget, operations that complete with nothing
+// left to commit may each take a step of a pass that checks the file
+// system: a few inodes' trees and directories, the orphans, or a region of
+// the block or inode bitmap. A step thus sees only committed state. Steps
+// are paced so that they take fsck_budget percent of the time.
+// The file system changes between steps, so a pass records the blocks that
+// it finds in trees (walked) and that are allocated during the pass
+// (fresh). A block moves to another tree only by being freed and allocated
+// again, which clears its walked bit. So a walked block found again is in
+// two trees, and an allocated block that is neither walked nor fresh at
+// the end of the pass is leaked. Likewise, an allocated inode should be
+// found in a directory, be created or linked during the pass, or be an
+// orphan.
+
+// The number of blocks a step checks, rounded up to whole inodes
+#define FSCK_STEP_NBLOCKS 64
+// The number of bitmap bits a step checks for leaks
+#define FSCK_STEP_NBITS (BPFS_BLOCK_SIZE * 8)
+// The number of inconsistencies printed per pass
+#define FSCK_MAX_REPORTS 16
+
+enum fsck_phase
+{
+	FSCK_BEGIN,       // check the inode file and start checking inodes
+	FSCK_INODES,      // check each allocated inode that is not an orphan
+	FSCK_ORPHANS,     // check the orphans' remaining trees
+	FSCK_BLOCK_LEAKS, // check the block bitmap for leaked blocks
+	FSCK_INODE_LEAKS, // check the inode bitmap for leaked inodes
+};
+
+struct fsck
+{
+	unsigned budget;    // percent of the time, 0 if disabled
+	enum fsck_phase phase;
+	uint64_t next;      // the bitmap index to check next
+	uint64_t nchecked;  // blocks checked in this step
+	uint64_t next_step; // when the next step may run, in ns
+	char *walked;       // blocks found in a tree, by bitmap index
+	char *fresh;        // blocks allocated, by bitmap index
+	char *reached;      // inodes named, created, or linked, by bitmap index
+	uint64_t ninodes;   // the number of inodes in reached
+	uint64_t npasses;
+	uint64_t nerrors;   // in this pass
+	uint64_t nerrors_total;
+};
+
+static struct fsck fsck;
+
+static bool fsck_test(const char *bitmap, uint64_t no)
+{
+	return bitmap[no / 8] & (1 << (no % 8));
+}
+
+static void fsck_set(char *bitmap, uint64_t no)
+{
+	bitmap[no / 8] |= 1 << (no % 8);
+}
+
+static void fsck_note_alloc_block(uint64_t blockno)
+{
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	if (!fsck.walked)
+		return;
+	fsck.walked[(blockno - 1) / 8] &= ~(1 << ((blockno - 1) % 8));
+	fsck_set(fsck.fresh, blockno - 1);
+}
+
+static void fsck_reach_inode(uint64_t ino)
+{
+	static_assert(BPFS_INO_INVALID == 0);
+	if (fsck.reached && ino - 1 < fsck.ninodes)
+		fsck_set(fsck.reached, ino - 1);
+}
+
+static void fsck_report(const char *format, ...)
+{
+	va_list ap;
+
+	if (fsck.nerrors++ >= FSCK_MAX_REPORTS)
+		return;
+	fprintf(stderr, "bpfs fsck: ");
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+static bool is_orphan(uint64_t ino)
+{
+	return hash_map_find_val(orphan_inos, u64_ptr(ino)) != NULL;
+}
+
+// Check and record that blockno is in the tree of ino (0: the inode file).
+// A block may also be in another tree if shared. Return whether the block
+// can be read.
+static bool fsck_block(uint64_t ino, uint64_t blockno, bool shared)
+{
+	uint64_t no = blockno - 1;
+
+	fsck.nchecked++;
+	if (blockno < BPFS_BLOCKNO_FIRST_ALLOC || blockno > bpfs_super->nblocks)
+	{
+		fsck_report("inode %" PRIu64 ": block %" PRIu64 " is out of range",
+		            ino, blockno);
+		return false;
+	}
+	if (!fsck_test(block_alloc.bitmap.bitmap, no))
+	{
+		fsck_report("inode %" PRIu64 ": block %" PRIu64 " is free",
+		            ino, blockno);
+		return false;
+	}
+	if (fsck_test(fsck.walked, no) && !shared)
+		fsck_report("inode %" PRIu64 ": block %" PRIu64 " is also in"
+		            " another tree", ino, blockno);
+	fsck_set(fsck.walked, no);
+	return true;
+}
+
+static bool fsck_indir(uint64_t ino, uint64_t blockno, unsigned height,
+                       uint64_t max_nblocks, uint64_t valid, bool shared)
+{
+	struct bpfs_indir_block *indir;
+	uint64_t child_max_nblocks;
+	uint64_t child_max_nbytes;
+	uint64_t lastno;
+	uint64_t no;
+	bool intact = true;
+
+	if (!fsck_block(ino, blockno, shared))
+		return false;
+	if (!height)
+		return true;
+
+	indir = (struct bpfs_indir_block*) get_block(blockno);
+	child_max_nblocks = max_nblocks / BPFS_BLOCKNOS_PER_INDIR;
+	child_max_nbytes = child_max_nblocks * BPFS_BLOCK_SIZE;
+	lastno = (valid - 1) / child_max_nbytes;
+	for (no = 0; no <= lastno; no++)
+	{
+		uint64_t child_valid;
+		if (indir->addr[no] == BPFS_BLOCKNO_INVALID)
+			continue;
+		if (no < lastno)
+			child_valid = child_max_nbytes;
+		else
+			child_valid = valid - no * child_max_nbytes;
+		if (!fsck_indir(ino, indir->addr[no], height - 1, child_max_nblocks,
+		                child_valid, shared))
+			intact = false;
+	}
+	return intact;
+}
+
+// Check the blocks of ino's tree root, as discover_tree_allocations()
+// finds them. Return whether the whole tree can be read.
+static bool fsck_tree(uint64_t ino, const struct bpfs_tree_root *root,
+                      bool shared)
+{
+	uint64_t height = tree_root_height(root);
+	uint64_t max_nblocks;
+
+	if (tree_root_addr(root) == BPFS_BLOCKNO_INVALID)
+		return true;
+	if (!height || !root->nbytes)
+		return fsck_block(ino, tree_root_addr(root), shared);
+	max_nblocks = tree_max_nblocks(height);
+	return fsck_indir(ino, tree_root_addr(root), height, max_nblocks,
+	                  MIN(root->nbytes, max_nblocks * BPFS_BLOCK_SIZE),
+	                  shared);
+}
+
+static void fsck_dirent(uint64_t parent_ino, const struct bpfs_dirent *dirent)
+{
+	const struct bpfs_inode *inode;
+
+	static_assert(BPFS_INO_INVALID == 0);
+	if (dirent->ino - 1 >= inode_alloc.bitmap.ntotal
+	    || !fsck_test(inode_alloc.bitmap.bitmap, dirent->ino - 1))
+	{
+		fsck_report("directory %" PRIu64 ": \"%s\" names free inode %"
+		            PRIu64, parent_ino, dirent->name, dirent->ino);
+		return;
+	}
+	fsck_reach_inode(dirent->ino);
+
+	inode = get_inode(dirent->ino);
+	if (dirent->file_type < BPFS_TYPE_FILE
+	    || dirent->file_type > BPFS_TYPE_SYMLINK
+	    || b2f_filetype(dirent->file_type) != (inode->mode & BPFS_S_IFMT))
+		fsck_report("directory %" PRIu64 ": \"%s\" has type %u but inode %"
+		            PRIu64 " has mode %o", parent_ino, dirent->name,
+		            dirent->file_type, dirent->ino, inode->mode);
+}
+
+static int callback_fsck_dirents(uint64_t blockoff, char *block,
+                                 unsigned off, unsigned size,
+                                 unsigned valid, uint64_t crawl_start,
+                                 enum commit commit, void *pino_void,
+                                 uint64_t *blockno)
+{
+	uint64_t ino = *(uint64_t*) pino_void;
+	const unsigned end = off + size;
+
+	while (off + BPFS_DIRENT_MIN_LEN <= end)
+	{
+		struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+		if (!dirent->rec_len)
+			break;
+		if (dirent->rec_len % BPFS_DIRENT_ALIGN
+		    || dirent->rec_len < BPFS_DIRENT_LEN(dirent->name_len)
+		    || off + dirent->rec_len > end)
+		{
+			fsck_report("directory %" PRIu64 ": dirent at %" PRIu64
+			            " has length %u", ino,
+			            blockoff * BPFS_BLOCK_SIZE + off, dirent->rec_len);
+			break;
+		}
+		off += dirent->rec_len;
+
+		if (dirent->ino == BPFS_INO_INVALID)
+			continue;
+		if (dirent->name_len < 2 || dirent->name[dirent->name_len - 1])
+		{
+			fsck_report("directory %" PRIu64 ": dirent at %" PRIu64
+			            " has a bad name", ino,
+			            blockoff * BPFS_BLOCK_SIZE + off - dirent->rec_len);
+			continue;
+		}
+		fsck_dirent(ino, dirent);
+	}
+	return 0;
+}
+
+static void fsck_inode(uint64_t ino)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+	bool is_dir = BPFS_S_ISDIR(inode->mode);
+
+	if (inode->nlinks < (is_dir ? 2 : 1))
+		fsck_report("inode %" PRIu64 ": %u links", ino, inode->nlinks);
+
+	if (!fsck_tree(ino, &inode->root, false) || !is_dir)
+		return;
+	if (!inode->root.nbytes || inode->root.nbytes % BPFS_BLOCK_SIZE)
+	{
+		fsck_report("directory %" PRIu64 ": size %" PRIu64, ino,
+		            inode->root.nbytes);
+		return;
+	}
+	xcall(crawl_data(ino, 0, BPFS_EOF, COMMIT_NONE,
+	                 callback_fsck_dirents, &ino));
+}
+
+// Start a pass. Return -ENOMEM if the inodes have outgrown fsck.reached
+// and it cannot grow.
+static int fsck_begin_pass(void)
+{
+	struct bpfs_tree_root *inode_root = get_inode_root();
+	uint64_t blockno;
+	char *reached;
+
+	reached = realloc(fsck.reached, inode_alloc.bitmap.ntotal / 8);
+	if (!reached)
+		return -ENOMEM;
+	fsck.reached = reached;
+	fsck.ninodes = inode_alloc.bitmap.ntotal;
+	memset(fsck.reached, 0, fsck.ninodes / 8);
+	memset(fsck.walked, 0, block_alloc.bitmap.ntotal / 8);
+	memset(fsck.fresh, 0, block_alloc.bitmap.ntotal / 8);
+	fsck_reach_inode(BPFS_INO_ROOT);
+	fsck.nerrors = 0;
+
+	static_assert(BPFS_BLOCKNO_INVALID == 0);
+	for (blockno = 1; blockno < BPFS_BLOCKNO_FIRST_ALLOC; blockno++)
+		fsck_set(fsck.walked, blockno - 1);
+	fsck_block(BPFS_INO_INVALID, bpfs_super->inode_root_addr, false);
+
+	if (NBLOCKS_FOR_NBYTES(inode_root->nbytes) * BPFS_INODES_PER_BLOCK
+	    != inode_alloc.bitmap.ntotal)
+		fsck_report("the inode file has %" PRIu64 " bytes but %" PRIu64
+		            " inodes", inode_root->nbytes, inode_alloc.bitmap.ntotal);
+	fsck_tree(BPFS_INO_INVALID, inode_root, false);
+	return 0;
+}
+
+static void fsck_end_pass(void)
+{
+	fsck.npasses++;
+	fsck.nerrors_total += fsck.nerrors;
+	BPFS_PROBE(fsck_pass, fsck.npasses, fsck.nerrors);
+	if (fsck.nerrors)
+		fprintf(stderr, "bpfs fsck: pass %" PRIu64 " found %" PRIu64
+		        " inconsistencies\n", fsck.npasses, fsck.nerrors);
+	else
+		Dprintf("fsck pass %" PRIu64 " passed\n", fsck.npasses);
+}
+
+static void fsck_destroy(void);
+
+// Check the next piece of the file system
+static void fsck_step(void)
+{
+	uint64_t end;
+
+	fsck.nchecked = 0;
+	switch (fsck.phase)
+	{
+		case FSCK_BEGIN:
+			if (fsck_begin_pass() < 0)
+			{
+				fprintf(stderr, "bpfs fsck: out of memory for %" PRIu64
+				        " inodes; disabling fsck\n",
+				        inode_alloc.bitmap.ntotal);
+				fsck_destroy();
+				break;
+			}
+			fsck.phase = FSCK_INODES;
+			fsck.next = 0;
+			break;
+
+		case FSCK_INODES:
+			while (fsck.nchecked < FSCK_STEP_NBLOCKS
+			       && fsck.next < inode_alloc.bitmap.ntotal)
+			{
+				uint64_t ino = ++fsck.next;
+				static_assert(BPFS_INO_INVALID == 0);
+				if (fsck_test(inode_alloc.bitmap.bitmap, ino - 1)
+				    && !is_orphan(ino))
+					fsck_inode(ino);
+			}
+			if (fsck.next >= inode_alloc.bitmap.ntotal)
+				fsck.phase = FSCK_ORPHANS;
+			break;
+
+		case FSCK_ORPHANS:
+		{
+			size_t i;
+			// All at once: reclaiming an orphan moves the others
+			for (i = 0; i < vector_size(orphans); i++)
+			{
+				struct orphan *orphan = vector_elt(orphans, i);
+				fsck_reach_inode(orphan->ino);
+				fsck_tree(orphan->ino, &orphan->root, true);
+			}
+			fsck.phase = FSCK_BLOCK_LEAKS;
+			fsck.next = 0;
+			break;
+		}
+
+		case FSCK_BLOCK_LEAKS:
+			end = MIN(fsck.next + FSCK_STEP_NBITS, block_alloc.bitmap.ntotal);
+			for (; fsck.next < end; fsck.next += sizeof(bitmap_scan_t) * 8)
+			{
+				uint64_t i = fsck.next / 8;
+				bitmap_scan_t leaked =
+					*(bitmap_scan_t*) (block_alloc.bitmap.bitmap + i)
+					& ~*(bitmap_scan_t*) (fsck.walked + i)
+					& ~*(bitmap_scan_t*) (fsck.fresh + i);
+				int j;
+				for (j = 0; leaked && j < sizeof(leaked) * 8; j++)
+					if (leaked & (((bitmap_scan_t) 1) << j))
+						fsck_report("block %" PRIu64 " is allocated but in"
+						            " no tree", fsck.next + j + 1);
+			}
+			if (fsck.next >= block_alloc.bitmap.ntotal)
+			{
+				fsck.phase = FSCK_INODE_LEAKS;
+				fsck.next = 0;
+			}
+			break;
+
+		case FSCK_INODE_LEAKS:
+			end = MIN(fsck.next + FSCK_STEP_NBITS,
+			          MIN(fsck.ninodes, inode_alloc.bitmap.ntotal));
+			for (; fsck.next < end; fsck.next++)
+				if (fsck_test(inode_alloc.bitmap.bitmap, fsck.next)
+				    && !fsck_test(fsck.reached, fsck.next)
+				    && !is_orphan(fsck.next + 1))
+					fsck_report("inode %" PRIu64 " is allocated but in no"
+					            " directory", fsck.next + 1);
+			if (fsck.next >= MIN(fsck.ninodes, inode_alloc.bitmap.ntotal))
+			{
+				fsck_end_pass();
+				fsck.phase = FSCK_BEGIN;
+			}
+			break;
+	}
+}
+
+static uint64_t fsck_now(void)
+{
+	struct timespec ts;
+	xsyscall(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Take a step if the budget allows. Call only with nothing to commit.
+static void fsck_maybe_step(void)
+{
+	uint64_t latency_start;
+	uint64_t start, end;
+
+	if (!fsck.budget)
+		return;
+	start = fsck_now();
+	if (start < fsck.next_step)
+		return;
+
+	latency_start = LATENCY_BEGIN(BPFS_LATENCY_FSCK);
+	fsck_step();
+	LATENCY_END(BPFS_LATENCY_FSCK, latency_start);
+	if (!fsck.budget)
+		return; // fsck_step() disabled fsck
+
+	// Wait until this step is budget percent of the time since it began
+	end = fsck_now();
+	fsck.next_step = end + (end - start) * (100 - fsck.budget) / fsck.budget;
+}
+
+static int fsck_init(unsigned budget)
+{
+	memset(&fsck, 0, sizeof(fsck));
+	fsck.budget = MIN(budget, 100);
+	if (!fsck.budget)
+		return 0;
+	fsck.walked = calloc(block_alloc.bitmap.ntotal / 8, 1);
+	fsck.fresh = calloc(block_alloc.bitmap.ntotal / 8, 1);
+	if (!fsck.walked || !fsck.fresh)
+	{
+		free(fsck.walked);
+		free(fsck.fresh);
+		fsck.walked = fsck.fresh = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void fsck_destroy(void)
+{
+	if (fsck.budget)
+		printf("fsck: %" PRIu64 " passes, %" PRIu64 " inconsistencies\n",
+		       fsck.npasses, fsck.nerrors_total);
+	free(fsck.walked);
+	free(fsck.fresh);
+	free(fsck.reached);
+	memset(&fsck, 0, sizeof(fsck));
+}
+
+
+//
+// commit, abort, and recover
+
+static int recover_superblock(void)
+{
+	struct bpfs_super *super_2 = bpfs_super + 1;
+
+	if (bpfs_super->commit_mode != super_2->commit_mode)
+		return -1;
+
+	if (bpfs_super->commit_mode == BPFS_COMMIT_SCSP)
+		return 0;
+
+	if (bpfs_super->commit_mode != BPFS_COMMIT_SP)
+		return -1;
+
+	if (super_2->magic != BPFS_FS_MAGIC)
+	{
+		fprintf(stderr, "Not a BPFS file system in SP mode (incorrect magic)\n");
+		return -1;
+	}
+
+	if (bpfs_super->inode_root_addr == bpfs_super->inode_root_addr_2)
+	{
+		if (super_2->inode_root_addr != super_2->inode_root_addr_2)
+			BPRAM_STORE(*super_2, *bpfs_super);
+	}
+	else if (super_2->inode_root_addr == super_2->inode_root_addr_2)
+		BPRAM_STORE(*bpfs_super, *super_2);
+	else
+		return -2;
+	return 0;
+}
+
+#if COMMIT_MODE == MODE_SP
+static struct bpfs_super *persistent_super;
+static struct bpfs_super staged_super;
+
+static void revert_superblock(void)
+{
+	assert(bpfs_super == &staged_super);
+
+	staged_super.inode_root_addr = persistent_super->inode_root_addr;
+
+	assert(!memcmp(persistent_super, &staged_super, sizeof(staged_super)));
+}
+
+static void persist_superblock(void)
+{
+# ifndef NDEBUG
+	static bool first_run = 1;
+# endif
+	struct bpfs_super *persistent_super_2 = persistent_super + 1;
+
+	assert(bpfs_super == &staged_super);
+
+	if (!memcmp(persistent_super, &staged_super, sizeof(staged_super)))
+		return; // update unnecessary
+
+# if DETECT_NONCOW_WRITES_SP
+	{
+		size_t len = BPFS_BLOCK_SIZE * 2; /* two super blocks */
+		static_assert(BPFS_BLOCKNO_INVALID == 0
+		              && BPFS_BLOCKNO_SUPER == 1 && BPFS_BLOCKNO_SUPER_2 == 2);
+		xsyscall(mprotect(bpram, len, PROT_READ | PROT_WRITE));
+	}
+# endif
+
+# ifndef NDEBUG
+	// Only compare supers after super2 has been created
+	if (first_run)
+		first_run = 0;
+	else
+		assert(!memcmp(persistent_super, persistent_super_2,
+		       sizeof(staged_super)));
+# endif
+
+	staged_super.inode_root_addr_2 = staged_super.inode_root_addr;
+
+	// persist the inode_root_addr{,_2} fields, but do so by copying
+	// all because !SCSP and to copy the ephemeral_valid field:
+	BPRAM_MEMCPY(persistent_super, &staged_super, sizeof(staged_super));
+	epoch_barrier(); // keep at least one SB consistent during each update
+	BPRAM_MEMCPY(persistent_super_2, &staged_super, sizeof(staged_super));
+	STATS_ADD(bpram_bytes, 2 * sizeof(staged_super));
+	STATS_ADD(super_commits, 1);
+
+# if DETECT_NONCOW_WRITES_SP
+	{
+		size_t len = BPFS_BLOCK_SIZE * 2; /* two super blocks */
+		static_assert(BPFS_BLOCKNO_INVALID == 0
+		              && BPFS_BLOCKNO_SUPER == 1 && BPFS_BLOCKNO_SUPER_2 == 2);
+		xsyscall(mprotect(bpram, len, PROT_READ));
+	}
+# endif
+}
+#elif COMMIT_MODE == MODE_SCSP
+static void reset_indirect_cow_superblock(void)
+{
+	uint64_t new_blockno;
+
+	assert(!indirect_cow_block_get(BPFS_BLOCKNO_SUPER));
+	new_blockno = cow_block_entire(BPFS_BLOCKNO_SUPER);
+	xassert(new_blockno != BPFS_BLOCKNO_INVALID);
+
+	set_super((struct bpfs_super*) get_block(new_blockno));
+}
+
+static void revert_superblock(void)
+{
+#if DETECT_NONCOW_WRITES_SCSP
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ));
+#endif
+	indirect_cow_abort();
+}
+
+static void persist_superblock(void)
+{
+#if DETECT_NONCOW_WRITES_SCSP
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ | PROT_WRITE));
+#endif
+	indirect_cow_commit();
+#if DETECT_NONCOW_WRITES_SCSP
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ));
+#endif
+}
+#endif
+
+#if !DETECT_ALLOCATION_DIFFS
+static void detect_allocation_diffs(void)
+{
+}
+#else
+static void print_bitmap_differences(const char *name,
+                                     const char *orig_bitmap,
+                                     const char *disc_bitmap,
+                                     size_t size)
+{
+	size_t i;
+	printf("%s bitmap differences (-1):", name);
+	for (i = 0; i < size; i++)
+	{
+		bool orig = !!(orig_bitmap[i / 8] & (1 << i % 8));
+		bool disc = !!(disc_bitmap[i / 8] & (1 << i % 8));
+		if (orig != disc)
+			printf(" %zu[%d]", i, disc);
+	}
+	printf("\n");
+}
+
+static void detect_allocation_diffs(void)
+{
+	char *orig_block_bitmap;
+	char *orig_inode_bitmap;
+	uint64_t orig_block_ntotal;
+	uint64_t orig_inode_ntotal;
+	bool diff = false;
+
+	/* non-NULL would complicate destory+init+compare */
+	assert(!block_alloc.bitmap.allocs);
+	assert(!block_alloc.bitmap.frees);
+	assert(!inode_alloc.bitmap.allocs);
+	assert(!inode_alloc.bitmap.frees);
+
+	orig_block_bitmap = malloc(block_alloc.bitmap.ntotal / 8);
+	xassert(orig_block_bitmap);
+	memcpy(orig_block_bitmap, block_alloc.bitmap.bitmap,
+	       block_alloc.bitmap.ntotal / 8);
+	orig_block_ntotal = block_alloc.bitmap.ntotal;
+
+	orig_inode_bitmap = malloc(inode_alloc.bitmap.ntotal / 8);
+	xassert(orig_inode_bitmap);
+	memcpy(orig_inode_bitmap, inode_alloc.bitmap.bitmap,
+	       inode_alloc.bitmap.ntotal / 8);
+	orig_inode_ntotal = inode_alloc.bitmap.ntotal;
+
+	destroy_allocations();
+	init_allocations(false);
+
+	assert(orig_block_ntotal == block_alloc.bitmap.ntotal);
+	if (memcmp(orig_block_bitmap, block_alloc.bitmap.bitmap,
+	           block_alloc.bitmap.ntotal / 8))
+	{
+		diff = true;
+		print_bitmap_differences("block",
+		                         orig_block_bitmap, block_alloc.bitmap.bitmap,
+		                         block_alloc.bitmap.ntotal);
+	}
+
+	assert(orig_inode_ntotal == inode_alloc.bitmap.ntotal);
+	if (memcmp(orig_inode_bitmap, inode_alloc.bitmap.bitmap,
+	           inode_alloc.bitmap.ntotal / 8))
+	{
+		diff = true;
+		print_bitmap_differences("inodes",
+		                         orig_inode_bitmap, inode_alloc.bitmap.bitmap,
+		                         inode_alloc.bitmap.ntotal);
+	}
+
+	assert(!diff);
+
+	free(orig_block_bitmap);
+	free(orig_inode_bitmap);
+}
+#endif
+
+static void abort_transaction(void)
+{
+#if COMMIT_MODE != MODE_BPFS
+	revert_superblock();
+#endif
+
+	abort_blocks();
+	abort_inodes();
+	abort_orphans();
+
+	detect_allocation_diffs();
+
+#if INDIRECT_COW
+	reset_indirect_cow_superblock();
+#endif
+}
+
+static void commit_transaction(void)
+{
+	uint64_t latency_start = LATENCY_BEGIN(BPFS_LATENCY_COMMIT);
+
+#if COMMIT_MODE != MODE_BPFS
+	persist_superblock();
+#endif
+
+	commit_blocks();
+	commit_inodes();
+	commit_orphans();
+
+	detect_allocation_diffs();
+
+#if COMMIT_MODE == MODE_SCSP
+	reset_indirect_cow_superblock();
+#endif
+
+	NVM_PERSIST();
+	LATENCY_END(BPFS_LATENCY_COMMIT, latency_start);
+}
+
+
+static int callback_load_directory(uint64_t blockoff, char *block,
+                                   unsigned off, unsigned size, unsigned valid,
+                                   uint64_t crawl_start, enum commit commit,
+                                   void *p_pi_void, uint64_t *blockno)
+{
+	uint64_t parent_ino = *(uint64_t*) p_pi_void;
+	const unsigned end = off + size;
+	while (off + BPFS_DIRENT_MIN_LEN <= end)
+	{
+		struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+		struct mdirent mdirent;
+		int r;
+
+		assert(!(off % BPFS_DIRENT_ALIGN));
+
+		if (!dirent->rec_len)
+		{
+			// end of directory entries in this block
+			r = dcache_add_free(parent_ino, blockoff * BPFS_BLOCK_SIZE + off,
+			                    BPFS_BLOCK_SIZE - off);
+			if (r < 0)
+				return r;
+			break;
+		}
+		off += dirent->rec_len;
+		assert(off <= BPFS_BLOCK_SIZE);
+		if (dirent->ino == BPFS_INO_INVALID)
+			continue;
+		assert(dirent->rec_len >= BPFS_DIRENT_LEN(dirent->name_len));
+
+		// Defer reading the dirent's inode until a lookup needs it
+		mdirent_init(&mdirent, dirent->name,
+		             blockoff * BPFS_BLOCK_SIZE + off - dirent->rec_len,
+		             dirent->ino, MDIRENT_GENERATION_UNKNOWN,
+		             dirent->rec_len, dirent->file_type);
+
+		r = dcache_add_dirent(parent_ino, dirent->name, &mdirent);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int find_dirent(uint64_t parent_ino, const char *name,
+                       const struct mdirent **pmd)
+{
+	const struct mdirent *md;
+	bool loaded = false;
+
+	if (!dcache_has_dir(parent_ino))
+	{
+		int r;
+		loaded = true;
+		r = dcache_add_dir(parent_ino);
+		if (r < 0)
+			return r;
+		r = crawl_data(parent_ino, 0, BPFS_EOF, COMMIT_NONE,
+		               callback_load_directory, &parent_ino);
+		if (r < 0)
+		{
+			dcache_rem_dir(parent_ino);
+			return r;
+		}
+	}
+
+	md = dcache_get_dirent(parent_ino, name);
+	BPFS_PROBE(find_dirent, parent_ino, name, md ? md->ino : BPFS_INO_INVALID,
+	           loaded);
+	if (!md)
+		return -ENOENT;
+	if (pmd)
+		*pmd = md;
+	return 0;
+}
+
+static int callback_get_dirent(uint64_t blockoff, char *block,
+                               unsigned off, unsigned size, unsigned valid,
+                               uint64_t crawl_start, enum commit commit,
+                               void *dirent_void, uint64_t *blockno)
+{
+	struct bpfs_dirent **dirent = (struct bpfs_dirent**) dirent_void;
+	*dirent = (struct bpfs_dirent*) (block + off);
+	assert(off + (*dirent)->rec_len <= valid);
+	return 0;
+}
+
+static struct bpfs_dirent* get_dirent(uint64_t parent_ino, uint64_t dirent_off)
+{
+	struct bpfs_dirent *dirent;
+	int r;
+
+	assert(get_inode(parent_ino));
+	assert(get_inode(parent_ino)->nlinks);
+	assert(dirent_off + BPFS_DIRENT_MIN_LEN <= get_inode(parent_ino)->root.nbytes);
+
+	r = crawl_data(parent_ino, dirent_off, 1, COMMIT_NONE,
+	               callback_get_dirent, &dirent);
+	if (r < 0)
+		return NULL;
+	return dirent;
+}
+
+#if !INDIRECT_COW
+// Copy [begin, end) of old to new, except for [skip_begin, skip_end)
+static void copy_range_skip(char *new, const char *old,
+                            unsigned begin, unsigned end,
+                            unsigned skip_begin, unsigned skip_end)
+{
+	if (begin < skip_begin)
+	{
+		unsigned n = MIN(end, skip_begin) - begin;
+		BPRAM_MEMCPY(new + begin, old + begin, n);
+		STATS_ADD(cow_bytes, n);
+		STATS_BPRAM_COPY(new + begin, n);
+	}
+	if (skip_end < end)
+	{
+		unsigned b = MAX(begin, skip_end);
+		BPRAM_MEMCPY(new + b, old + b, end - b);
+		STATS_ADD(cow_bytes, end - b);
+		STATS_BPRAM_COPY(new + b, end - b);
+	}
+}
+#endif
+
+// CoW a directory block, copying only each dirent's header and name.
+// The caller overwrites [off, off + size) and sets whether the dirent at off
+// will be in use. Other dirents keep their names even if free, because
+// a dirent being added may not have its ino set yet.
+static uint64_t cow_dirent_block(uint64_t old_blockno,
+                                 unsigned off, unsigned size, bool off_used)
+{
+#if INDIRECT_COW
+	// A DRAM copy is cheaper than tracking what is left uncopied
+	assert(off + size <= BPFS_BLOCK_SIZE);
+	return cow_block_entire(old_blockno);
+#else
+	const unsigned end = off + size;
+	uint64_t new_blockno;
+	const char *old_block;
+	char *new_block;
+	unsigned doff;
+
+	assert(end <= BPFS_BLOCK_SIZE);
+
+# if COMMIT_MODE != MODE_BPFS
+	if (block_freshly_alloced(old_blockno))
+		return old_blockno;
+# endif
+
+	new_blockno = cow_block_alloc(old_blockno);
+	if (new_blockno == BPFS_BLOCKNO_INVALID)
+		return BPFS_BLOCKNO_INVALID;
+
+	old_block = get_block(old_blockno);
+	new_block = get_block(new_blockno);
+	for (doff = 0; doff + BPFS_DIRENT_MIN_LEN <= BPFS_BLOCK_SIZE;)
+	{
+		const struct bpfs_dirent *dirent
+			= (const struct bpfs_dirent*) (old_block + doff);
+		unsigned len = sizeof(*dirent);
+
+		// The name of the block's end marker is garbage
+		if (dirent->rec_len && (doff != off || off_used))
+			len = MIN(len + dirent->name_len, dirent->rec_len);
+		copy_range_skip(new_block, old_block, doff, doff + len, off, end);
+
+		if (!dirent->rec_len)
+			break;
+		doff += dirent->rec_len;
+	}
+	STATS_ADD(cow_blocks, 1);
+	free_block(old_blockno);
+	return new_blockno;
+#endif
+}
+
+struct sd_ino
+{
+	uint64_t parent_ino;
+	struct str_dirent *sd;
+};
+
+static int callback_dirent_plug(uint64_t blockoff, char *block,
+                                unsigned off, unsigned size,  unsigned valid,
+                                uint64_t crawl_start, enum commit commit,
+                                void *si_void, uint64_t *blockno)
+{
+	struct sd_ino *si = (struct sd_ino*) si_void;
+	struct str_dirent *sd = si->sd;
+	struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+	const uint64_t min_hole_size = BPFS_DIRENT_LEN(sd->str.len);
+	const uint16_t rec_len = dirent->rec_len;
+#ifndef NDEBUG
+	const unsigned end = off + size;
+#endif
+
+	assert(commit != COMMIT_NONE);
+	assert(!(off % BPFS_DIRENT_ALIGN));
+	assert(off + min_hole_size <= end);
+	assert(!dirent->rec_len || dirent->rec_len >= min_hole_size);
+	assert(off + dirent->rec_len <= BPFS_BLOCK_SIZE);
+	assert(BPFS_BLOCK_SIZE - off >= min_hole_size);
+	// Not necessarily true for a dirent's first use:
+	// assert(dirent->ino == BPFS_INO_INVALID);
+
+	if (commit == COMMIT_COPY)
+	{
+		// This callback and its caller write all of [off, min_hole_size)
+		uint64_t new_blockno = cow_dirent_block(*blockno, off, min_hole_size,
+		                                        true);
+		assert(COMMIT_COPY == COMMIT_ATOMIC);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+		dirent = (struct bpfs_dirent*) (block + off);
+		*blockno = new_blockno;
+		BPRAM_STORE(dirent->rec_len, rec_len);
+	}
+
+	// TODO: set file_type here
+	if (!rec_len)
+	{
+		if (off + min_hole_size + BPFS_DIRENT_MIN_LEN <= BPFS_BLOCK_SIZE)
+		{
+			unsigned next_off = off + min_hole_size;
+			struct bpfs_dirent *next_dirent
+				= (struct bpfs_dirent*) (block + next_off);
+			int r;
+			BPRAM_STORE(next_dirent->rec_len, 0);
+			r = dcache_add_free(si->parent_ino,
+			                    blockoff * BPFS_BLOCK_SIZE + next_off,
+			                    BPFS_BLOCK_SIZE - next_off);
+			xassert(!r); // FIXME: recover from OOM
+		}
+		BPRAM_STORE(dirent->rec_len, min_hole_size);
+	}
+	BPRAM_STORE(dirent->name_len, sd->str.len);
+	BPRAM_MEMCPY(dirent->name, sd->str.str, sd->str.len);
+	STATS_BPRAM_COPY(dirent->name, sd->str.len);
+	sd->dirent_off = blockoff * BPFS_BLOCK_SIZE + off;
+	sd->dirent = dirent;
+	return 1;
+}
+
+static int callback_dirent_append(uint64_t blockoff, char *block,
+                                  unsigned off, unsigned size,  unsigned valid,
+                                  uint64_t crawl_start, enum commit commit,
+                                  void *si_void, uint64_t *blockno)
+{
+	struct sd_ino *si = (struct sd_ino*) si_void;
+	struct str_dirent *sd = si->sd;
+	uint64_t hole_size = BPFS_DIRENT_LEN(sd->str.len);
+
+	assert(!off && size == BPFS_BLOCK_SIZE);
+	assert(crawl_start == blockoff * BPFS_BLOCK_SIZE);
+	assert(!valid);
+	assert(commit != COMMIT_NONE);
+	assert(commit == COMMIT_FREE);
+
+	sd->dirent_off = blockoff * BPFS_BLOCK_SIZE;
+	sd->dirent = (struct bpfs_dirent*) block;
+
+	if (hole_size + BPFS_DIRENT_MIN_LEN <= BPFS_BLOCK_SIZE)
+	{
+		struct bpfs_dirent *next_dirent = (struct bpfs_dirent*) (block + hole_size);
+		int r;
+		BPRAM_STORE(next_dirent->rec_len, 0);
+		r = dcache_add_free(si->parent_ino,
+		                    blockoff * BPFS_BLOCK_SIZE + hole_size,
+		                    BPFS_BLOCK_SIZE - hole_size);
+		if (r < 0)
+			return r;
+	}
+	BPRAM_STORE(sd->dirent->rec_len, hole_size);
+
+	BPRAM_STORE(sd->dirent->name_len, sd->str.len);
+	BPRAM_MEMCPY(sd->dirent->name, sd->str.str, sd->str.len);
+	STATS_BPRAM_COPY(sd->dirent->name, sd->str.len);
+	// TODO: set file_type here
+
+	return 0;
+}
+
+static int alloc_dirent(uint64_t parent_ino, struct str_dirent *sd)
+{
+	struct sd_ino si = { .parent_ino = parent_ino, .sd = sd };
+	uint64_t off;
+	int r;
+
+	off = dcache_take_free(parent_ino, BPFS_DIRENT_LEN(sd->str.len));
+	if (off != DCACHE_FREE_NONE)
+	{
+		r = crawl_data(parent_ino, off,
+		               BPFS_BLOCK_SIZE - (off % BPFS_BLOCK_SIZE),
+		               COMMIT_ATOMIC, callback_dirent_plug, &si);
+		if (r < 0)
+		{
+			// FIXME: need to dcache_add_free(parent_ino, off, ?);
+			xassert(0);
+			return r;
+		}
+		assert(r == 1);
+	}
+	else
+	{
+		r = crawl_data(parent_ino, BPFS_EOF, BPFS_BLOCK_SIZE,
+		               COMMIT_ATOMIC, callback_dirent_append, &si);
+		if (r < 0)
+			return r;
+	}
+	assert(sd->dirent_off != BPFS_EOF && sd->dirent);
+
+	// Caller sets dirent->ino and dirent->file_type
+	return 0;
+}
+
+static int callback_set_dirent_ino(uint64_t blockoff, char *block,
+                                   unsigned off, unsigned size, unsigned valid,
+                                   uint64_t crawl_start, enum commit commit,
+                                   void *ino_void, uint64_t *blockno)
+{
+	uint64_t ino = *(uint64_t*) ino_void;
+	struct bpfs_dirent *dirent;
+
+	assert(commit != COMMIT_NONE);
+	assert(!(off % BPFS_DIRENT_ALIGN));
+
+	if (commit == COMMIT_COPY)
+	{
+		uint64_t new_blockno = cow_dirent_block(*blockno, off, sizeof(ino),
+		                                        ino != BPFS_INO_INVALID);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+		*blockno = new_blockno;
+	}
+	dirent = (struct bpfs_dirent*) (block + off);
+
+	BPRAM_STORE(dirent->ino, ino);
+
+	return 0;
+}
+
+static int callback_clear_dirent_ino(uint64_t blockoff, char *block,
+                                     unsigned off, unsigned size, unsigned valid,
+                                     uint64_t crawl_start, enum commit commit,
+                                     void *ino_void, uint64_t *blockno)
+{
+	uint64_t *ino = (uint64_t*) ino_void;
+	struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+
+	assert(commit != COMMIT_NONE);
+	assert(!(off % BPFS_DIRENT_ALIGN));
+
+	*ino = dirent->ino;
+	if (commit == COMMIT_COPY)
+	{
+		uint64_t new_blockno = cow_dirent_block(*blockno, off, sizeof(*ino),
+		                                        false);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+		*blockno = new_blockno;
+	}
+	dirent = (struct bpfs_dirent*) (block + off);
+
+	BPRAM_STORE(dirent->ino, BPFS_INO_INVALID);
+
+	return 0;
+}
+
+struct callback_addrem_dirent_data {
+	bool add; /* true for add, false for remove */
+	uint64_t dirent_off;
+	uint64_t ino; /* input for add, output for rem */
+	bool dir;
+};
+
+static int callback_addrem_dirent(char *block, unsigned off,
+                                  struct bpfs_inode *inode, enum commit commit,
+                                  void *cadd_void, uint64_t *blockno)
+{
+	struct callback_addrem_dirent_data *cadd = (struct callback_addrem_dirent_data*) cadd_void;
+	uint64_t new_blockno = *blockno;
+	crawl_callback dirent_callback;
+	int r;
+
+	assert(commit != COMMIT_NONE);
+
+	if (cadd->dir && cadd->add && !(inode->nlinks + 1))
+		return -EMLINK;
+
+	// TODO: why does this write 4 fewer bytes for SCSP than when it is
+	// placed after crawl_tree() and the cow also guarded by same block?
+	if (cadd->dir)
+	{
+		if (commit == COMMIT_COPY)
+		{
+			new_blockno = cow_block_entire(*blockno);
+			if (new_blockno == BPFS_BLOCKNO_INVALID)
+				return -ENOSPC;
+			indirect_cow_block_required(new_blockno);
+			block = get_block(new_blockno);
+		}
+		inode = (struct bpfs_inode*) (block + off);
+
+		if (cadd->add)
+			BPRAM_STORE(inode->nlinks, inode->nlinks + 1);
+		else
+			BPRAM_STORE(inode->nlinks, inode->nlinks - 1);
+		assert(inode->nlinks >= 2);
+	}
+
+	dirent_callback = cadd->add ? callback_set_dirent_ino : callback_clear_dirent_ino;
+	r = crawl_tree(&inode->root, cadd->dirent_off, 1,
+	               commit, dirent_callback, &cadd->ino, &new_blockno);
+	if (r < 0)
+		return r;
+#if COMMIT_MODE == MODE_BPFS
+	assert(*blockno == new_blockno);
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+struct callback_init_inode_data {
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	uint64_t generation;
+};
+
+static int callback_init_inode(char *block, unsigned off,
+                               struct bpfs_inode *inode, enum commit commit,
+                               void *ciid_void, uint64_t *blockno)
+{
+	struct callback_init_inode_data *ciid = (struct callback_init_inode_data*) ciid_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+	inode = (struct bpfs_inode*) (block + off);
+
+	assert(ciid->generation > inode->generation);
+	BPRAM_STORE(inode->generation, ciid->generation);
+	assert(inode->generation); // not allowed to repeat within a mount
+	BPRAM_STORE(inode->mode, f2b_mode(ciid->mode));
+	BPRAM_STORE(inode->uid, ciid->uid);
+	BPRAM_STORE(inode->gid, ciid->gid);
+#if DETECT_ZEROLINKS_WITH_LINKS
+	assert(!inode->nlinks);
+#endif
+	// inode->nlinks = 1; // set by caller
+	BPRAM_STORE(inode->flags, 0);
+	// ha_set(&inode->root.ha, 0, BPFS_BLOCKNO_INVALID); // set by caller
+	// inode->root.nbytes = 0; // set by caller
+	BPRAM_STORE(inode->size, 0);
+	BPRAM_STORE(inode->atime, BPFS_TIME_NOW());
+	BPRAM_STORE(inode->ctime, inode->atime);
+	BPRAM_STORE(inode->mtime, inode->atime);
+
+	// NOTE: inode->pad is uninitialized.
+	// A format ugprade can zero needed fields before bumping the version.
+	//memset(inode->pad, 0, sizeof(inode->pad));
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+static int callback_set_cmtime(char *block, unsigned off,
+                               struct bpfs_inode *inode, enum commit commit,
+                               void *new_time_void, uint64_t *blockno)
+{
+	struct bpfs_time *new_time = (struct bpfs_time*) new_time_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+#if !SCSP_OPT_TIME
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+#endif
+	inode = (struct bpfs_inode*) (block + off);
+
+	BPRAM_STORE(inode->mtime, *new_time);
+	BPRAM_STORE(inode->ctime, *new_time);
+#if SCSP_OPT_TIME
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->mtime),
+	                          sizeof(inode->mtime));
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->ctime),
+	                          sizeof(inode->ctime));
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+
+//
+// frontend notification
+
+static struct bpfs_notify notify;
+
+void bpfs_set_notify(const struct bpfs_notify *n)
+{
+	if (n)
+		notify = *n;
+	else
+		memset(&notify, 0, sizeof(notify));
+}
+
+static void notify_inval_inode(uint64_t ino, int64_t off, int64_t len)
+{
+	if (notify.inval_inode)
+		notify.inval_inode(ino, off, len);
+}
+
+static void notify_inval_entry(uint64_t parent_ino, const char *name,
+                               bool rolled_back)
+{
+	if (notify.inval_entry)
+		notify.inval_entry(parent_ino, name, rolled_back);
+}
+
+#if COMMIT_MODE != MODE_BPFS
+static void notify_group_end(unsigned nops, int error)
+{
+	if (notify.group_end)
+		notify.group_end(nops, error);
+}
+#endif
+
+static int create_file(uint64_t parent_ino, const char *name, mode_t mode,
+                       uid_t uid, gid_t gid, const char *link,
+                       struct bpfs_dirent **pdirent)
+{
+	uint64_t ino;
+	size_t name_len = strlen(name) + 1;
+	struct str_dirent sd = {{name, name_len}, BPFS_EOF, NULL};
+	struct callback_init_inode_data ciid = {mode, uid, gid, 0};
+	struct callback_addrem_dirent_data cadd = {true, 0, BPFS_INO_INVALID, S_ISDIR(mode)};
+	struct bpfs_inode *inode;
+	struct mdirent mdirent;
+	int r;
+
+	assert(!!link == !!S_ISLNK(mode));
+
+	if (name_len > BPFS_DIRENT_MAX_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	if (!get_inode(parent_ino))
+		return -ENOENT;
+	assert(get_inode(parent_ino)->nlinks >= 2);
+	assert(BPFS_S_ISDIR(get_inode(parent_ino)->mode));
+
+	if (!find_dirent(parent_ino, name, NULL))
+		return -EEXIST;
+
+	// TODO: should we init inodes in alloc and below?
+	ino = alloc_inode();
+	if (ino == BPFS_INO_INVALID)
+		return -ENOSPC;
+	ciid.generation = next_generation(ino);
+
+	if ((r = alloc_dirent(parent_ino, &sd)) < 0)
+		return r;
+
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_init_inode, &ciid);
+	if (r < 0)
+		return r;
+
+	r = crawl_inode(parent_ino, COMMIT_ATOMIC,
+	                callback_set_cmtime, &get_inode(ino)->mtime);
+	if (r < 0)
+		return r;
+
+	// inode's block freshly allocated for [SC]SP and inode ignored for BPFS
+	inode = get_inode(ino);
+	assert(inode);
+
+	if (S_ISDIR(mode) || S_ISLNK(mode))
+	{
+		ha_set(&inode->root.ha, 0, alloc_block());
+		if (inode->root.ha.addr == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+
+		if (S_ISDIR(mode))
+		{
+			struct bpfs_dirent *ndirent;
+
+			BPRAM_STORE(inode->nlinks, 2); // for the ".." dirent
+
+			BPRAM_STORE(inode->root.nbytes, BPFS_BLOCK_SIZE);
+
+			ndirent = (struct bpfs_dirent*) get_block(inode->root.ha.addr);
+			assert(ndirent);
+			BPRAM_STORE(ndirent->rec_len, 0);
+			// this new directory is not yet in the dcache;
+			// no need to add this free dirent to the dcache
+		}
+		else if (S_ISLNK(mode))
+		{
+			BPRAM_STORE(inode->nlinks, 1);
+
+			BPRAM_STORE(inode->root.nbytes, strlen(link) + 1);
+
+			assert(inode->root.nbytes <= BPFS_BLOCK_SIZE); // else use crawler
+			BPRAM_MEMCPY(get_block(inode->root.ha.addr), link, inode->root.nbytes);
+			STATS_BPRAM_COPY(get_block(inode->root.ha.addr),
+			                 inode->root.nbytes);
+		}
+	}
+	else
+	{
+		BPRAM_STORE(inode->nlinks, 1);
+		BPRAM_STORE(inode->root.nbytes, 0);
+		ha_set(&inode->root.ha, 0, BPFS_BLOCKNO_INVALID);
+	}
+
+	// dirent's block is freshly allocated or already copied
+	BPRAM_STORE(sd.dirent->file_type, f2b_filetype(mode));
+
+	// Set sd.dirent->ino and, if S_ISDIR, increment parent->nlinks.
+	cadd.dirent_off = sd.dirent_off;
+	cadd.ino = ino;
+	r = crawl_inode(parent_ino, COMMIT_ATOMIC, callback_addrem_dirent, &cadd);
+	if (r < 0)
+		return r;
+
+	sd.dirent = get_dirent(parent_ino, sd.dirent_off);
+	assert(sd.dirent);
+
+	mdirent_init_dirent(&mdirent, sd.dirent, sd.dirent_off);
+	r = dcache_add_dirent(parent_ino, name, &mdirent);
+	xassert(!r); // FIXME: recover from OOM
+	group_note_name(parent_ino, name);
+	notify_inval_entry(parent_ino, name, false);
+
+	*pdirent = sd.dirent;
+	return 0;
+}
+
+
+//
+// group commit
+
+// In SP and SCSP modes with group_max > 1, the operations that change the
+// file system accumulate in one transaction (a group) that commits once it
+// has group_max operations, once its window closes (the frontend calls
+// bpfs_sync() when bpfs_group_timeout() expires), or on fsync. Later
+// operations in a group reuse the blocks (SCSP: the DRAM shadows) its
+// earlier operations copied, and the group persists the superblock once.
+// In SCSP mode, an operation that shrinks a tree also commits its group:
+// SCSP_OPT_APPEND writes past a tree's end directly to BPRAM, where a later
+// operation could overwrite data that the committed tree still holds.
+// A frontend may hold each operation's reply until its group commits
+// (see bpfs_group_pending() and bpfs_notify.group_end).
+// An operation that fails after changing the file system rolls back its
+// whole group.
+// A transaction (bpfs_txn_begin()) holds its group open, with each
+// operation completing immediately, until bpfs_txn_commit().
+// A frontend may have cached what a group changed, so a rollback
+// invalidates the names and inodes that the group changed.
+
+#if COMMIT_MODE != MODE_BPFS
+// The number of operations in the uncommitted group
+static unsigned group_nops;
+// When the group's first operation completed
+static struct timeval group_start;
+// Whether the current operation has changed the file system
+static bool op_writes;
+// Whether the last operation joined the uncommitted group and
+// bpfs_group_pending() has not yet said so
+static bool op_grouped;
+// Whether the current operation has shrunk a tree (see group_note_shrink())
+static bool op_shrinks;
+// Whether a transaction is open, and whether one of its operations failed
+static bool txn_open;
+static bool txn_failed;
+// What the uncommitted group has changed, while it may roll back
+// (see group_tracks()): inodes (ino -> 1), names (struct group_name's),
+// and newly allocated inodes (inos)
+static hash_map_t *group_inos;
+static vector_t *group_names;
+static vector_t *group_new_inos;
+// The highest generation that a rolled back group gave each inode
+// (ino -> generation), so that no (ino, generation) repeats in a mount
+static hash_map_t *rolled_back_generations;
+# define GROUP_NOPS group_nops
+#else
+# define GROUP_NOPS 0
+#endif
+
+struct group_name
+{
+	uint64_t parent_ino;
+	char name[];
+};
+
+#if COMMIT_MODE != MODE_BPFS
+void group_note_write(void)
+{
+	op_writes = true;
+}
+
+#if SCSP_OPT_APPEND
+static void group_note_shrink(void)
+{
+	op_shrinks = true;
+}
+#endif
+
+// Return whether the current operation may roll back after completing
+static bool group_tracks(void)
+{
+	return txn_open || bpfs_options.group_max > 1;
+}
+
+void group_note_inode(uint64_t ino)
+{
+	if (group_tracks())
+		xcall(hash_map_insert(group_inos, u64_ptr(ino), u64_ptr(1)));
+}
+#endif
+
+static void group_note_new_inode(uint64_t ino)
+{
+#if COMMIT_MODE != MODE_BPFS
+	if (group_tracks())
+		xcall(vector_push_back(group_new_inos, u64_ptr(ino)));
+#endif
+}
+
+// Note that the name in directory parent_ino changes
+static void group_note_name(uint64_t parent_ino, const char *name)
+{
+#if COMMIT_MODE != MODE_BPFS
+	size_t name_len = strlen(name) + 1;
+	struct group_name *gname;
+
+	if (!group_tracks())
+		return;
+	gname = malloc(sizeof(*gname) + name_len);
+	xassert(gname); // FIXME: recover from OOM
+	gname->parent_ino = parent_ino;
+	memcpy(gname->name, name, name_len);
+	xcall(vector_push_back(group_names, gname));
+#endif
+}
+
+// Return the generation to give inode ino as it is allocated
+static uint64_t next_generation(uint64_t ino)
+{
+	uint64_t generation = get_inode(ino)->generation + 1;
+#if COMMIT_MODE != MODE_BPFS
+	uint64_t rolled_back = (uintptr_t)
+		hash_map_find_val(rolled_back_generations, u64_ptr(ino));
+	if (generation <= rolled_back)
+		generation = rolled_back + 1;
+#endif
+	return generation;
+}
+
+#if COMMIT_MODE != MODE_BPFS
+static void group_changes_init(void)
+{
+	xassert((group_inos = hash_map_create_ptr()));
+	xassert((group_names = vector_create()));
+	xassert((group_new_inos = vector_create()));
+	xassert((rolled_back_generations = hash_map_create_ptr()));
+}
+
+// Forget what the group changed, as it commits (if committed) or as an
+// operation outside of a group aborts
+static void group_forget_changes(bool committed)
+{
+	size_t i;
+
+	for (i = 0; i < vector_size(group_new_inos); i++)
+	{
+		uint64_t ino = (uintptr_t) vector_elt(group_new_inos, i);
+		uint64_t rolled_back = (uintptr_t)
+			hash_map_find_val(rolled_back_generations, u64_ptr(ino));
+		// Committed generations exceed those rolled back
+		if (committed && rolled_back
+		    && get_inode(ino)->generation > rolled_back)
+			(void) hash_map_erase(rolled_back_generations, u64_ptr(ino));
+	}
+	vector_clear(group_new_inos);
+	for (i = 0; i < vector_size(group_names); i++)
+		free(vector_elt(group_names, i));
+	vector_clear(group_names);
+	if (!hash_map_empty(group_inos))
+		hash_map_clear(group_inos);
+}
+
+static void group_changes_destroy(void)
+{
+	group_forget_changes(false);
+	hash_map_destroy(rolled_back_generations);
+	vector_destroy(group_new_inos);
+	vector_destroy(group_names);
+	hash_map_destroy(group_inos);
+}
+
+// Record the generations that the group gave its new inodes.
+// Call before rolling back the group.
+static void group_save_generations(void)
+{
+	size_t i;
+	for (i = 0; i < vector_size(group_new_inos); i++)
+	{
+		uint64_t ino = (uintptr_t) vector_elt(group_new_inos, i);
+		uint64_t generation = get_inode(ino)->generation;
+		uint64_t rolled_back = (uintptr_t)
+			hash_map_find_val(rolled_back_generations, u64_ptr(ino));
+		if (generation > rolled_back)
+			xcall(hash_map_insert(rolled_back_generations, u64_ptr(ino),
+			                      u64_ptr(generation)));
+	}
+}
+
+// Invalidate what the rolled back group changed
+static void group_invalidate_changes(void)
+{
+	hash_map_it2_t it = hash_map_it2_create(group_inos);
+	size_t i;
+
+	while (hash_map_it2_next(&it))
+		notify_inval_inode((uintptr_t) it.key, 0, 0);
+	for (i = 0; i < vector_size(group_names); i++)
+	{
+		struct group_name *gname = vector_elt(group_names, i);
+		notify_inval_entry(gname->parent_ino, gname->name, true);
+	}
+	group_forget_changes(false);
+}
+
+// Commit the uncommitted group
+static void group_flush(void)
+{
+#if WRITE_STATS
+	struct bpfs_stats_counts *op_stats = stats_op;
+#endif
+	unsigned nops = group_nops;
+
+	// An open transaction commits only at bpfs_txn_commit()
+	if (!group_nops || txn_open)
+		return;
+	stats_begin_op(BPFS_STATS_OP_GROUP);
+	commit_transaction();
+#if WRITE_STATS
+	stats_op = op_stats;
+#endif
+	group_nops = 0;
+	op_grouped = false;
+	group_forget_changes(true);
+	notify_group_end(nops, 0);
+}
+
+// Abort the uncommitted group, including the current operation
+static void group_rollback(void)
+{
+	unsigned nops = group_nops;
+
+	group_save_generations();
+	abort_transaction();
+	group_nops = 0;
+	op_grouped = false;
+
+	// The dcache may reflect the group's operations
+	dcache_destroy();
+	xcall(dcache_init());
+
+	group_invalidate_changes();
+	notify_group_end(nops, -EIO);
+}
+#endif
+
+bool bpfs_group_pending(void)
+{
+#if COMMIT_MODE != MODE_BPFS
+	bool pending = op_grouped;
+	op_grouped = false;
+	return pending;
+#else
+	return false;
+#endif
+}
+
+int bpfs_group_timeout(void)
+{
+#if COMMIT_MODE != MODE_BPFS
+	struct timeval now;
+	double elapsed;
+
+	if (!group_nops || txn_open)
+		return -1;
+	xsyscall(gettimeofday(&now, NULL));
+	elapsed = (now.tv_sec - group_start.tv_sec)
+	          + (now.tv_usec - group_start.tv_usec) / 1e6;
+	if (elapsed >= bpfs_options.group_window)
+		return 0;
+	return (bpfs_options.group_window - elapsed) * 1000 + 1;
+#else
+	return -1;
+#endif
+}
+
+void bpfs_sync(void)
+{
+#if COMMIT_MODE != MODE_BPFS
+	group_flush();
+#endif
+}
+
+// Complete the current operation. In group commit mode an operation that
+// changed the file system joins the uncommitted group instead of committing.
+static void bpfs_commit(void)
+{
+	BPFS_PROBE(commit, GROUP_NOPS, block_alloc.bitmap.nfree);
+
+	// Each operation also reclaims a bounded amount of orphan space
+	reclaim_orphans(false);
+
+#if COMMIT_MODE != MODE_BPFS
+	if (txn_open)
+	{
+		if (op_writes)
+		{
+			group_nops++;
+			op_writes = false;
+		}
+		return;
+	}
+	if (bpfs_options.group_max > 1 && (op_writes || group_nops))
+	{
+		if (op_writes)
+		{
+			if (!group_nops++)
+				xsyscall(gettimeofday(&group_start, NULL));
+			op_grouped = true;
+			op_writes = false;
+		}
+		if (group_nops >= bpfs_options.group_max
+		    || block_alloc.bitmap.nfree < GROUP_MIN_NFREE
+		    || op_shrinks)
+			group_flush();
+		op_shrinks = false;
+		if (!group_nops)
+			fsck_maybe_step();
+		return;
+	}
+	op_writes = false;
+	op_shrinks = false;
+	group_forget_changes(true);
+#endif
+	commit_transaction();
+	fsck_maybe_step();
+}
+
+// Undo the current operation
+static void bpfs_abort(void)
+{
+	BPFS_PROBE(abort, GROUP_NOPS);
+
+#if COMMIT_MODE != MODE_BPFS
+	if (group_nops || txn_open)
+	{
+		// Changes cannot be undone separately from the group's
+		if (op_writes)
+		{
+			op_writes = false;
+			group_rollback();
+			txn_failed = txn_open;
+		}
+		op_shrinks = false;
+		return;
+	}
+	op_writes = false;
+	op_shrinks = false;
+	group_forget_changes(false);
+#endif
+	abort_transaction();
+}
+
+
+//
+// directory compaction
+
+// Compact a directory of more than one block once its dirents span less
+// than 1/DIR_COMPACT_RATIO of it
+#define DIR_COMPACT_RATIO 4
+
+// The number of open handles for each directory (ino -> nopens).
+// Compaction moves dirents, so it waits for readers to close the directory.
+static hash_map_t *dir_nopens;
+
+static int callback_read_dir(uint64_t blockoff, char *block,
+                             unsigned off, unsigned size, unsigned valid,
+                             uint64_t crawl_start, enum commit commit,
+                             void *image, uint64_t *blockno)
+{
+	assert(!crawl_start);
+	memcpy((char*) image + blockoff * BPFS_BLOCK_SIZE + off, block + off, size);
+	return 0;
+}
+
+// End the dirents of the block containing image offset off at off.
+// Return the offset of the next block.
+static uint64_t terminate_dirents(char *image, uint64_t off)
+{
+	unsigned block_off = off % BPFS_BLOCK_SIZE;
+	if (block_off + BPFS_DIRENT_MIN_LEN <= BPFS_BLOCK_SIZE)
+		((struct bpfs_dirent*) (image + off))->rec_len = 0;
+	return off - block_off + BPFS_BLOCK_SIZE;
+}
+
+// Pack the dirents of the nbytes directory image old into new,
+// emptying new's trailing blocks. Return the packed number of bytes.
+static uint64_t pack_dirents(const char *old, char *new, uint64_t nbytes)
+{
+	uint64_t old_off, new_off = 0;
+	uint64_t packed_nbytes;
+
+	// Start from old so that blocks whose dirents do not move are unchanged
+	memcpy(new, old, nbytes);
+
+	for (old_off = 0; old_off < nbytes; old_off += BPFS_BLOCK_SIZE)
+	{
+		unsigned off = 0;
+		while (off + BPFS_DIRENT_MIN_LEN <= BPFS_BLOCK_SIZE)
+		{
+			const struct bpfs_dirent *dirent
+				= (const struct bpfs_dirent*) (old + old_off + off);
+			struct bpfs_dirent *new_dirent;
+			unsigned len;
+
+			if (!dirent->rec_len)
+				break;
+			off += dirent->rec_len;
+			if (dirent->ino == BPFS_INO_INVALID)
+				continue;
+
+			len = BPFS_DIRENT_LEN(dirent->name_len);
+			if (new_off % BPFS_BLOCK_SIZE + len > BPFS_BLOCK_SIZE)
+				new_off = terminate_dirents(new, new_off);
+			assert(new_off <= old_off + off - dirent->rec_len);
+
+			new_dirent = (struct bpfs_dirent*) (new + new_off);
+			memcpy(new_dirent, dirent, sizeof(*dirent) + dirent->name_len);
+			new_dirent->rec_len = len;
+			new_off += len;
+		}
+	}
+
+	if (!new_off || new_off % BPFS_BLOCK_SIZE)
+		new_off = terminate_dirents(new, new_off);
+	packed_nbytes = new_off;
+	for (; new_off < nbytes; new_off += BPFS_BLOCK_SIZE)
+		((struct bpfs_dirent*) (new + new_off))->rec_len = 0;
+
+	return packed_nbytes;
+}
+
+static int callback_compact_dir(uint64_t blockoff, char *block,
+                                unsigned off, unsigned size, unsigned valid,
+                                uint64_t crawl_start, enum commit commit,
+                                void *image, uint64_t *blockno)
+{
+	const char *new = (char*) image + blockoff * BPFS_BLOCK_SIZE;
+
+	assert(commit != COMMIT_NONE);
+	assert(!crawl_start && !off && size == BPFS_BLOCK_SIZE);
+
+	if (!memcmp(block, new, BPFS_BLOCK_SIZE))
+		return 0;
+
+	if (commit != COMMIT_FREE)
+	{
+		uint64_t new_blockno = cow_block_entire(*blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+		*blockno = new_blockno;
+	}
+
+	BPRAM_MEMCPY(block, new, BPFS_BLOCK_SIZE);
+	STATS_BPRAM_COPY(block, BPFS_BLOCK_SIZE);
+	return 0;
+}
+
+static int callback_truncate_dir(char *block, unsigned off,
+                                 struct bpfs_inode *inode, enum commit commit,
+                                 void *nbytes_void, uint64_t *blockno)
+{
+	uint64_t nbytes = *(uint64_t*) nbytes_void;
+	unsigned height = tree_height(NBLOCKS_FOR_NBYTES(nbytes));
+	uint64_t new_blockno = *blockno;
+	uint64_t new_blockno2;
+	int r;
+
+	assert(commit != COMMIT_NONE);
+	assert(nbytes && !(nbytes % BPFS_BLOCK_SIZE));
+	assert(nbytes < inode->root.nbytes);
+
+	// Changing the height also changes the root address
+	if (!(commit == COMMIT_FREE
+	      || (COMMIT_MODE == MODE_BPFS
+	          && commit == COMMIT_ATOMIC
+	          && height == tree_root_height(&inode->root))))
+	{
+		new_blockno = cow_block_entire(*blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+	inode = (struct bpfs_inode*) (block + off);
+
+#if SCSP_OPT_APPEND
+	group_note_shrink();
+#endif
+	truncate_block_free(&inode->root, nbytes);
+
+	BPRAM_STORE(inode->root.nbytes, nbytes);
+
+	new_blockno2 = new_blockno;
+	r = tree_change_height(&inode->root, height, COMMIT_ATOMIC, &new_blockno2);
+	if (r < 0)
+		return r;
+	assert(new_blockno == new_blockno2);
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+// Pack the dirents of directory ino and free its trailing empty blocks.
+// Set *reclaimed to the number of bytes freed.
+static int compact_dir(uint64_t ino, uint64_t *reclaimed)
+{
+	uint64_t nbytes = get_inode(ino)->root.nbytes;
+	uint64_t packed_nbytes;
+	char *old, *new = NULL;
+	int r;
+
+	assert(BPFS_S_ISDIR(get_inode(ino)->mode));
+	*reclaimed = 0;
+
+	if (nbytes <= BPFS_BLOCK_SIZE)
+		return 0;
+
+	if (!(old = malloc(nbytes)) || !(new = malloc(nbytes)))
+	{
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crawl_data(ino, 0, nbytes, COMMIT_NONE, callback_read_dir, old);
+	if (r < 0)
+		goto out;
+
+	packed_nbytes = pack_dirents(old, new, nbytes);
+	assert(packed_nbytes <= nbytes);
+	if (packed_nbytes == nbytes)
+		goto out;
+
+#if COMMIT_MODE != MODE_BPFS
+	// Keep a compaction failure from rolling back grouped operations
+	group_flush();
+#endif
+
+	// The dcache's dirent offsets are about to become stale
+	if (dcache_has_dir(ino))
+		dcache_rem_dir(ino);
+
+	// Each step leaves a consistent directory: first move the dirents out
+	// of the trailing blocks, then drop those blocks.
+	r = crawl_data(ino, 0, nbytes, COMMIT_ATOMIC, callback_compact_dir, new);
+	if (r < 0)
+		goto out;
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_truncate_dir, &packed_nbytes);
+	if (r < 0)
+		goto out;
+
+	notify_inval_inode(ino, 0, 0);
+	*reclaimed = nbytes - packed_nbytes;
+
+  out:
+	free(old);
+	free(new);
+	return r;
+}
+
+// Compact directory ino if it is sparse and no handle is reading it.
+// Call after committing the operation that freed its dirents.
+static void maybe_compact_dir(uint64_t ino)
+{
+	uint64_t nbytes, reclaimed;
+
+	// Directories not in the dcache have not lost dirents since loading
+	if (!dcache_has_dir(ino) || ino_count_get(dir_nopens, ino))
+		return;
+#if COMMIT_MODE != MODE_BPFS
+	// A failed compaction would roll back the transaction
+	if (txn_open)
+		return;
+#endif
+
+	nbytes = get_inode(ino)->root.nbytes;
+	if (nbytes <= BPFS_BLOCK_SIZE
+	    || dcache_dir_dirents_len(ino) * DIR_COMPACT_RATIO >= nbytes)
+		return;
+
+	// Compaction is only an optimization; failing to is ok
+	if (compact_dir(ino, &reclaimed) < 0)
+	{
+		bpfs_abort();
+		return;
+	}
+	Dprintf("%s(ino = %" PRIu64 "): reclaimed %" PRIu64 " bytes\n",
+	        __FUNCTION__, ino, reclaimed);
+	bpfs_commit();
+}
+
+
+//
+// operations
+
+// Start an operation, of type op
+static void begin_op(enum bpfs_stats_op op)
+{
+	stats_begin_op(op);
+	nvm_begin_op();
+#if LATENCY_STATS
+	latency_op = op;
+#endif
+#if COMMIT_MODE != MODE_BPFS
+	op_grouped = false;
+#endif
+}
+
+const char* bpfs_mode_str(void)
+{
+	static char str[64];
+	const char *mode;
+
+	if (str[0])
+		return str;
+	switch (COMMIT_MODE)
+	{
+		case MODE_SP:   mode = "SP";   break;
+		case MODE_SCSP: mode = "SCSP"; break;
+		case MODE_BPFS: mode = "BPFS"; break;
+		default: assert(0); mode = NULL;
+	}
+	snprintf(str, sizeof(str), "%s mode", mode);
+#if SCSP_OPT_APPEND
+	strcat(str, " (SCSP_OPT_APPEND)");
+#endif
+#if SCSP_OPT_TIME
+	strcat(str, " (SCSP_OPT_TIME)");
+#endif
+#if COMMIT_MODE == MODE_BPFS
+	if (atomic16)
+		strcat(str, " (16B atomic writes)");
+#endif
+	return str;
+}
+
+int bpfs_statfs(struct statvfs *stv)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_STATFS);
+
+	memset(stv, 0, sizeof(*stv));
+	stv->f_bsize = BPFS_BLOCK_SIZE;
+	stv->f_frsize = BPFS_BLOCK_SIZE;
+	static_assert(sizeof(stv->f_blocks) >= sizeof(bpfs_super->nblocks));
+	stv->f_blocks = bpfs_super->nblocks;
+	stv->f_bfree = block_alloc.bitmap.nfree;
+	stv->f_bavail = stv->f_bfree; // NOTE: no space reserved for root
+	stv->f_files = inode_alloc.bitmap.ntotal - inode_alloc.bitmap.nfree;
+	stv->f_ffree = inode_alloc.bitmap.nfree;
+	stv->f_favail = stv->f_ffree; // NOTE: no space reserved for root
+	memset(&stv->f_fsid, 0, sizeof(stv->f_fsid)); // TODO: good enough?
+	stv->f_flag = 0; // TODO: check for flags (see mount(8))
+	stv->f_namemax = BPFS_DIRENT_MAX_NAME_LEN - 1;
+
+	bpfs_commit();
+	return 0;
+}
+
+static void fill_entry(const struct bpfs_dirent *dirent, struct bpfs_entry *e)
+{
+	assert(get_inode(dirent->ino)->nlinks);
+
+	memset(e, 0, sizeof(*e));
+	e->ino = dirent->ino;
+	e->generation = get_inode(dirent->ino)->generation;
+	xcall(bpfs_stat(e->ino, &e->attr));
+}
+
+static void mfill_entry(const struct mdirent *mdirent, struct bpfs_entry *e)
+{
+	if (mdirent->ino_generation == MDIRENT_GENERATION_UNKNOWN)
+		dcache_set_dirent_generation(mdirent,
+		                             get_inode(mdirent->ino)->generation);
+
+	memset(e, 0, sizeof(*e));
+	e->ino = mdirent->ino;
+	e->generation = mdirent->ino_generation;
+	xcall(bpfs_stat(e->ino, &e->attr));
+}
+
+int bpfs_lookup(uint64_t parent_ino, const char *name, struct bpfs_entry *e)
+{
+	const struct mdirent *mdirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_LOOKUP);
+
+	r = find_dirent(parent_ino, name, &mdirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	mfill_entry(mdirent, e);
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_getattr(uint64_t ino, struct stat *stbuf)
+{
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_GETATTR);
+
+	r = bpfs_stat(ino, stbuf);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	return 0;
+}
+
+static int truncate_block_zero_leaf(uint64_t prev_blockno, uint64_t begin,
+                                    uint64_t end, uint64_t valid,
+                                    uint64_t *new_blockno)
+{
+	uint64_t blockno = prev_blockno;
+	char *block;
+
+	assert(valid <= begin);
+	assert(begin < end);
+	assert(end <= BPFS_BLOCK_SIZE);
+
+#if COMMIT_MODE != MODE_BPFS
+	blockno = cow_block(blockno, begin, end - begin, begin);
+	if (blockno == BPFS_BLOCKNO_INVALID)
+		return -ENOSPC;
+	indirect_cow_block_required(blockno);
+#endif
+	block = get_block(blockno);
+
+	BPRAM_MEMSET(block + begin, 0, end - begin);
+	STATS_ADD(zero_bytes, end - begin);
+
+	*new_blockno = blockno;
+	return 0;
+}
+
+static int truncate_block_zero_indir(uint64_t prev_blockno, uint64_t begin,
+                                     uint64_t end, uint64_t valid,
+                                     unsigned height, uint64_t max_nblocks,
+                                     uint64_t *new_blockno)
+{
+	uint64_t blockno = prev_blockno;
+	struct bpfs_indir_block *indir = (struct bpfs_indir_block*) get_block(blockno);
+	uint64_t child_max_nblocks = max_nblocks / BPFS_BLOCKNOS_PER_INDIR;
+	uint64_t child_max_nbytes = BPFS_BLOCK_SIZE * child_max_nblocks;
+	uint64_t validno = (valid + child_max_nbytes - 1) / child_max_nbytes;
+	uint64_t beginno = begin / child_max_nbytes;
+	uint64_t endno = (end + child_max_nbytes - 1) / child_max_nbytes;
+	bool begin_aligned = !(begin % child_max_nbytes);
+	uint64_t no;
+
+	assert(valid <= begin);
+	assert(begin < end);
+	assert(end <= BPFS_BLOCK_SIZE * max_nblocks);
+
+#if COMMIT_MODE != MODE_BPFS
+	{
+		unsigned indir_valid = beginno * sizeof(indir->addr[0]);
+		if (!begin_aligned)
+			indir_valid += sizeof(indir->addr[0]);
+		blockno = cow_block(blockno, 0, 0, indir_valid);
+		if (blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(blockno);
+		indir = (struct bpfs_indir_block*) get_block(blockno);
+	}
+#endif
+
+	for (no = beginno + 1; no < endno; no++)
+	{
+#if APPEASE_VALGRIND
+		BPRAM_STORE(indir->addr[no], BPFS_BLOCKNO_INVALID);
+#else
+		if (indir->addr[no] != BPFS_BLOCKNO_INVALID)
+			BPRAM_STORE(indir->addr[no], BPFS_BLOCKNO_INVALID);
+#endif
+	}
+
+	if (begin_aligned)
+		BPRAM_STORE(indir->addr[beginno], BPFS_BLOCKNO_INVALID);
+	else if (indir->addr[beginno] != BPFS_BLOCKNO_INVALID)
+	{
+		uint64_t child_begin = begin - beginno * child_max_nbytes;
+		uint64_t child_end = MIN(end - beginno * child_max_nbytes,
+		                         child_max_nbytes);
+		uint64_t child_valid;
+		uint64_t child_blockno = indir->addr[beginno];
+		int r;
+
+		if (beginno + 1 == validno)
+			child_valid = MIN(valid - beginno * child_max_nbytes,
+			                  child_max_nbytes);
+		else
+		{
+			assert(validno < beginno + 1);
+			child_valid = 0;
+		}
+
+		xcall(indirect_cow_parent_push(blockno));
+		if (height > 1)
+			r = truncate_block_zero_indir(child_blockno, child_begin,
+			                              child_end, child_valid, height - 1,
+			                              child_max_nblocks, &child_blockno);
+		else
+			r = truncate_block_zero_leaf(child_blockno, child_begin,
+			                             child_end, child_valid,
+			                             &child_blockno);
+		indirect_cow_parent_pop(blockno);
+		if (r < 0)
+			return r;
+
+		if (indir->addr[beginno] != child_blockno)
+			BPRAM_STORE(indir->addr[beginno], child_blockno);
+	}
+
+	*new_blockno = blockno;
+	return 0;
+}
+
+// Extend root to end bytes, filling root->nbytes through end with zeros
+int truncate_block_zero(struct bpfs_tree_root *root,
+                        uint64_t begin, uint64_t end, uint64_t valid,
+                        uint64_t *blockno)
+{
+	uint64_t new_blockno = *blockno;
+#if COMMIT_MODE != MODE_BPFS
+	unsigned root_off = block_offset(root);
+#endif
+	uint64_t max_nblocks = tree_max_nblocks(tree_root_height(root));
+	uint64_t max_nbytes = max_nblocks * BPFS_BLOCK_SIZE;
+	uint64_t child_blockno = tree_root_addr(root);
+
+	/* convenience. NOTE: EOF is a quasi end of file here. */
+	if (max_nbytes <= root->nbytes)
+		return 0;
+	if (end == BPFS_EOF)
+		end = max_nbytes;
+	if (valid == BPFS_EOF)
+		valid = MIN(root->nbytes, max_nbytes);
+
+	assert(valid <= begin); // not supposed to overwrite data
+	assert(begin < end);
+
+	end = MIN(end, max_nblocks * BPFS_BLOCK_SIZE);
+	if (end < begin)
+		return 0;
+
+
+	if (tree_root_addr(root) == BPFS_BLOCKNO_INVALID)
+		return 0;
+
+#if COMMIT_MODE != MODE_BPFS
+	new_blockno = cow_block_entire(*blockno);
+	if (new_blockno == BPFS_BLOCKNO_INVALID)
+		return -ENOSPC;
+	indirect_cow_block_required(new_blockno);
+	root = (struct bpfs_tree_root*) (get_block(new_blockno) + root_off);
+#endif
+
+	if (!begin)
+		child_blockno = BPFS_BLOCKNO_INVALID;
+	else
+	{
+		int r;
+		xcall(indirect_cow_parent_push(new_blockno));
+		if (!tree_root_height(root))
+			r = truncate_block_zero_leaf(child_blockno, begin, end, valid,
+			                             &child_blockno);
+		else
+			r = truncate_block_zero_indir(child_blockno, begin, end, valid,
+			                              tree_root_height(root), max_nblocks,
+			                              &child_blockno);
+		indirect_cow_parent_pop(new_blockno);
+		if (r < 0)
+			return r;
+	}
+	if (tree_root_addr(root) != child_blockno)
+		ha_set_addr(&root->ha, child_blockno);
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+static unsigned count_bits(unsigned x)
+{
+	unsigned n = 0;
+	unsigned i;
+	for (i = 0; i < sizeof(x) * 8; i++)
+		n += !!(x & (1 << i));
+	return n;
+}
+
+struct callback_setattr_data {
+	const struct stat *attr;
+	int to_set;
+};
+
+static int callback_setattr(char *block, unsigned off,
+                            struct bpfs_inode *inode, enum commit commit,
+                            void *csd_void, uint64_t *blockno)
+{
+	struct callback_setattr_data *csd = csd_void;
+	const struct stat *attr = csd->attr;
+	int to_set = csd->to_set;
+	int nonatomic
+		=   BPFS_SET_ATTR_ATIME
+		  | BPFS_SET_ATTR_MTIME
+		  | BPFS_SET_ATTR_ATIME_NOW
+		  | BPFS_SET_ATTR_MTIME_NOW
+		  ;
+	bool shrink_tree = (to_set & BPFS_SET_ATTR_SIZE)
+	                   && attr->st_size < inode->root.nbytes;
+	// Shrinking a sparse file into its tree changes both size fields
+	bool shrink_sparse = shrink_tree && inode->size > inode->root.nbytes;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+	if (!(commit == COMMIT_FREE
+	      || (SCSP_OPT_TIME && count_bits(to_set & ~nonatomic) <= 1
+	          && !shrink_tree)
+	      || (COMMIT_MODE == MODE_BPFS
+	          && commit == COMMIT_ATOMIC
+	          && (count_bits(to_set & ~nonatomic) <= 1
+	              || to_set == (BPFS_SET_ATTR_UID | BPFS_SET_ATTR_GID))
+	          && !shrink_sparse)))
+	{
+		new_blockno = cow_block_entire(*blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+	inode = (struct bpfs_inode*) (block + off);
+
+	if (to_set & BPFS_SET_ATTR_MODE)
+		BPRAM_STORE(inode->mode, f2b_mode(attr->st_mode));
+	if ((to_set & BPFS_SET_ATTR_UID) && (to_set & BPFS_SET_ATTR_GID))
+	{
+		struct bpfs_inode stage = {.uid = attr->st_uid, .gid = attr->st_gid};
+
+		static_assert(!(offsetof(struct bpfs_inode, uid) % 8));
+		static_assert(offsetof(struct bpfs_inode, uid) + sizeof(inode->uid)
+		              == offsetof(struct bpfs_inode, gid));
+		static_assert(sizeof(inode->uid) + sizeof(inode->gid) == 8);
+
+		BPRAM_MEMCPY(&inode->uid, &stage.uid, sizeof(inode->uid)+sizeof(inode->gid));
+	}
+	else if (to_set & BPFS_SET_ATTR_UID)
+		BPRAM_STORE(inode->uid, attr->st_uid);
+	else if (to_set & BPFS_SET_ATTR_GID)
+		BPRAM_STORE(inode->gid, attr->st_gid);
+	if (to_set & BPFS_SET_ATTR_SIZE && attr->st_size != inode_size(inode))
+	{
+		if (shrink_tree)
+		{
+			uint64_t new_blockno2 = new_blockno;
+			int r;
+
+#if SCSP_OPT_APPEND
+			group_note_shrink();
+#endif
+
+			// Clear a stale size first so that, if not CoWed,
+			// the file does not appear to grow
+			if (inode->size > attr->st_size)
+				BPRAM_STORE(inode->size, 0);
+
+			if (NBLOCKS_FOR_NBYTES(attr->st_size) < NBLOCKS_FOR_NBYTES(inode->root.nbytes))
+			{
+				truncate_block_free(&inode->root, attr->st_size);
+
+				BPRAM_STORE(inode->root.nbytes, attr->st_size);
+
+				r = tree_change_height(&inode->root,
+				                       tree_height(NBLOCKS_FOR_NBYTES(attr->st_size)),
+				                       COMMIT_ATOMIC, &new_blockno2);
+				if (r < 0)
+					return r;
+				assert(new_blockno == new_blockno2);
+			}
+			else
+				BPRAM_STORE(inode->root.nbytes, attr->st_size);
+		}
+		else
+		{
+			// Reads past root.nbytes return zeros, so changing the size
+			// beyond it need not touch the tree
+			BPRAM_STORE(inode->size, attr->st_size);
+		}
+	}
+	// NOTE: if add sub-second, check for BPFS_SET_ATTR_ATIME_NOW
+	if (to_set & BPFS_SET_ATTR_ATIME)
+		BPRAM_STORE(inode->atime.sec, attr->st_atime);
+	// NOTE: if add sub-second, check for BPFS_SET_ATTR_MTIME_NOW
+	if (to_set & BPFS_SET_ATTR_MTIME)
+		BPRAM_STORE(inode->mtime.sec, attr->st_mtime);
+	BPRAM_STORE(inode->ctime, BPFS_TIME_NOW());
+
+	if (to_set & BPFS_SET_ATTR_SIZE)
+		BPRAM_STORE(inode->mtime, inode->ctime);
+
+#if SCSP_OPT_TIME
+	if (to_set & (BPFS_SET_ATTR_ATIME))
+		indirect_cow_block_direct(new_blockno, block_offset(&inode->atime),
+		                          sizeof(inode->atime));
+	if (to_set & (BPFS_SET_ATTR_MTIME | BPFS_SET_ATTR_SIZE))
+		indirect_cow_block_direct(new_blockno, block_offset(&inode->mtime),
+		                          sizeof(inode->mtime));
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->ctime),
+	                          sizeof(inode->ctime));
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+int bpfs_setattr(uint64_t ino, const struct stat *attr, int to_set,
+                 struct stat *stbuf)
+{
+	static const int supported
+		=   BPFS_SET_ATTR_MODE
+		  | BPFS_SET_ATTR_UID
+		  | BPFS_SET_ATTR_GID
+		  | BPFS_SET_ATTR_SIZE
+		  | BPFS_SET_ATTR_ATIME
+		  | BPFS_SET_ATTR_MTIME
+		  | BPFS_SET_ATTR_ATIME_NOW
+		  | BPFS_SET_ATTR_MTIME_NOW
+		  ;
+	struct callback_setattr_data csd = {attr, to_set};
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ", set =", __FUNCTION__, ino);
+	if (to_set & BPFS_SET_ATTR_MODE)
+		Dprintf(" mode");
+	if (to_set & BPFS_SET_ATTR_UID)
+		Dprintf(" uid");
+	if (to_set & BPFS_SET_ATTR_GID)
+		Dprintf(" gid");
+	if (to_set & BPFS_SET_ATTR_SIZE)
+		Dprintf(" size(to %" PRId64 ")", attr->st_size);
+	if (to_set & BPFS_SET_ATTR_ATIME)
+	{
+		Dprintf(" atime");
+		if (to_set & BPFS_SET_ATTR_ATIME_NOW)
+			Dprintf("[now]");
+	}
+	if (to_set & BPFS_SET_ATTR_MTIME)
+	{
+		Dprintf(" mtime");
+		if (to_set & BPFS_SET_ATTR_MTIME_NOW)
+			Dprintf("[now]");
+	}
+	Dprintf(")\n");
+	begin_op(BPFS_STATS_OP_SETATTR);
+
+	assert(!(to_set & ~supported));
+	to_set &= supported;
+
+	assert(get_inode(ino)->nlinks);
+
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_setattr, &csd);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	bpfs_stat(ino, stbuf);
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_readlink(uint64_t ino, char *buf, size_t size)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_READLINK);
+
+	assert(BPFS_S_ISLNK(inode->mode));
+	assert(inode->root.nbytes);
+	assert(inode->root.nbytes <= BPFS_BLOCK_SIZE);
+	assert(inode->nlinks);
+
+	if (size < inode->root.nbytes)
+	{
+		bpfs_abort();
+		return -ENAMETOOLONG;
+	}
+
+	bpfs_commit();
+	// Committing a group may have moved the inode out of a DRAM shadow
+	inode = get_inode(ino);
+	memcpy(buf, get_block(tree_root_addr(&inode->root)), inode->root.nbytes);
+	return 0;
+}
+
+int bpfs_mknod(uint64_t parent_ino, const char *name, mode_t mode,
+               uid_t uid, gid_t gid, struct bpfs_entry *e)
+{
+	struct bpfs_dirent *dirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_MKNOD);
+
+	if (S_ISBLK(mode) || S_ISCHR(mode))
+	{
+		// Need to store rdev to support these two types
+		bpfs_abort();
+		return -ENOSYS;
+	}
+
+	r = create_file(parent_ino, name, mode, uid, gid, NULL, &dirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	fill_entry(dirent, e);
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_mkdir(uint64_t parent_ino, const char *name, mode_t mode,
+               uid_t uid, gid_t gid, struct bpfs_entry *e)
+{
+	struct bpfs_dirent *dirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_MKDIR);
+
+	r = create_file(parent_ino, name, mode | S_IFDIR, uid, gid, NULL, &dirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	fill_entry(dirent, e);
+	bpfs_commit();
+	return 0;
+}
+
+static int callback_set_ctime(char *block, unsigned off,
+                              struct bpfs_inode *inode, enum commit commit,
+                              void *new_time_void, uint64_t *blockno)
+{
+	struct bpfs_time *new_time = (struct bpfs_time*) new_time_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+#if !SCSP_OPT_TIME
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+#endif
+	inode = (struct bpfs_inode*) (block + off);
+
+	BPRAM_STORE(inode->ctime, *new_time);
+#if SCSP_OPT_TIME
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->ctime),
+	                          sizeof(inode->ctime));
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+static int callback_change_nlinks(char *block, unsigned off,
+                                  struct bpfs_inode *inode, enum commit commit,
+                                  void *delta_void, uint64_t *blockno)
+{
+	int nlinks_delta = *(int*) delta_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+	if (nlinks_delta > 0 && inode->nlinks > inode->nlinks + nlinks_delta)
+		return -EMLINK;
+
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+	inode = (struct bpfs_inode*) (block + off);
+
+	assert(nlinks_delta >= 0 || inode->nlinks >= -nlinks_delta);
+	BPRAM_STORE(inode->nlinks, inode->nlinks + nlinks_delta);
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+static int do_unlink_inode(uint64_t ino, struct bpfs_time time_now)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+	int nlinks_delta = -1;
+	int r;
+
+	assert(inode);
+	assert(inode->nlinks);
+	if (inode->nlinks == 1 || BPFS_S_ISDIR(inode->mode))
+	{
+		assert(!BPFS_S_ISDIR(inode->mode) || inode->nlinks == 2);
+
+#if DETECT_ZEROLINKS_WITH_LINKS
+		if (BPFS_S_ISDIR(inode->mode))
+			nlinks_delta = -2;
+		r = crawl_inode(ino, COMMIT_ATOMIC, callback_change_nlinks,
+		                &nlinks_delta);
+		if (r < 0)
+			return r;
+		assert(!get_inode(ino)->nlinks);
+#endif
+
+		// This was the last dirent for this inode. Free the inode later:
+		r = add_orphan(ino);
+		if (r < 0)
+			return r;
+		if (BPFS_S_ISDIR(inode->mode) && dcache_has_dir(ino))
+			dcache_rem_dir(ino);
+	}
+	else
+	{
+		r = crawl_inode(ino, COMMIT_ATOMIC, callback_change_nlinks,
+		                &nlinks_delta);
+		if (r < 0)
+			return r;
+
+		r = crawl_inode(ino, COMMIT_ATOMIC, callback_set_ctime, &time_now);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int do_unlink(uint64_t parent_ino, const struct mdirent *md)
+{
+	struct bpfs_time time_now = BPFS_TIME_NOW();
+	struct callback_addrem_dirent_data cadd =
+		{false, md->off, BPFS_INO_INVALID,
+		 BPFS_S_ISDIR(get_inode(md->ino)->mode)};
+	int r;
+
+	assert(get_inode(md->ino)->nlinks);
+
+	r = crawl_inode(parent_ino, COMMIT_ATOMIC, callback_addrem_dirent, &cadd);
+	if (r < 0)
+		return r;
+
+	r = crawl_inode(parent_ino, COMMIT_ATOMIC, callback_set_cmtime, &time_now);
+	if (r < 0)
+		return r;
+
+	r = do_unlink_inode(md->ino, time_now);
+	if (r < 0)
+		return r;
+
+	r = dcache_add_free(parent_ino, md->off, md->rec_len);
+	xassert(!r); // FIXME: recover from OOM
+
+	group_note_name(parent_ino, md->name);
+	r = dcache_rem_dirent(parent_ino, md->name);
+	assert(!r);
+
+	return 0;
+}
+
+int bpfs_unlink(uint64_t parent_ino, const char *name)
+{
+	const struct mdirent *mdirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_UNLINK);
+
+	r = find_dirent(parent_ino, name, &mdirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	r = do_unlink(parent_ino, mdirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	maybe_compact_dir(parent_ino);
+	return 0;
+}
+
+#ifndef NDEBUG
+static int callback_empty_dir(uint64_t blockoff, char *block,
+                              unsigned off, unsigned size, unsigned valid,
+                              uint64_t crawl_start, enum commit commit,
+                              void *ppi, uint64_t *blockno)
+{
+	uint64_t parent_ino = *(uint64_t*) ppi;
+	unsigned end = off + size;
+	while (off + BPFS_DIRENT_MIN_LEN <= end)
+	{
+		struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+		if (!dirent->rec_len)
+		{
+			// end of directory entries in this block
+			break;
+		}
+		off += dirent->rec_len;
+		assert(off <= BPFS_BLOCK_SIZE);
+		if (dirent->ino == BPFS_INO_INVALID)
+			continue;
+		if (dirent->ino == parent_ino)
+			continue;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+int bpfs_rmdir(uint64_t parent_ino, const char *name)
+{
+	const struct mdirent *mdirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_RMDIR);
+
+	r = find_dirent(parent_ino, name, &mdirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+#ifndef NDEBUG
+	r = crawl_data(mdirent->ino, 0, BPFS_EOF, COMMIT_NONE,
+	               callback_empty_dir, &parent_ino);
+	xassert(r >= 0);
+	if (r == 1)
+	{
+		bpfs_abort();
+		return -ENOTEMPTY;
+	}
+#endif
+
+	r = do_unlink(parent_ino, mdirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	maybe_compact_dir(parent_ino);
+	return 0;
+}
+
+int bpfs_symlink(const char *link, uint64_t parent_ino, const char *name,
+                 uid_t uid, gid_t gid, struct bpfs_entry *e)
+{
+	struct bpfs_dirent *dirent;
+	int r;
+
+	Dprintf("%s(link = '%s', parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, link, parent_ino, name);
+	begin_op(BPFS_STATS_OP_SYMLINK);
+
+	r = create_file(parent_ino, name, S_IFLNK | 0777, uid, gid, link, &dirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	fill_entry(dirent, e);
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_rename(uint64_t src_parent_ino, const char *src_name,
+                uint64_t dst_parent_ino, const char *dst_name)
+{
+	const struct mdirent *src_md;
+	const struct mdirent *edst_md;
+	struct mdirent ndst_md;
+	struct bpfs_dirent *dst_dirent;
+	struct bpfs_time time_now = BPFS_TIME_NOW();
+	uint64_t invalid_ino = BPFS_INO_INVALID;
+	uint64_t unlinked_ino = BPFS_INO_INVALID;
+	uint64_t dst_off;
+	bool dst_existed;
+	int r;
+
+	Dprintf("%s(src_parent_ino = %" PRIu64 ", src_name = '%s',"
+	        " dst_parent_ino = %" PRIu64 ", dst_name = '%s')\n",
+	        __FUNCTION__, src_parent_ino, src_name, dst_parent_ino, dst_name);
+	begin_op(BPFS_STATS_OP_RENAME);
+
+	r = find_dirent(src_parent_ino, src_name, &src_md);
+	if (r < 0)
+		goto abort;
+	assert(get_inode(src_md->ino)->nlinks);
+
+	r = find_dirent(dst_parent_ino, dst_name, &edst_md);
+	if (r < 0 && r != -ENOENT)
+		goto abort;
+	dst_existed = (r != -ENOENT);
+
+	if (dst_existed)
+	{
+		assert(get_inode(edst_md->ino)->nlinks);
+
+		unlinked_ino = edst_md->ino;
+		// TODO: check that types match?
+		dst_off = edst_md->off;
+	}
+	else
+	{
+		struct str_dirent dst_sd = {{dst_name, strlen(dst_name) + 1},
+		                            BPFS_EOF, NULL};
+		r = alloc_dirent(dst_parent_ino, &dst_sd);
+		if (r < 0)
+			goto abort;
+		dst_off = dst_sd.dirent_off;
+
+// TODO: enable check for MODE_SCSP (need bpram_blockno() support):
+#if COMMIT_MODE == MODE_SP
+		assert(block_freshly_alloced(bpram_blockno(dst_sd.dirent)));
+#else
+		// TODO: the assignment to dst_sd.dirent assumes that it is not
+		// yet referenced. Assert this (how?) or remove this assumption.
+#endif
+		BPRAM_STORE(dst_sd.dirent->file_type, src_md->file_type);
+	}
+
+	r = crawl_data_2(dst_parent_ino, dst_off, 1,
+	                 callback_set_dirent_ino, (void*) &src_md->ino,
+	                 src_parent_ino, src_md->off, 1,
+	                 callback_set_dirent_ino, &invalid_ino,
+	                 COMMIT_ATOMIC);
+	if (r < 0)
+		goto abort;
+	assert(get_dirent(src_parent_ino, src_md->off)->ino == BPFS_INO_INVALID);
+	assert(get_dirent(dst_parent_ino, dst_off)->ino == src_md->ino);
+	fsck_reach_inode(src_md->ino);
+
+	r = crawl_inode(dst_parent_ino, COMMIT_ATOMIC, callback_set_cmtime,
+	                &time_now);
+	if (r < 0)
+		goto abort;
+	if (dst_parent_ino != src_parent_ino)
+	{
+		r = crawl_inode(src_parent_ino, COMMIT_ATOMIC, callback_set_cmtime,
+		                &time_now);
+		if (r < 0)
+			goto abort;
+	}
+
+	if (src_md->file_type == BPFS_TYPE_DIR)
+	{
+		if (src_parent_ino != dst_parent_ino)
+		{
+			int nlinks_delta = -1;
+			r = crawl_inode(src_parent_ino, COMMIT_ATOMIC,
+			                callback_change_nlinks, &nlinks_delta);
+			if (r < 0)
+				goto abort;
+		}
+
+		if (src_parent_ino != dst_parent_ino && !dst_existed)
+		{
+			int nlinks_delta = 1;
+			r = crawl_inode(dst_parent_ino, COMMIT_ATOMIC,
+			                callback_change_nlinks, &nlinks_delta);
+			if (r < 0)
+				goto abort;
+		}
+		else if (src_parent_ino == dst_parent_ino && dst_existed)
+		{
+			int nlinks_delta = -1;
+			r = crawl_inode(dst_parent_ino, COMMIT_ATOMIC,
+			                callback_change_nlinks, &nlinks_delta);
+			if (r < 0)
+				goto abort;
+		}
+
+		// Update the child ino's ctime because rename can change its
+		// ".." dirent's ino field. We would make this field update here,
+		// but the ".." dirent is computed on the fly and not stored on disk.
+		r = crawl_inode(src_md->ino, COMMIT_ATOMIC, callback_set_ctime,
+		                &time_now);
+		if (r < 0)
+			goto abort;
+	}
+
+	if (unlinked_ino != BPFS_INO_INVALID)
+	{
+		struct bpfs_inode *unlinked_inode = get_inode(unlinked_ino);
+		bool unlinked_remains = unlinked_inode->nlinks > 1
+		                        && !BPFS_S_ISDIR(unlinked_inode->mode);
+
+		r = do_unlink_inode(unlinked_ino, time_now);
+		if (r < 0)
+			goto abort;
+		// A caching frontend cannot see the replaced inode's nlink and ctime
+		if (unlinked_remains)
+			notify_inval_inode(unlinked_ino, -1, 0);
+
+		r = dcache_rem_dirent(dst_parent_ino, dst_name);
+		assert(!r);
+	}
+
+	r = dcache_add_free(src_parent_ino, src_md->off, src_md->rec_len);
+	xassert(!r); // FIXME: recover from OOM
+	group_note_name(src_parent_ino, src_name);
+	group_note_name(dst_parent_ino, dst_name);
+	r = dcache_rem_dirent(src_parent_ino, src_name);
+	assert(!r);
+
+	dst_dirent = get_dirent(dst_parent_ino, dst_off);
+	assert(dst_dirent);
+	mdirent_init_dirent(&ndst_md, dst_dirent, dst_off);
+	r = dcache_add_dirent(dst_parent_ino, dst_name, &ndst_md);
+	xassert(!r); // FIXME: recover from OOM
+	if (!dst_existed)
+		notify_inval_entry(dst_parent_ino, dst_name, false);
+	if (ndst_md.file_type == BPFS_TYPE_DIR)
+		notify_inval_inode(ndst_md.ino, -1, 0); // for its new ctime
+
+	bpfs_commit();
+	maybe_compact_dir(src_parent_ino);
+	return 0;
+
+  abort:
+	bpfs_abort();
+	return r;
+}
+
+int bpfs_link(uint64_t ino, uint64_t parent_ino, const char *name,
+              struct bpfs_entry *e)
+{
+	size_t name_len = strlen(name) + 1;
+	struct mdirent mdirent;
+	struct str_dirent sd = {{name, name_len}, BPFS_EOF, NULL};
+	int nlinks_delta = 1;
+	struct bpfs_time time_now = BPFS_TIME_NOW();
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ", parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, ino, parent_ino, name);
+	begin_op(BPFS_STATS_OP_LINK);
+
+	if (name_len > BPFS_DIRENT_MAX_NAME_LEN)
+	{
+		r = -ENAMETOOLONG;
+		goto abort;
+	}
+
+	assert(get_inode(ino));
+	assert(!BPFS_S_ISDIR(get_inode(ino)->mode));
+	assert(get_inode(ino)->nlinks);
+	if (!(get_inode(ino)->nlinks + 1))
+	{
+		r = -EMLINK;
+		goto abort;
+	}
+
+	if (!get_inode(parent_ino))
+	{
+		r = -ENOENT;
+		goto abort;
+	}
+	assert(get_inode(parent_ino)->nlinks);
+	assert(BPFS_S_ISDIR(get_inode(parent_ino)->mode));
+
+	if (!find_dirent(parent_ino, name, NULL))
+	{
+		r = -EEXIST;
+		goto abort;
+	}
+
+	if ((r = alloc_dirent(parent_ino, &sd)) < 0)
+		goto abort;
+
+	r = crawl_inode(parent_ino, COMMIT_ATOMIC, callback_set_cmtime, &time_now);
+	if (r < 0)
+		goto abort;
+
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_change_nlinks, &nlinks_delta);
+	if (r < 0)
+		goto abort;
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_set_ctime, &time_now);
+	if (r < 0)
+		goto abort;
+
+	// dirent's block is freshly allocated or already copied
+	BPRAM_STORE(sd.dirent->file_type, f2b_filetype(get_inode(ino)->mode));
+
+	r = crawl_data(parent_ino, sd.dirent_off, 1, COMMIT_ATOMIC,
+	               callback_set_dirent_ino, &ino);
+	if (r < 0)
+		goto abort;
+	fsck_reach_inode(ino);
+	sd.dirent = get_dirent(parent_ino, sd.dirent_off);
+	assert(sd.dirent);
+
+	mdirent_init_dirent(&mdirent, sd.dirent, sd.dirent_off);
+	r = dcache_add_dirent(parent_ino, name, &mdirent);
+	xassert(!r); // FIXME: recover from OOM
+	group_note_name(parent_ino, name);
+	notify_inval_entry(parent_ino, name, false);
+
+	fill_entry(sd.dirent, e);
+	bpfs_commit();
+	return 0;
+
+  abort:
+	bpfs_abort();
+	return r;
+}
+
+int bpfs_opendir(uint64_t ino)
+{
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_OPENDIR);
+
+	assert(get_inode(ino)->nlinks);
+
+	ino_count_add(dir_nopens, ino, 1);
+
+	bpfs_commit();
+	return 0;
+}
+
+struct readdir_params
+{
+	bpfs_readdir_filler_t filler;
+	void *user;
+};
+
+static int callback_readdir(uint64_t blockoff, char *block,
+                            unsigned off, unsigned size, unsigned valid,
+                            uint64_t crawl_start, enum commit commit,
+                            void *p_void, uint64_t *blockno)
+{
+	struct readdir_params *params = (struct readdir_params*) p_void;
+	const unsigned end = off + size;
+	while (off + BPFS_DIRENT_MIN_LEN <= end)
+	{
+		struct bpfs_dirent *dirent = (struct bpfs_dirent*) (block + off);
+		int r;
+
+		assert(!(off % BPFS_DIRENT_ALIGN));
+
+		if (!dirent->rec_len)
+		{
+			// end of directory entries in this block
+			break;
+		}
+		off += dirent->rec_len;
+		assert(off <= BPFS_BLOCK_SIZE);
+		if (dirent->ino == BPFS_INO_INVALID)
+			continue;
+		assert(dirent->rec_len >= BPFS_DIRENT_LEN(dirent->name_len));
+
+		r = params->filler(params->user, dirent->name, dirent->ino,
+		                   b2f_filetype(dirent->file_type),
+		                   DIRENT_FIRST_PERSISTENT_OFFSET
+		                   + blockoff * BPFS_BLOCK_SIZE + off);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+static int callback_set_atime(char *block, unsigned off,
+                              struct bpfs_inode *inode, enum commit commit,
+                              void *new_time_void, uint64_t *blockno)
+{
+	struct bpfs_time *new_time = (struct bpfs_time*) new_time_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+#if !SCSP_OPT_TIME
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+#endif
+	inode = (struct bpfs_inode*) (block + off);
+
+	BPRAM_STORE(inode->atime, *new_time);
+#if SCSP_OPT_TIME
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->atime),
+	                          sizeof(inode->atime));
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+// FIXME: is readdir() supposed to not notice changes made after the opendir?
+int bpfs_readdir(uint64_t ino, int64_t off,
+                 bpfs_readdir_filler_t filler, void *user)
+{
+	struct bpfs_inode *inode = get_inode(ino);
+	struct readdir_params params = {filler, user};
+	struct bpfs_time time_now = BPFS_TIME_NOW();
+	int r = 0;
+
+	Dprintf("%s(ino = %" PRIu64 ", off = %" PRId64 ")\n",
+	        __FUNCTION__, ino, off);
+	begin_op(BPFS_STATS_OP_READDIR);
+
+	if (!inode)
+	{
+		r = -EINVAL;
+		goto abort;
+	}
+	assert(inode->nlinks);
+	if (!(BPFS_S_ISDIR(inode->mode)))
+	{
+		r = -ENOTDIR;
+		goto abort;
+	}
+
+	// ".." also reports ino: the parent is not tracked
+	for (; off < DIRENT_FIRST_PERSISTENT_OFFSET && !r; off++)
+	{
+		static const char* name[] = {".", ".."};
+		r = filler(user, name[off], ino, S_IFDIR, off + 1);
+	}
+
+	if (!r)
+		r = crawl_data(ino, off - DIRENT_FIRST_PERSISTENT_OFFSET, BPFS_EOF,
+		               COMMIT_NONE, callback_readdir, &params);
+	if (r < 0)
+		goto abort;
+
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_set_atime, &time_now);
+	if (r < 0)
+		goto abort;
+
+	bpfs_commit();
+	return 0;
+
+  abort:
+	bpfs_abort();
+	return r;
+}
+
+int bpfs_releasedir(uint64_t ino)
+{
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_RELEASEDIR);
+	ino_count_sub(dir_nopens, ino, 1);
+	bpfs_commit();
+	maybe_compact_dir(ino);
+	return 0;
+}
+
+static int sync_inode(uint64_t ino, int datasync)
+{
+	// TODO: flush cache lines and memory controller
+#if 0
+	printf("fsync(ino = %" PRIu64 ", datasync = %d): not yet implemented\n",
+	       ino, datasync);
+#endif
+
+	assert(get_inode(ino)->nlinks);
+
+#if COMMIT_MODE != MODE_BPFS
+	// Make ino's (and all earlier) grouped operations durable
+	group_flush();
+#endif
+
+	return 0;
+}
+
+int bpfs_fsyncdir(uint64_t ino, int datasync)
+{
+	int r;
+	Dprintf("%s(ino = %" PRIu64 ", datasync = %d)\n",
+	        __FUNCTION__, ino, datasync);
+	begin_op(BPFS_STATS_OP_FSYNCDIR);
+
+	r = sync_inode(ino, datasync);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_create(uint64_t parent_ino, const char *name, mode_t mode,
+                uid_t uid, gid_t gid, struct bpfs_entry *e)
+{
+	struct bpfs_dirent *dirent;
+	int r;
+
+	Dprintf("%s(parent_ino = %" PRIu64 ", name = '%s')\n",
+	        __FUNCTION__, parent_ino, name);
+	begin_op(BPFS_STATS_OP_CREATE);
+
+	r = create_file(parent_ino, name, mode, uid, gid, NULL, &dirent);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+
+	fill_entry(dirent, e);
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_open(uint64_t ino)
+{
+	struct bpfs_inode *inode;
+
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_OPEN);
+
+	inode = get_inode(ino);
+	if (!inode)
+	{
+		bpfs_abort();
+		return -EINVAL;
+	}
+	assert(inode->nlinks);
+	if (BPFS_S_ISDIR(inode->mode))
+	{
+		bpfs_abort();
+		return -EISDIR;
+	}
+	// TODO: should we detect EACCES?
+
+	bpfs_commit();
+	return 0;
+}
+
+static int callback_read(uint64_t blockoff, char *block,
+                         unsigned off, unsigned size, unsigned valid,
+                         uint64_t crawl_start, enum commit commit,
+                         void *iov_void, uint64_t *new_blockno)
+{
+	struct iovec *iov = iov_void;
+	iov += blockoff - crawl_start / BPFS_BLOCK_SIZE;
+	iov->iov_base = block + off;
+	iov->iov_len = size;
+	return 0;
+}
+
+int bpfs_read_iov(uint64_t ino, uint64_t off, size_t size,
+                  struct iovec **piov, int *pcount)
+{
+	static const char zero_block[BPFS_BLOCK_SIZE];
+	struct bpfs_inode *inode = get_inode(ino);
+	struct bpfs_time time_now = BPFS_TIME_NOW();
+	uint64_t first_blockoff, last_blockoff, nblocks = 0, nzeros, i;
+	uint64_t file_size, data_size = 0;
+	struct iovec *iov = NULL;
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ", off = %" PRIu64 ", size = %zu)\n",
+	        __FUNCTION__, ino, off, size);
+	begin_op(BPFS_STATS_OP_READ);
+
+	if (!inode)
+	{
+		r = -ENOENT;
+		goto abort;
+	}
+	assert(inode->nlinks);
+	assert(BPFS_S_ISREG(inode->mode));
+
+	file_size = inode_size(inode);
+	if (off >= file_size)
+	{
+		bpfs_abort();
+		*piov = NULL;
+		*pcount = 0;
+		return 0;
+	}
+
+	size = MIN(size, file_size - off);
+	// Crawl only the valid bytes; the rest read as zeros
+	if (off < inode->root.nbytes)
+	{
+		data_size = MIN(size, inode->root.nbytes - off);
+		first_blockoff = off / BPFS_BLOCK_SIZE;
+		last_blockoff = (off + data_size) ? (off + data_size - 1) / BPFS_BLOCK_SIZE : 0;
+		nblocks = last_blockoff - first_blockoff + 1;
+	}
+	nzeros = NBLOCKS_FOR_NBYTES(size - data_size);
+	iov = calloc(nblocks + nzeros, sizeof(*iov));
+	if (!iov)
+	{
+		r = -ENOMEM;
+		goto abort;
+	}
+	for (i = 0; i < nzeros; i++)
+	{
+		iov[nblocks + i].iov_base = (void*) zero_block;
+		iov[nblocks + i].iov_len = MIN(BPFS_BLOCK_SIZE,
+		                               size - data_size - i * BPFS_BLOCK_SIZE);
+	}
+
+	r = crawl_inode(ino, COMMIT_ATOMIC, callback_set_atime, &time_now);
+	if (r < 0)
+		goto abort;
+
+	bpfs_commit();
+	// The iovecs may point into SCSP DRAM shadows, which committing a
+	// group frees, so find the data only now
+	if (nblocks)
+	{
+		r = crawl_data(ino, off, data_size, COMMIT_NONE, callback_read, iov);
+		assert(r >= 0);
+	}
+	*piov = iov;
+	*pcount = nblocks + nzeros;
+	return 0;
+
+  abort:
+	bpfs_abort();
+	free(iov);
+	return r;
+}
+
+ssize_t bpfs_read(uint64_t ino, void *buf, size_t size, uint64_t off)
+{
+	struct iovec *iov;
+	size_t nbytes = 0;
+	int count, i;
+	int r;
+
+	r = bpfs_read_iov(ino, off, size, &iov, &count);
+	if (r < 0)
+		return r;
+	for (i = 0; i < count; i++)
+	{
+		memcpy((char*) buf + nbytes, iov[i].iov_base, iov[i].iov_len);
+		nbytes += iov[i].iov_len;
+	}
+	free(iov);
+	return nbytes;
+}
+
+static int callback_write(uint64_t blockoff, char *block,
+                          unsigned off, unsigned size, unsigned valid,
+                          uint64_t crawl_start, enum commit commit,
+                          void *buf, uint64_t *new_blockno)
+{
+	uint64_t buf_offset = blockoff * BPFS_BLOCK_SIZE + off - crawl_start;
+	// Write in place with one CMPXCHG16B
+	bool write16 = COMMIT_MODE == MODE_BPFS && commit == COMMIT_ATOMIC
+	               && off < valid && !can_atomic_write(off, size)
+	               && can_atomic_write16(block + off, size);
+
+	assert(commit != COMMIT_NONE);
+	if (!(commit == COMMIT_FREE
+	      || (SCSP_OPT_APPEND && off >= valid)
+	      || (COMMIT_MODE == MODE_BPFS
+	          && (commit == COMMIT_ATOMIC
+	              && (can_atomic_write(off, size) || off >= valid
+	                  || write16)))))
+	{
+		uint64_t newno = cow_block(*new_blockno, off, size, valid);
+		if (newno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(newno);
+		*new_blockno = newno;
+		block = get_block(newno);
+	}
+
+	// TODO: if can_atomic_write(), will memcpy() make just one write?
+	if (write16)
+		atomic_write16(block + off, buf + buf_offset, size);
+	else
+		BPRAM_MEMCPY(block + off, buf + buf_offset, size);
+	STATS_BPRAM_COPY(block + off, size);
+	if (SCSP_OPT_APPEND && off >= valid)
+		indirect_cow_block_direct(*new_blockno, off, size);
+
+	return 0;
+}
+
+
+static int callback_set_mtime(char *block, unsigned off,
+                              struct bpfs_inode *inode, enum commit commit,
+                              void *new_time_void, uint64_t *blockno)
+{
+	struct bpfs_time *new_time = (struct bpfs_time*) new_time_void;
+	uint64_t new_blockno = *blockno;
+
+	assert(commit != COMMIT_NONE);
+
+#if !SCSP_OPT_TIME
+	if (commit == COMMIT_COPY)
+	{
+		new_blockno = cow_block_entire(new_blockno);
+		if (new_blockno == BPFS_BLOCKNO_INVALID)
+			return -ENOSPC;
+		indirect_cow_block_required(new_blockno);
+		block = get_block(new_blockno);
+	}
+#endif
+	inode = (struct bpfs_inode*) (block + off);
+
+	BPRAM_STORE(inode->mtime, *new_time);
+#if SCSP_OPT_TIME
+	indirect_cow_block_direct(new_blockno, block_offset(&inode->mtime),
+	                          sizeof(inode->mtime));
+#endif
+
+	*blockno = new_blockno;
+	return 0;
+}
+
+ssize_t bpfs_write(uint64_t ino, const void *buf, size_t size, uint64_t off)
+{
+	// cast away const for crawl_data(), since it accepts char* (but won't
+	// modify). cast into a new variable to avoid spurious compile warning.
+	char *buf_unconst = (char*) buf;
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ", off = %" PRIu64 ", size = %zu)\n",
+	        __FUNCTION__, ino, off, size);
+	begin_op(BPFS_STATS_OP_WRITE);
+
+	assert(get_inode(ino)->nlinks);
+
+	r = crawl_data(ino, off, size, COMMIT_ATOMIC, callback_write, buf_unconst);
+	if (r >= 0)
+	{
+		struct bpfs_time time_now = BPFS_TIME_NOW();
+		r = crawl_inode(ino, COMMIT_ATOMIC, callback_set_mtime, &time_now);
+#if COMMIT_MODE == MODE_BPFS
+		assert(r >= 0);
+#endif
+	}
+
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	return size;
+}
+
+int bpfs_fsync(uint64_t ino, int datasync)
+{
+	int r;
+	Dprintf("%s(ino = %" PRIu64 ", datasync = %d)\n",
+	        __FUNCTION__, ino, datasync);
+	begin_op(BPFS_STATS_OP_FSYNC);
+
+	r = sync_inode(ino, datasync);
+	if (r < 0)
+	{
+		bpfs_abort();
+		return r;
+	}
+	bpfs_commit();
+	return 0;
+}
+
+int bpfs_compact(uint64_t ino, uint64_t *reclaimed)
+{
+	int r;
+
+	Dprintf("%s(ino = %" PRIu64 ")\n", __FUNCTION__, ino);
+	begin_op(BPFS_STATS_OP_IOCTL);
+
+	if (!BPFS_S_ISDIR(get_inode(ino)->mode))
+	{
+		r = -ENOTDIR;
+		goto abort;
+	}
+	// The caller's handle may be open
+	if (ino_count_get(dir_nopens, ino) > 1)
+	{
+		r = -EBUSY;
+		goto abort;
+	}
+#if COMMIT_MODE != MODE_BPFS
+	if (txn_open)
+	{
+		r = -EBUSY;
+		goto abort;
+	}
+#endif
+
+	r = compact_dir(ino, reclaimed);
+	if (r < 0)
+		goto abort;
+
+	bpfs_commit();
+	return 0;
+
+  abort:
+	bpfs_abort();
+	return r;
+}
+
+// Complete a transaction ioctl that returned r
+static int end_txn_op(int r)
+{
+	if (r < 0)
+		bpfs_abort();
+	else
+		bpfs_commit();
+	return r;
+}
+
+int bpfs_txn_begin(void)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_IOCTL);
+#if COMMIT_MODE == MODE_SP
+	if (txn_open)
+		return end_txn_op(-EBUSY);
+	// Earlier operations are not part of the transaction
+	group_flush();
+	txn_open = true;
+	txn_failed = false;
+	return end_txn_op(0);
+#else
+	// Operations in these modes commit in place
+	return end_txn_op(-EOPNOTSUPP);
+#endif
+}
+
+// End the open transaction, committing it if commit
+static int end_txn(bool commit)
+{
+#if COMMIT_MODE == MODE_SP
+	if (!txn_open)
+		return -EINVAL;
+	txn_open = false;
+	if (commit && !txn_failed)
+	{
+		group_flush();
+		return 0;
+	}
+	// Roll back the operations since the failure, if any
+	if (group_nops)
+		group_rollback();
+	return commit ? -EIO : 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+int bpfs_txn_commit(void)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_IOCTL);
+	return end_txn_op(end_txn(true));
+}
+
+int bpfs_txn_abort(void)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_IOCTL);
+	return end_txn_op(end_txn(false));
+}
+
+int bpfs_get_stats(struct bpfs_stats *out)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_IOCTL);
+#if WRITE_STATS
+	*out = stats;
+	bpfs_commit();
+	return 0;
+#else
+	bpfs_abort();
+	return -ENOTTY;
+#endif
+}
+
+//
+// huge page bpram
+
+// Walks through get_block() touch blocks all over BPRAM, so with base pages
+// a large file system misses the TLB on most block accesses. Huge pages
+// (bpfs_options.hugepages) map 512 blocks per TLB entry.
+
+#ifndef HUGETLBFS_MAGIC
+# define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define HUGEPAGE_SIZE_DEFAULT (2 * 1024 * 1024)
+
+// Whether bpram is mprotect()ed a block at a time, which hugetlb pages
+// do not allow
+#define DETECT_PROTECTS_BPRAM \
+	(DETECT_STRAY_ACCESSES || DETECT_NONCOW_WRITES_SP \
+	 || DETECT_NONCOW_WRITES_SCSP)
+
+// The length of the bpram mapping, a multiple of its page size
+static size_t bpram_map_size;
+
+// The default huge page size
+static size_t hugepage_size(void)
+{
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+	char line[128];
+	unsigned long kb;
+	size_t size = HUGEPAGE_SIZE_DEFAULT;
+
+	if (!meminfo)
+		return size;
+	while (fgets(line, sizeof(line), meminfo))
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+		{
+			size = kb * 1024;
+			break;
+		}
+	fclose(meminfo);
+	return size;
+}
+
+// Map size bytes of fd (anonymous memory if fd < 0) at an align-aligned
+// address, so that the mapping can use huge pages throughout
+static char* mmap_aligned(size_t size, size_t align, int flags, int fd)
+{
+	size_t len = size + align;
+	char *reserve = mmap(NULL, len, PROT_NONE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	char *addr;
+
+	if (reserve == MAP_FAILED)
+		return MAP_FAILED;
+	addr = (char*) ROUNDUP64((uintptr_t) reserve, align);
+	if (mmap(addr, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0)
+	    == MAP_FAILED)
+	{
+		xsyscall(munmap(reserve, len));
+		return MAP_FAILED;
+	}
+	if (addr > reserve)
+		xsyscall(munmap(reserve, addr - reserve));
+	if (addr + size < reserve + len)
+		xsyscall(munmap(addr + size, reserve + len - (addr + size)));
+	return addr;
+}
+
+// Set *bytes to the bytes of the mapping that contains addr that are
+// mapped with huge pages. Return false if /proc/self/smaps cannot say.
+static bool smaps_huge_bytes(const void *addr, uint64_t *bytes)
+{
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	char line[256];
+	bool in_map = false;
+	bool found = false;
+
+	*bytes = 0;
+	if (!smaps)
+		return false;
+	while (fgets(line, sizeof(line), smaps))
+	{
+		unsigned long start, end, kb;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+		{
+			if (in_map)
+				break;
+			in_map = start <= (uintptr_t) addr && (uintptr_t) addr < end;
+			found |= in_map;
+		}
+		else if (in_map
+		         && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1
+		             || sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1
+		             || sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1))
+			*bytes += kb * 1024;
+	}
+	fclose(smaps);
+	return found;
+}
+
+// Ask for transparent huge pages for [addr, addr + len)
+static void advise_thp(void *addr, size_t len, bool anonymous)
+{
+#ifdef MADV_HUGEPAGE
+	char enabled[128] = "";
+	FILE *file;
+
+	if (madvise(addr, len, MADV_HUGEPAGE) < 0)
+	{
+		printf("BPRAM: MADV_HUGEPAGE: %s; using base pages\n",
+		       strerror(errno));
+		return;
+	}
+	if (!anonymous)
+	{
+		uint64_t huge_bytes;
+
+		// File mappings obey their file system, which may ignore the
+		// advice (e.g., ext4, or tmpfs without huge=). Fault in the
+		// first page to see which it maps.
+		(void) *(volatile char*) addr;
+		if (smaps_huge_bytes(addr, &huge_bytes) && !huge_bytes)
+			printf("BPRAM: the image's file system does not map it with"
+			       " huge pages; using base pages\n");
+		return;
+	}
+	file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (file)
+	{
+		if (!fgets(enabled, sizeof(enabled), file))
+			enabled[0] = 0;
+		fclose(file);
+	}
+	if (strstr(enabled, "[never]"))
+		printf("BPRAM: transparent huge pages are disabled; using base"
+		       " pages\n");
+#else
+	printf("BPRAM: no transparent huge page support; using base pages\n");
+#endif
+}
+
+
+//
+// persistent bpram
+
+static int bpram_fd = -1;
+
+static int init_persistent_bpram(const char *filename,
+                                 enum bpfs_hugepages hugepages)
+{
+	struct stat stbuf;
+	struct statfs stfs;
+
+	assert(!bpram && !bpram_size);
+
+	bpram_fd = xsyscall(open(filename, O_RDWR));
+
+	xsyscall(fstat(bpram_fd, &stbuf));
+	bpram_size = stbuf.st_size;
+	xassert(bpram_size == stbuf.st_size);
+	bpram_map_size = bpram_size;
+
+	xsyscall(fstatfs(bpram_fd, &stfs));
+	if (stfs.f_type == HUGETLBFS_MAGIC)
+	{
+		// The file's pages are huge pages of f_bsize bytes
+#if DETECT_PROTECTS_BPRAM
+		fprintf(stderr, "BPRAM on hugetlbfs is incompatible with"
+		        " DETECT_STRAY_ACCESSES and DETECT_NONCOW_WRITES\n");
+		xsyscall(close(bpram_fd));
+		bpram_fd = -1;
+		bpram_size = bpram_map_size = 0;
+		return -EINVAL;
+#endif
+		bpram_map_size = ROUNDUP64(bpram_size, stfs.f_bsize);
+		bpram = mmap_aligned(bpram_map_size, stfs.f_bsize, MAP_SHARED,
+		                     bpram_fd);
+	}
+	else if (hugepages != BPFS_HUGEPAGES_OFF)
+	{
+		if (hugepages == BPFS_HUGEPAGES_HUGETLB)
+			printf("BPRAM: %s is not on hugetlbfs; using transparent huge"
+			       " pages\n", filename);
+		bpram = mmap_aligned(bpram_size, hugepage_size(), MAP_SHARED,
+		                     bpram_fd);
+		if (bpram != MAP_FAILED)
+			advise_thp(bpram, bpram_size, false);
+	}
+	else
+		bpram = mmap(NULL, bpram_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		             bpram_fd, 0);
+	xassert(bpram != MAP_FAILED);
+	// some code assumes block memory address are block aligned
+	xassert(!block_offset(bpram));
+	return 0;
+}
+
+static void destroy_persistent_bpram(void)
+{
+	xsyscall(msync(bpram, bpram_size, MS_SYNC));
+	xsyscall(munmap(bpram, bpram_map_size));
+	bpram = NULL;
+	bpram_size = bpram_map_size = 0;
+	xsyscall(close(bpram_fd));
+	bpram_fd = -1;
+}
+
+
+//
+// ephemeral bpram
+
+static void init_ephemeral_bpram(size_t size, enum bpfs_hugepages hugepages)
+{
+	void *bpram_void = bpram; // convert &bpram to a void** without alias warn
+	int r;
+	assert(!bpram && !bpram_size);
+
+	if (hugepages == BPFS_HUGEPAGES_OFF)
+	{
+		// some code assumes block memory address are block aligned
+		r = posix_memalign(&bpram_void, BPFS_BLOCK_SIZE, size);
+		xassert(!r); // note: posix_memalign() returns positives on error
+		bpram = bpram_void;
+		bpram_map_size = 0;
+	}
+	else
+	{
+		size_t align = hugepage_size();
+
+		bpram = MAP_FAILED;
+		bpram_map_size = ROUNDUP64(size, align);
+		if (hugepages == BPFS_HUGEPAGES_HUGETLB)
+		{
+#if DETECT_PROTECTS_BPRAM
+			printf("BPRAM: hugetlb pages are incompatible with"
+			       " DETECT_STRAY_ACCESSES and DETECT_NONCOW_WRITES;"
+			       " using transparent huge pages\n");
+#elif defined(MAP_HUGETLB)
+			bpram = mmap(NULL, bpram_map_size, PROT_READ | PROT_WRITE,
+			             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (bpram == MAP_FAILED)
+				printf("BPRAM: MAP_HUGETLB: %s; using transparent huge"
+				       " pages\n", strerror(errno));
+#else
+			printf("BPRAM: no hugetlb support; using transparent huge"
+			       " pages\n");
+#endif
+		}
+		if (bpram == MAP_FAILED)
+		{
+			bpram = mmap_aligned(bpram_map_size, align,
+			                     MAP_PRIVATE | MAP_ANONYMOUS, -1);
+			xassert(bpram != MAP_FAILED);
+			advise_thp(bpram, bpram_map_size, true);
+		}
+	}
+	bpram_size = size;
+	xcall(mkbpfs(bpram, bpram_size));
+}
+
+static void destroy_ephemeral_bpram(void)
+{
+	if (bpram_map_size)
+		xsyscall(munmap(bpram, bpram_map_size));
+	else
+		free(bpram);
+	bpram = NULL;
+	bpram_size = bpram_map_size = 0;
+}
+
+
+//
+// format upgrades
+
+// v7 inodes have uninitialized pad bytes where v8 keeps the sparse size
+static int callback_upgrade_v7(uint64_t blockoff, char *block,
+                               unsigned off, unsigned size, unsigned valid,
+                               uint64_t crawl_start, enum commit commit,
+                               void *user, uint64_t *blockno)
+{
+	unsigned end = off + size;
+
+	assert(commit == COMMIT_NONE);
+	assert(!(off % sizeof(struct bpfs_inode)));
+
+	for (; off < end; off += sizeof(struct bpfs_inode))
+	{
+		struct bpfs_inode *inode = (struct bpfs_inode*) (block + off);
+		// holes read from the crawler's read-only block of zeros
+		if (inode->pad_size || inode->size)
+		{
+			BPRAM_STORE(inode->pad_size, 0);
+			BPRAM_STORE(inode->size, 0);
+		}
+	}
+	return 0;
+}
+
+// Upgrade the file system in place. Call before any allocations.
+static int upgrade_format(void)
+{
+	struct bpfs_super *super = get_bpram_super();
+
+	if (bpfs_super->version == BPFS_STRUCT_VERSION)
+		return 0;
+
+	assert(bpfs_super->version == 7);
+	xcall(crawl_inodes(0, get_inode_root()->nbytes, COMMIT_NONE,
+	                   callback_upgrade_v7, NULL));
+
+	// The inodes are upgraded, so a crash from here on is harmless
+	BPRAM_STORE(super->version, BPFS_STRUCT_VERSION);
+	BPRAM_STORE(super[1].version, BPFS_STRUCT_VERSION);
+	BPRAM_STORE(bpfs_super->version, BPFS_STRUCT_VERSION); // SP stages a copy
+	printf("Upgraded file system from v7 to v%u\n", BPFS_STRUCT_VERSION);
+	return 0;
+}
+
+
+//
+// mount and unmount
+
+void inform_pin_of_bpram(const char *bpram_addr, size_t size)
+	__attribute__((noinline));
+
+void inform_pin_of_bpram(const char *bpram_addr, size_t size)
+{
+	// This function exists to let the Pin tool bpramcount know:
+	// 1) that bpfs has the address and size of bpram
+	// 2) the value of these two parameters
+
+	// This code exists to ensure that the compiler does not optimize
+	// away calls to this function. This syscall probably cannot be
+	// optimized away.
+	(void) getpid();
+}
+
+static void (*destroy_bpram)(void);
+
+// Mount the file system in bpram
+static int mount_bpram(const struct bpfs_options *opts)
+{
+	static bool hash_map_inited;
+	int r;
+
+	if (!hash_map_inited)
+	{
+		xassert(!hash_map_init());
+		latency_calibrate();
+		hash_map_inited = true;
+	}
+
+	if (opts)
+		bpfs_options = *opts;
+#if COMMIT_MODE == MODE_BPFS
+	if (bpfs_options.group_max > 1)
+	{
+		fprintf(stderr, "Group commit is not supported in BPFS mode\n");
+		bpfs_options.group_max = 1;
+	}
+#else
+	group_changes_init();
+#endif
+
+	set_super(get_bpram_super());
+
+	if (bpfs_super->magic != BPFS_FS_MAGIC)
+	{
+		fprintf(stderr, "Not a BPFS file system (incorrect magic)\n");
+		r = -EINVAL;
+		goto out;
+	}
+	// v7 is upgraded after recovery
+	if (bpfs_super->version != BPFS_STRUCT_VERSION && bpfs_super->version != 7)
+	{
+		fprintf(stderr, "File system formatted as v%u, but software is for v%u\n",
+		        bpfs_super->version, BPFS_STRUCT_VERSION);
+		r = -EINVAL;
+		goto out;
+	}
+	if (bpfs_super->nblocks * BPFS_BLOCK_SIZE < bpram_size)
+	{
+		fprintf(stderr, "BPRAM is smaller than the file system\n");
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (recover_superblock() < 0)
+	{
+		fprintf(stderr, "Unable to recover BPFS superblock\n");
+		r = -EIO;
+		goto out;
+	}
+
+#if COMMIT_MODE == MODE_SP
+	BPRAM_STORE(bpfs_super->commit_mode, BPFS_COMMIT_SP);
+	BPRAM_STORE(bpfs_super[1].commit_mode, BPFS_COMMIT_SP);
+	persistent_super = bpfs_super;
+	staged_super = *bpfs_super;
+	set_super(&staged_super);
+#else
+	BPRAM_STORE(bpfs_super->commit_mode, BPFS_COMMIT_SCSP);
+	BPRAM_STORE(bpfs_super[1].commit_mode, BPFS_COMMIT_SCSP);
+#endif
+
+	crawler_init();
+	detect_atomic16();
+
+#if INDIRECT_COW
+	xcall(indirect_cow_init());
+#endif
+
+	if (upgrade_format() < 0)
+	{
+		fprintf(stderr, "Unable to upgrade BPFS file system\n");
+#if INDIRECT_COW
+		indirect_cow_destroy();
+#endif
+		r = -EIO;
+		goto out;
+	}
+
+	xassert((orphans = vector_create()));
+	xassert((orphan_inos = hash_map_create_ptr()));
+	xcall(init_allocations(true));
+
+#if COMMIT_MODE == MODE_BPFS
+	// NOTE: could instead clear and set this field for each system call
+	BPRAM_STORE(bpfs_super->ephemeral_valid, 0);
+	BPRAM_STORE(bpfs_super[1].ephemeral_valid, 0);
+#endif
+
+# if COMMIT_MODE == MODE_SCSP
+	reset_indirect_cow_superblock();
+# endif
+
+	inform_pin_of_bpram(bpram, bpram_size);
+	store_stats_mount();
+
+#if DETECT_NONCOW_WRITES_SCSP
+	xsyscall(mprotect(bpram, bpram_size, PROT_READ));
+#endif
+
+#if DETECT_STRAY_ACCESSES
+	xsyscall(mprotect(bpram, bpram_size, PROT_NONE));
+	{
+		uint64_t blockno;
+		static_assert(BPFS_BLOCKNO_INVALID == 0);
+		for (blockno = 1; blockno < bpfs_super->nblocks + 1; blockno++)
+			if (block_is_alloced(blockno))
+				xsyscall(mprotect(bpram + (blockno - 1) * BPFS_BLOCK_SIZE,
+				                  BPFS_BLOCK_SIZE, PROT_INUSE_OLD));
+	}
+#endif
+
+	xcall(fsck_init(bpfs_options.fsck_budget));
+
+#if BLOCK_POISON
+	printf("Block poisoning enabled. Write counting will be incorrect.\n");
+#endif
+
+	xcall(dcache_init());
+	xassert((dir_nopens = hash_map_create_ptr()));
+	nvm_init();
+
+	stats_begin_op(BPFS_STATS_OP_OTHER);
+	bpfs_commit();
+	return 0;
+
+  out:
+#if COMMIT_MODE != MODE_BPFS
+	group_changes_destroy();
+#endif
+	destroy_bpram();
+	return r;
+}
+
+int bpfs_mount_file(const char *filename, const struct bpfs_options *opts)
+{
+	int r = init_persistent_bpram(filename,
+	                              opts ? opts->hugepages : BPFS_HUGEPAGES_OFF);
+	if (r < 0)
+		return r;
+	destroy_bpram = destroy_persistent_bpram;
+	return mount_bpram(opts);
+}
+
+int bpfs_mount_ephemeral(size_t size, const struct bpfs_options *opts)
+{
+	init_ephemeral_bpram(size, opts ? opts->hugepages : BPFS_HUGEPAGES_OFF);
+	destroy_bpram = destroy_ephemeral_bpram;
+	return mount_bpram(opts);
+}
+
+void bpfs_unmount(void)
+{
+	Dprintf("%s()\n", __FUNCTION__);
+	begin_op(BPFS_STATS_OP_OTHER);
+
+#if COMMIT_MODE != MODE_BPFS
+	// An unfinished transaction does not commit
+	if (txn_open)
+	{
+		txn_open = false;
+		if (group_nops)
+			group_rollback();
+	}
+#endif
+
+	if (!bpfs_super->ephemeral_valid)
+	{
+		BPRAM_STORE(bpfs_super->ephemeral_valid, 1);
+		indirect_cow_block_dirty(get_super_blockno(),
+		                         block_offset(&bpfs_super->ephemeral_valid),
+		                         sizeof(bpfs_super->ephemeral_valid));
+	}
+
+	bpfs_commit();
+#if COMMIT_MODE != MODE_BPFS
+	group_flush();
+#endif
+
+#if COMMIT_MODE == MODE_BPFS && WRITE_STATS
+	{
+		uint64_t cow_nbytes = 0;
+		uint64_t cow_nblocks = 0;
+		unsigned i;
+		for (i = 0; i < BPFS_STATS_NOPS; i++)
+		{
+			cow_nbytes += stats.op[i].cow_bytes;
+			cow_nblocks += stats.op[i].cow_blocks;
+		}
+		printf("CoW: %" PRIu64 " bytes in %" PRIu64 " blocks\n",
+		       cow_nbytes, cow_nblocks);
+	}
+#else
+	// MODE_SP: doesn't count superblock
+	// MODE_SCSP: current implementation can un-CoW
+	// !WRITE_STATS: not counted
+	printf("CoW: -1 bytes in -1 blocks\n");
+#endif
+
+	store_stats_unmount();
+	nvm_destroy();
+
+	hash_map_destroy(dir_nopens);
+#if COMMIT_MODE != MODE_BPFS
+	group_changes_destroy();
+#endif
+	dcache_destroy();
+	fsck_destroy();
+	destroy_orphans();
+	destroy_allocations();
+#if INDIRECT_COW
+	indirect_cow_destroy();
+#endif
+	destroy_bpram();
+}
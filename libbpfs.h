@@ -0,0 +1,223 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef LIBBPFS_H
+#define LIBBPFS_H
+
+// The BPFS file system as a library, for use without FUSE (bpfs.c is the
+// FUSE frontend). One file system may be mounted at a time.
+//
+// Each operation returns 0 (or a count) on success and a negative errno
+// on failure. An operation that fails has no effect. An operation that
+// succeeds is durable when it returns, except that with group_max > 1 it
+// may instead join a group that commits later (see bpfs_group_pending()),
+// and that the operations of a transaction commit at bpfs_txn_commit().
+// Inode numbers are those of the file system; the root is BPFS_INO_ROOT.
+
+#include "bpfs_structs.h"
+#include "bpfs_ioctl.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Commit modes (see bpfs_options.mode)
+enum bpfs_mode
+{
+	BPFS_MODE_DEFAULT, // COMMIT_MODE_DEFAULT in bpfs.h
+	BPFS_MODE_SP,      // shadow paging up to the superblock
+	BPFS_MODE_SCSP,    // shadow paging in DRAM up to one atomic BPRAM write
+	BPFS_MODE_BPFS,    // short-circuit shadow paging with in-place writes
+};
+
+// BPRAM page sizes (see bpfs_options.hugepages)
+enum bpfs_hugepages
+{
+	BPFS_HUGEPAGES_OFF,     // base pages
+	BPFS_HUGEPAGES_THP,     // transparent huge pages
+	BPFS_HUGEPAGES_HUGETLB, // hugetlb pages, else transparent huge pages
+};
+
+struct bpfs_options
+{
+	// SP and SCSP mode group commit. Commit up to group_max operations at
+	// once (1 disables), waiting up to group_window seconds for more
+	// operations (see bpfs_group_timeout()).
+	int group_max;
+	double group_window;
+	// NVM emulation (NVM_EMULATION in bpfs.h), each 0 to disable. Each
+	// persist (a commit or epoch barrier) waits nvm_write_ns for each
+	// cache line written since the previous persist, and until the lines
+	// could have been written at nvm_write_mbps MB/s. An operation's first
+	// access to each block waits nvm_read_ns.
+	unsigned nvm_write_ns;
+	unsigned nvm_write_mbps;
+	unsigned nvm_read_ns;
+	// The commit mode to mount in. A file system may be mounted in a
+	// different mode each time.
+	enum bpfs_mode mode;
+	// Online consistency checking, 0 to disable. Between operations,
+	// check the committed file system a piece at a time, spending up to
+	// fsck_budget percent of the time, and print any inconsistency found.
+	unsigned fsck_budget;
+	// Map BPRAM with huge pages, to cut TLB misses, falling back to
+	// smaller pages where they are unavailable. An image on hugetlbfs
+	// always uses its huge pages.
+	enum bpfs_hugepages hugepages;
+};
+
+#define BPFS_OPTIONS_DEFAULT \
+	{1, 0, 0, 0, 0, BPFS_MODE_DEFAULT, 0, BPFS_HUGEPAGES_OFF}
+
+// Mount the file system in the file filename
+int bpfs_mount_file(const char *filename, const struct bpfs_options *opts);
+// Mount a new file system of size bytes in DRAM
+int bpfs_mount_ephemeral(size_t size, const struct bpfs_options *opts);
+// Commit any uncommitted group (an open transaction rolls back) and unmount
+void bpfs_unmount(void);
+
+// Describe the commit mode, e.g., "SCSP mode (SCSP_OPT_APPEND)"
+const char* bpfs_mode_str(void);
+// Return the mode named name ("sp", "scsp", or "bpfs", in any case),
+// or -EINVAL
+int bpfs_mode_parse(const char *name);
+
+// Callbacks for a frontend that caches file system state, each optional
+struct bpfs_notify
+{
+	// Inode ino's attributes changed and, if off >= 0, so did its data in
+	// [off, off + len) (to EOF if len is 0), not only through the
+	// operation in progress
+	void (*inval_inode)(uint64_t ino, int64_t off, int64_t len);
+	// The entry name in directory parent_ino was created (the frontend may
+	// hold a negative entry for it) or, if rolled_back, was changed by a
+	// rolled back group (the frontend may hold any entry for it)
+	void (*inval_entry)(uint64_t parent_ino, const char *name,
+	                    bool rolled_back);
+	// The uncommitted group of nops operations committed (error is 0)
+	// or rolled back (error is -EIO)
+	void (*group_end)(unsigned nops, int error);
+};
+
+void bpfs_set_notify(const struct bpfs_notify *notify);
+
+// An inode and its attributes, as returned by the operations that
+// create or find one
+struct bpfs_entry
+{
+	uint64_t ino;
+	uint64_t generation;
+	struct stat attr;
+};
+
+// bpfs_setattr() to_set flags (the same values as FUSE_SET_ATTR_*)
+#define BPFS_SET_ATTR_MODE      (1 << 0)
+#define BPFS_SET_ATTR_UID       (1 << 1)
+#define BPFS_SET_ATTR_GID       (1 << 2)
+#define BPFS_SET_ATTR_SIZE      (1 << 3)
+#define BPFS_SET_ATTR_ATIME     (1 << 4)
+#define BPFS_SET_ATTR_MTIME     (1 << 5)
+#define BPFS_SET_ATTR_ATIME_NOW (1 << 7)
+#define BPFS_SET_ATTR_MTIME_NOW (1 << 8)
+
+// Called by bpfs_readdir() for each entry. next_off is the offset to
+// continue reading after this entry from. Return 0 to continue, 1 to
+// stop before this entry, or a negative errno to fail the readdir.
+typedef int (*bpfs_readdir_filler_t)(void *user, const char *name,
+                                     uint64_t ino, mode_t type,
+                                     int64_t next_off);
+
+int bpfs_statfs(struct statvfs *stv);
+int bpfs_lookup(uint64_t parent_ino, const char *name, struct bpfs_entry *e);
+int bpfs_getattr(uint64_t ino, struct stat *stbuf);
+int bpfs_setattr(uint64_t ino, const struct stat *attr, int to_set,
+                 struct stat *stbuf);
+// Copy the symlink ino's target, NUL terminated, into buf
+int bpfs_readlink(uint64_t ino, char *buf, size_t size);
+// Create an inode that is not a block or character device (ENOSYS)
+int bpfs_mknod(uint64_t parent_ino, const char *name, mode_t mode,
+               uid_t uid, gid_t gid, struct bpfs_entry *e);
+int bpfs_mkdir(uint64_t parent_ino, const char *name, mode_t mode,
+               uid_t uid, gid_t gid, struct bpfs_entry *e);
+int bpfs_unlink(uint64_t parent_ino, const char *name);
+int bpfs_rmdir(uint64_t parent_ino, const char *name);
+int bpfs_symlink(const char *link, uint64_t parent_ino, const char *name,
+                 uid_t uid, gid_t gid, struct bpfs_entry *e);
+int bpfs_rename(uint64_t src_parent_ino, const char *src_name,
+                uint64_t dst_parent_ino, const char *dst_name);
+int bpfs_link(uint64_t ino, uint64_t parent_ino, const char *name,
+              struct bpfs_entry *e);
+
+// Directories are compacted only while they have no open handles
+int bpfs_opendir(uint64_t ino);
+int bpfs_readdir(uint64_t ino, int64_t off,
+                 bpfs_readdir_filler_t filler, void *user);
+int bpfs_releasedir(uint64_t ino);
+int bpfs_fsyncdir(uint64_t ino, int datasync);
+
+// Create a regular file
+int bpfs_create(uint64_t parent_ino, const char *name, mode_t mode,
+                uid_t uid, gid_t gid, struct bpfs_entry *e);
+int bpfs_open(uint64_t ino);
+// Return in *piov (free() it) the *pcount iovecs that hold the data of
+// [off, off + size), without copying. The iovecs point into the file
+// system and are valid until the next operation.
+int bpfs_read_iov(uint64_t ino, uint64_t off, size_t size,
+                  struct iovec **piov, int *pcount);
+// Return the number of bytes read
+ssize_t bpfs_read(uint64_t ino, void *buf, size_t size, uint64_t off);
+// Return the number of bytes written
+ssize_t bpfs_write(uint64_t ino, const void *buf, size_t size, uint64_t off);
+int bpfs_fsync(uint64_t ino, int datasync);
+
+// The BPFS_IOC_* ioctls (see bpfs_ioctl.h). A transaction includes every
+// operation until it ends; a frontend with several clients holds the
+// operations of those that do not own it (as bpfs.c does).
+int bpfs_compact(uint64_t ino, uint64_t *reclaimed);
+int bpfs_txn_begin(void);
+int bpfs_txn_commit(void);
+int bpfs_txn_abort(void);
+int bpfs_get_stats(struct bpfs_stats *stats);
+
+// Group commit (SP and SCSP modes with group_max > 1).
+// Return whether the last operation waits for its group to commit,
+// if not already returned for it (so true at most once per operation).
+bool bpfs_group_pending(void);
+// Return the milliseconds until the uncommitted group's window closes,
+// after which the caller should bpfs_sync(), or -1 if there is no group
+// to commit
+int bpfs_group_timeout(void);
+// Commit the uncommitted group
+void bpfs_sync(void);
+
+// Latency instrumentation (LATENCY_STATS in bpfs.h). Times are in
+// timestamp counter ticks. Phases nest (a crawl includes its CoWs), so a
+// phase's time includes that of the phases within it.
+enum bpfs_latency_phase
+{
+	BPFS_LATENCY_CRAWL,  // crawl_tree() and so crawl_inode(), crawl_data()
+	BPFS_LATENCY_COW,    // cow_block(), cow_block_hole(), cow_block_entire()
+	BPFS_LATENCY_COMMIT, // committing an operation or group
+	BPFS_LATENCY_FSCK,   // online fsck steps (bpfs_options.fsck_budget)
+	BPFS_LATENCY_REPLY,  // the frontend's reply (see bpfs_latency_phase())
+	BPFS_LATENCY_NPHASES
+};
+
+// Return the current time, or 0 if not LATENCY_STATS
+uint64_t bpfs_latency_now(void);
+// Record a frontend request that began at start. It counts towards the
+// type of the last operation called since the previous request, or
+// BPFS_STATS_OP_OTHER.
+void bpfs_latency_op(uint64_t start);
+// Record a frontend phase that began at start
+void bpfs_latency_phase(enum bpfs_latency_phase phase, uint64_t start);
+// Print the latency distribution of each request type and phase.
+// Not async-signal-safe; call between operations.
+void bpfs_latency_dump(FILE *file);
+
+#endif
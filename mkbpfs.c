@@ -41,9 +41,11 @@ static char* mk_get_block(char *bpram, struct bpfs_super *super, uint64_t no)
 	return bpram + (no - 1) * BPFS_BLOCK_SIZE;
 }
 
+// The block mk_alloc_block() allocates next, less one (mkbpfs() resets it)
+static uint64_t next_blockno;
+
 static uint64_t mk_alloc_block(struct bpfs_super *super)
 {
-	static uint64_t next_blockno = BPFS_BLOCKNO_FIRST_ALLOC - 1;
 	static_assert(BPFS_BLOCKNO_INVALID == 0);
 	assert(next_blockno < super->nblocks);
 	assert(next_blockno < BPFS_MIN_NBLOCKS);
@@ -68,6 +70,7 @@ int mkbpfs(char *bpram, size_t bpram_size)
 	if (bpram_size < NBLOCKS_MODULUS * BPFS_BLOCK_SIZE)
 		return -ENOSPC;
 
+	next_blockno = BPFS_BLOCKNO_FIRST_ALLOC - 1;
 	super = (struct bpfs_super*) bpram;
 	super->version = BPFS_STRUCT_VERSION;
 	static_assert(sizeof(uuid_t) == sizeof(super->uuid));
@@ -136,6 +139,8 @@ int mkbpfs(char *bpram, size_t bpram_size)
 	root_inode->root.ha.height = 0;
 	root_inode->root.ha.addr = mk_alloc_block(super);
 	root_inode->root.nbytes = BPFS_BLOCK_SIZE;
+	root_inode->pad_size = 0;
+	root_inode->size = 0;
 	root_inode->mtime = root_inode->ctime = root_inode->atime = BPFS_TIME_NOW();
 	memset(root_inode->pad, 0, sizeof(root_inode->pad));
 
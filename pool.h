@@ -67,6 +67,7 @@
 			name##_free_pool = pool->next; \
 			free(pool); \
 		} \
+		name##_free_list = NULL; \
 	}
 
 #else
@@ -0,0 +1,44 @@
+/* This file is part of BPFS. BPFS is copyright 2009-2010 The Regents of the
+ * University of California. It is distributed under the terms of version 2
+ * of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static (USDT) probes in provider "bpfs" for perf, bpftrace, and SystemTap,
+// e.g., bpftrace -e 'usdt:./bpfs:bpfs:cow_block { @[arg3] = count(); }'.
+// An unattached probe is a nop. Without USDT_PROBES (bpfs.h) or
+// <sys/sdt.h> (systemtap-sdt-dev) probes compile to nothing.
+//
+// Probes and their arguments:
+// commit(group_nops, nfree_blocks)     bpfs_commit(): an operation completes
+// abort(group_nops)                    bpfs_abort(): an operation rolls back
+// cow_block(old, new, off, size, valid)
+// cow_block_hole(new, off, size, valid)
+// cow_block_entire(old, new)
+// alloc_block(blockno, nfree_blocks)   blockno 0 if out of space
+// free_block(blockno, nfree_blocks)
+// alloc_inode(ino)
+// find_dirent(parent_ino, name, ino, loaded)
+//                                      ino 0 on a miss; loaded if the dir
+//                                      was read into the dcache
+// indirect_cow_commit(nblocks)         SCSP: the number of CoWed blocks
+// crawl(off, size, commit, r)          crawl_tree() returns r
+// fsck_pass(npasses, nerrors)          an online fsck pass completes
+
+#include "bpfs.h"
+
+#if USDT_PROBES && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define BPFS_PROBE(name, args...) STAP_PROBEV(bpfs, name, ##args)
+# endif
+#endif
+
+#ifndef BPFS_PROBE
+// Use but do not evaluate args
+static inline int bpfs_probe_nop(int unused, ...) { return 0; }
+# define BPFS_PROBE(name, args...) ((void) sizeof(bpfs_probe_nop(0, ##args)))
+#endif
+
+#endif